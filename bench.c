@@ -0,0 +1,706 @@
+#define _GNU_SOURCE  // clock_gettime and getopt are not exposed under plain -std=c99
+#include <getopt.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include "cachesim.h"
+
+/*
+Throughput harness for libcachesim. Checks the library against the reference results,
+generates synthetic traces, then times each phase over a matrix of geometries and policies.
+*/
+
+/*
+Benchmark settings
+    BENCH_ACCESSES: Default number of records in each synthetic trace
+    BENCH_FOOTPRINT: Default bytes of address space the synthetic traces touch
+    BENCH_STRIDE: Default stride of the strided trace in bytes
+    BENCH_ZIPF: Default exponent of the zipfian trace
+    BENCH_REPEAT: Default timed runs per measurement, the fastest is reported
+    BENCH_MAX_GEOMETRIES: Most geometries -g accepts
+    BENCH_LINE_MAX: Longest line of a reference output
+*/
+#define BENCH_ACCESSES 1000000
+#define BENCH_FOOTPRINT (64UL << 20)
+#define BENCH_STRIDE 256
+#define BENCH_ZIPF 0.99
+#define BENCH_REPEAT 3
+#define BENCH_MAX_GEOMETRIES 32
+#define BENCH_LINE_MAX 256
+
+/*
+Synthetic trace patterns, in the order of pattern_names
+*/
+enum { PATTERN_SEQUENTIAL, PATTERN_STRIDED, PATTERN_RANDOM, PATTERN_ZIPFIAN, PATTERN_COUNT };
+static const char* pattern_names[] = {"sequential", "strided", "random", "zipfian"};
+
+/*
+Replacement policy names, in POLICY_* order
+*/
+static const char* policy_names[] = {"lru", "fifo", "random", "plru", "srrip", "brrip"};
+
+// Receives the fields bench_parse decodes so the loop is not optimized away
+static volatile unsigned long bench_sink;
+
+/*
+Structs:
+    - geometry: One (s, E, b) point of the matrix
+    - reference: A trace with its expected results, from traces/output or the assignment documentation
+    - trace_options: Size and locality of the synthetic traces
+*/
+typedef struct {
+    int s;  // Number of set index bits
+    int E;  // Associativity
+    int b;  // Number of block bits
+} geometry;
+
+typedef struct {
+    const char* trace;  // Trace to replay
+    const char* verbose;  // Expected -v output, NULL if only the totals are known
+    geometry g;  // Geometry the results were produced with
+    uint64_t hits;  // Expected hit count
+    uint64_t misses;  // Expected miss count
+    uint64_t evictions;  // Expected eviction count
+} reference;
+
+typedef struct {
+    long accesses;  // Records per trace
+    unsigned long footprint;  // Bytes of address space touched
+    unsigned long stride;  // Stride of the strided pattern
+    double zipf;  // Exponent of the zipfian pattern
+} trace_options;
+
+// Table 1 of the assignment documentation, plus the verbose outputs shipped in traces/output
+static const reference references[] = {
+    {"traces/trace01.dat", "traces/output/trace01out.txt", {1, 1, 1}, 9, 8, 6},
+    {"traces/trace02.dat", "traces/output/trace02out.txt", {4, 2, 4}, 4, 5, 2},
+    {"traces/trace03.dat", NULL, {2, 1, 4}, 2, 3, 1},
+    {"traces/trace04.dat", NULL, {5, 1, 5}, 265189, 21775, 21743},
+};
+
+/*
+Functions:
+    - main: Gets command line arguments, checks correctness and runs the matrix
+    - print_usage: Prints the usage of the program
+    - check_references: Replays every reference trace and compares the results
+    - check_verbose: Compares the per-access results of a trace with a reference output
+    - check_kernels: Compares the fixed-geometry LRU kernels with the generic kernels
+    - check_invalidations: Replays small traces whose results depend on lines being invalidated
+    - write_file: Writes a string to a file
+    - run_trace: Replays a trace through a fresh LRU cache and returns its counters
+    - generate_trace: Writes a synthetic trace in lackey text format
+    - parse_geometries: Parses a -g list of s:E:b triples
+    - in_list: Checks whether a comma separated list names an entry
+    - bench_parse: Times decoding a trace without simulating it
+    - bench_simulate: Times simulating a trace decoded ahead of time
+    - bench_end_to_end: Times opening, decoding and simulating a trace
+    - now: Monotonic time in seconds
+*/
+/////////////////////// Function prototypes ///////////////////////////
+void print_usage(char* argv[]);
+int check_references(void);
+int check_verbose(const reference* ref);
+int check_kernels(void);
+int check_invalidations(void);
+int write_file(const char* path, const char* text);
+int run_trace(const char* path, const geometry* g, cache_stats* stats);
+int generate_trace(const char* path, int pattern, const trace_options* opts);
+int parse_geometries(const char* spec, geometry* out);
+int in_list(const char* list, const char* name);
+double bench_parse(const char* path, long* records);
+double bench_simulate(cache_batch* batches, int nbatches, const geometry* g, int policy);
+double bench_end_to_end(const char* path, const geometry* g, int policy);
+double now(void);
+int main(int argc, char* argv[])
+{
+    int input;
+    trace_options opts = {BENCH_ACCESSES, BENCH_FOOTPRINT, BENCH_STRIDE, BENCH_ZIPF};
+    int repeat = BENCH_REPEAT;
+    int keep = 0;  // keep the generated traces
+    int check_only = 0;  // stop after the correctness check
+    const char* patterns = NULL;  // comma separated pattern names, NULL for all
+    const char* policies = NULL;  // comma separated policy names, NULL for all
+    geometry geometries[BENCH_MAX_GEOMETRIES] = {{6, 1, 6}, {10, 4, 6}, {12, 8, 6}, {8, 16, 6}};
+    int ngeometries = 4;
+
+    while ((input = getopt(argc, argv, "hckn:w:x:z:r:g:P:T:")) != -1) {
+        switch (input) {
+            case 'h':
+                print_usage(argv);
+                return 0;
+            case 'c':
+                check_only = 1;
+                break;
+            case 'k':
+                keep = 1;
+                break;
+            case 'n':
+                opts.accesses = atol(optarg);
+                break;
+            case 'w':
+                opts.footprint = strtoul(optarg, NULL, 0);
+                break;
+            case 'x':
+                opts.stride = strtoul(optarg, NULL, 0);
+                break;
+            case 'z':
+                opts.zipf = atof(optarg);
+                break;
+            case 'r':
+                repeat = atoi(optarg);
+                break;
+            case 'g':
+                ngeometries = parse_geometries(optarg, geometries);
+                if (ngeometries <= 0) {
+                    printf("Invalid geometry list: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'P':
+                policies = optarg;
+                break;
+            case 'T':
+                patterns = optarg;
+                break;
+            default:
+                print_usage(argv);
+                return 1;
+        }
+    }
+    if (opts.accesses <= 0 || opts.footprint < 64 || opts.stride == 0 || opts.zipf <= 0 || repeat < 1) {
+        print_usage(argv);
+        return 1;
+    }
+
+    // Timings are only worth reporting for a simulator that still gets the right answers
+    if (check_references() != 0 || check_kernels() != 0 || check_invalidations() != 0) {
+        printf("Reference check failed\n");
+        return 1;
+    }
+    if (check_only) {
+        return 0;
+    }
+
+    printf("%-10s %3s %5s %3s %-7s %-10s %10s %9s %8s %9s\n", "pattern", "s", "E", "b", "policy",
+           "phase", "records", "seconds", "ns/rec", "Mrec/s");
+    for (int pattern = 0; pattern < PATTERN_COUNT; pattern++) {
+        if (patterns && !in_list(patterns, pattern_names[pattern])) {
+            continue;
+        }
+        char path[64];
+        snprintf(path, sizeof(path), "bench-%s.tmp", pattern_names[pattern]);
+        if (generate_trace(path, pattern, &opts) != 0) {
+            return 1;
+        }
+
+        // Decoding does not depend on the geometry, so it is timed once per trace
+        long records = 0;
+        double best = 0;
+        for (int r = 0; r < repeat; r++) {
+            double t = bench_parse(path, &records);
+            if (t < 0) {
+                return 1;
+            }
+            best = r == 0 || t < best ? t : best;
+        }
+        printf("%-10s %3s %5s %3s %-7s %-10s %10ld %9.4f %8.2f %9.1f\n", pattern_names[pattern], "-", "-",
+               "-", "-", "parse", records, best, best * 1e9 / records, records / best / 1e6);
+
+        for (int k = 0; k < ngeometries; k++) {
+            const geometry* g = &geometries[k];
+
+            // Decode the whole trace at this block size so simulate-only excludes parsing
+            trace_reader* tracefile = trace_open(path);
+            if (!tracefile) {
+                printf("Error opening %s\n", path);
+                return 1;
+            }
+            // Each fill continues the record the previous batch could not finish, so batches
+            // are decoded into one working batch and copied out
+            cache_batch* work = cache_batch_new();
+            cache_batch* batches = NULL;
+            int nbatches = 0, cap = 0, failed = !work;
+            while (!failed && cache_batch_fill(work, tracefile, g->b) > 0) {
+                if (nbatches == cap) {
+                    cap = cap ? 2 * cap : 64;
+                    cache_batch* grown = (cache_batch*)realloc(batches, (size_t)cap * sizeof(cache_batch));
+                    if (!grown) {
+                        failed = 1;
+                        break;
+                    }
+                    batches = grown;
+                }
+                memcpy(&batches[nbatches++], work, sizeof(cache_batch));
+            }
+            trace_close(tracefile);
+            free(work);
+            if (failed) {
+                printf("Error allocating the decoded %s\n", path);
+                free(batches);
+                return 1;
+            }
+
+            for (int policy = 0; policy < POLICY_COUNT; policy++) {
+                if (policies && !in_list(policies, policy_names[policy])) {
+                    continue;
+                }
+                if (policy == POLICY_PLRU && (g->E & (g->E - 1)) != 0) {
+                    continue;
+                }
+                double sim = 0, e2e = 0;
+                for (int r = 0; r < repeat; r++) {
+                    double t = bench_simulate(batches, nbatches, g, policy);
+                    double u = bench_end_to_end(path, g, policy);
+                    if (t < 0 || u < 0) {
+                        free(batches);
+                        return 1;
+                    }
+                    sim = r == 0 || t < sim ? t : sim;
+                    e2e = r == 0 || u < e2e ? u : e2e;
+                }
+                printf("%-10s %3d %5d %3d %-7s %-10s %10ld %9.4f %8.2f %9.1f\n", pattern_names[pattern], g->s,
+                       g->E, g->b, policy_names[policy], "simulate", records, sim, sim * 1e9 / records,
+                       records / sim / 1e6);
+                printf("%-10s %3d %5d %3d %-7s %-10s %10ld %9.4f %8.2f %9.1f\n", pattern_names[pattern], g->s,
+                       g->E, g->b, policy_names[policy], "end-to-end", records, e2e, e2e * 1e9 / records,
+                       records / e2e / 1e6);
+            }
+            free(batches);
+        }
+        if (!keep) {
+            remove(path);
+        }
+    }
+    return 0;
+}
+
+void print_usage(char* argv[]) {
+    printf("Usage: %s [-hck] [-n <num>] [-w <bytes>] [-x <bytes>] [-z <alpha>] [-r <num>]\n", argv[0]);
+    printf("          [-g <s:E:b,...>] [-P <policies>] [-T <patterns>]\n");
+    printf("Options:\n");
+    printf("  -h         Print this help message.\n");
+    printf("  -c         Only check the results against the reference outputs.\n");
+    printf("  -k         Keep the generated bench-*.tmp traces.\n");
+    printf("  -n <num>   Records per synthetic trace (default %d).\n", BENCH_ACCESSES);
+    printf("  -w <bytes> Address space the traces touch (default %lu).\n", BENCH_FOOTPRINT);
+    printf("  -x <bytes> Stride of the strided trace (default %d).\n", BENCH_STRIDE);
+    printf("  -z <alpha> Exponent of the zipfian trace (default %.2f).\n", BENCH_ZIPF);
+    printf("  -r <num>   Timed runs per measurement, the fastest is reported (default %d).\n", BENCH_REPEAT);
+    printf("  -g <list>  Geometries as s:E:b, e.g. 6:1:6,10:4:6.\n");
+    printf("  -P <list>  Policies to time, e.g. lru,srrip (default all).\n");
+    printf("  -T <list>  Patterns to time: sequential, strided, random, zipfian (default all).\n");
+}
+
+double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+int check_references(void) {
+    int failed = 0;
+    for (size_t i = 0; i < sizeof(references) / sizeof(references[0]); i++) {
+        const reference* ref = &references[i];
+        const geometry* g = &ref->g;
+
+        // Totals through the same path cachesim takes
+        cache* c = makecache(g->s, g->E, g->b, POLICY_LRU, WRITE_DEFAULT);
+        trace_reader* tracefile = trace_open(ref->trace);
+        if (!c || !tracefile) {
+            printf("%s: cannot run the reference\n", ref->trace);
+            freecache(c);
+            if (tracefile) {
+                trace_close(tracefile);
+            }
+            return 1;
+        }
+        cache_stats stats = {0, 0, 0, 0, 0, 0};
+        int verbose = 0;
+        runsim(c, tracefile, &stats, &verbose);
+        trace_close(tracefile);
+        freecache(c);
+
+        int ok = stats.hits == ref->hits && stats.misses == ref->misses && stats.evictions == ref->evictions;
+        if (!ok) {
+            printf("%s (%d,%d,%d): got hits:%llu misses:%llu evictions:%llu, expected hits:%llu misses:%llu evictions:%llu\n",
+                   ref->trace, g->s, g->E, g->b, (unsigned long long)stats.hits, (unsigned long long)stats.misses,
+                   (unsigned long long)stats.evictions, (unsigned long long)ref->hits,
+                   (unsigned long long)ref->misses, (unsigned long long)ref->evictions);
+        }
+        if (ok && ref->verbose) {
+            ok = check_verbose(ref) == 0;
+        }
+        printf("check %s (%d,%d,%d): %s\n", ref->trace, g->s, g->E, g->b, ok ? "ok" : "FAILED");
+        failed |= !ok;
+    }
+    return failed;
+}
+
+int run_trace(const char* path, const geometry* g, cache_stats* stats) {
+    cache* c = makecache(g->s, g->E, g->b, POLICY_LRU, WRITE_DEFAULT);
+    trace_reader* tracefile = trace_open(path);
+    if (!c || !tracefile) {
+        printf("%s: cannot run the trace\n", path);
+        freecache(c);
+        if (tracefile) {
+            trace_close(tracefile);
+        }
+        return 1;
+    }
+    memset(stats, 0, sizeof(*stats));
+    int verbose = 0;
+    runsim(c, tracefile, stats, &verbose);
+    trace_close(tracefile);
+    freecache(c);
+    return 0;
+}
+
+int check_kernels(void) {
+    // The library picks a fixed-geometry kernel for these associativities unless
+    // CACHESIM_KERNEL=generic, which has to give the same counters on every trace
+    static const int ways[] = {2, 4, 8, 16};
+    const char* saved = getenv("CACHESIM_KERNEL");
+    char* restore = saved ? strdup(saved) : NULL;
+    int failed = 0;
+    for (size_t i = 0; i < sizeof(references) / sizeof(references[0]); i++) {
+        for (size_t k = 0; k < sizeof(ways) / sizeof(ways[0]); k++) {
+            geometry g = {2, ways[k], 4};
+            cache_stats fixed, generic;
+            unsetenv("CACHESIM_KERNEL");
+            int err = run_trace(references[i].trace, &g, &fixed);
+            setenv("CACHESIM_KERNEL", "generic", 1);
+            err |= run_trace(references[i].trace, &g, &generic);
+            int ok = !err && memcmp(&fixed, &generic, sizeof(cache_stats)) == 0;
+            if (!ok) {
+                printf("kernels %s (%d,%d,%d): fixed-geometry kernel differs from the generic kernel\n",
+                       references[i].trace, g.s, g.E, g.b);
+            }
+            failed |= !ok;
+        }
+    }
+    if (restore) {
+        setenv("CACHESIM_KERNEL", restore, 1);
+        free(restore);
+    }
+    else {
+        unsetenv("CACHESIM_KERNEL");
+    }
+    if (!failed) {
+        printf("check fixed-geometry kernels: ok\n");
+    }
+    return failed;
+}
+
+int write_file(const char* path, const char* text) {
+    FILE* out = fopen(path, "w");
+    if (!out) {
+        printf("Error opening %s\n", path);
+        return 1;
+    }
+    int ok = fputs(text, out) >= 0;
+    ok = fclose(out) == 0 && ok;
+    if (!ok) {
+        printf("Error writing %s\n", path);
+    }
+    return !ok;
+}
+
+int check_invalidations(void) {
+    // A FIFO L1 over an inclusive L2: the L2 evicts block 1 while the L1 holds {1, 2, 5}, the
+    // L1 refills the freed way with 3 and then evicts its oldest line, 2, for 6. The last
+    // load of 3 hits only if the refilled way counts as the newest line
+    static const char* fifo_config = "L1 s=0 E=3 b=4 policy=fifo\nL2 s=2 E=1 b=4 inclusion=inclusive\n";
+    static const char* fifo_trace = " L 0,1\n L 10,1\n L 20,1\n L 50,1\n L 30,1\n L 60,1\n L 30,1\n";
+    int failed = write_file("bench-hier.tmp", fifo_config) | write_file("bench-trace.tmp", fifo_trace);
+    hierarchy* h = failed ? NULL : load_hierarchy("bench-hier.tmp", POLICY_LRU, WRITE_DEFAULT);
+    trace_reader* tracefile = h ? trace_open("bench-trace.tmp") : NULL;
+    if (tracefile) {
+        runhierarchy(h, tracefile, 0);
+        trace_close(tracefile);
+        const cache_stats* l1 = hier_stats(h, "L1");
+        int ok = l1 && l1->hits == 1 && l1->misses == 6;
+        printf("check FIFO back-invalidation: %s\n", ok ? "ok" : "FAILED");
+        failed |= !ok;
+    }
+    else {
+        printf("check FIFO back-invalidation: cannot run the hierarchy\n");
+        failed = 1;
+    }
+    freehierarchy(h);
+
+    // A dirty L1 line an inclusive L2 evicts is written back on its way out: the L2 holds one
+    // block, so loading 1 after storing 0 back-invalidates the dirty 0 in the L1
+    static const char* dirty_config = "L1 s=0 E=2 b=4\nL2 s=0 E=1 b=4 inclusion=inclusive\n";
+    failed |= write_file("bench-hier.tmp", dirty_config) | write_file("bench-trace.tmp", " S 0,1\n L 10,1\n");
+    h = failed ? NULL : load_hierarchy("bench-hier.tmp", POLICY_LRU, WRITE_DEFAULT);
+    tracefile = h ? trace_open("bench-trace.tmp") : NULL;
+    if (tracefile) {
+        runhierarchy(h, tracefile, 0);
+        trace_close(tracefile);
+        const cache_stats* l1 = hier_stats(h, "L1");
+        int ok = l1 && l1->dirty_evictions == 1 && l1->bytes_written == 16;
+        printf("check dirty back-invalidation: %s\n", ok ? "ok" : "FAILED");
+        failed |= !ok;
+    }
+    else {
+        printf("check dirty back-invalidation: cannot run the hierarchy\n");
+        failed = 1;
+    }
+    freehierarchy(h);
+
+    // An inclusive L2 with 64-byte blocks over an L1 with 16-byte ones: evicting L2 block 0 for
+    // 0x40 must take both L1 pieces of it, 0x0 and the dirty 0x10, so the reloads both miss
+    static const char* split_config = "L1 s=0 E=4 b=4\nL2 s=0 E=1 b=6 inclusion=inclusive\n";
+    static const char* split_trace = " L 0,1\n S 10,1\n L 40,1\n L 0,1\n L 10,1\n";
+    failed |= write_file("bench-hier.tmp", split_config) | write_file("bench-trace.tmp", split_trace);
+    h = failed ? NULL : load_hierarchy("bench-hier.tmp", POLICY_LRU, WRITE_DEFAULT);
+    tracefile = h ? trace_open("bench-trace.tmp") : NULL;
+    if (tracefile) {
+        runhierarchy(h, tracefile, 0);
+        trace_close(tracefile);
+        const cache_stats* l1 = hier_stats(h, "L1");
+        int ok = l1 && l1->hits == 0 && l1->misses == 5 && l1->dirty_evictions == 1 && l1->bytes_written == 16;
+        printf("check back-invalidation of smaller blocks: %s\n", ok ? "ok" : "FAILED");
+        failed |= !ok;
+    }
+    else {
+        printf("check back-invalidation of smaller blocks: cannot run the hierarchy\n");
+        failed = 1;
+    }
+    freehierarchy(h);
+
+    // The same order under MESI: core 1's store takes block 1 from core 0's FIFO L1 {0, 1, 2}
+    // before core 0 loads 3, 4, 5 and then 3 again, which hits with the L1 holding {3, 4, 5}
+    static const char* core0 = " L 0,1\n L 10,1\n L 20,1\n L 30,1\n L 40,1\n L 50,1\n L 30,1\n";
+    static const char* core1 = " L 1000,1\n L 1000,1\n S 10,1\n L 1000,1\n L 1000,1\n L 1000,1\n L 1000,1\n";
+    char* cores[2] = {"bench-trace.tmp", "bench-core1.tmp"};
+    failed |= write_file(cores[0], core0) | write_file(cores[1], core1);
+    multicore* m = failed ? NULL : makemulticore(cores, 2, 0, 3, 4, 4, 4, POLICY_FIFO, INTERLEAVE_ROUND_ROBIN);
+    if (m && runmulticore(m, 1, 1) == 0) {
+        const cache_stats* l1 = multicore_stats(m, 0);
+        int ok = l1 && l1->hits == 1 && l1->misses == 6;
+        printf("check FIFO coherence invalidation: %s\n", ok ? "ok" : "FAILED");
+        failed |= !ok;
+    }
+    else {
+        printf("check FIFO coherence invalidation: cannot run the cores\n");
+        failed = 1;
+    }
+    freemulticore(m);
+    remove("bench-hier.tmp");
+    remove("bench-trace.tmp");
+    remove("bench-core1.tmp");
+    return failed;
+}
+
+int check_verbose(const reference* ref) {
+    // Each reference line is "<op> <addr>,<size> <results>"; replaying the record one block
+    // lookup per pass must give the same results in the same order
+    FILE* expected = fopen(ref->verbose, "r");
+    if (!expected) {
+        printf("Error opening %s\n", ref->verbose);
+        return 1;
+    }
+    cache* c = makecache(ref->g.s, ref->g.E, ref->g.b, POLICY_LRU, WRITE_DEFAULT);
+    if (!c) {
+        fclose(expected);
+        return 1;
+    }
+    static const char* result_names[] = {"hit", "miss", "miss eviction"};
+    cache_stats stats = {0, 0, 0, 0, 0, 0};  // cache_lookup does not count, traffic lands here
+    char line[BENCH_LINE_MAX];
+    int lineno = 0, failed = 0;
+    while (!failed && fgets(line, sizeof(line), expected)) {
+        lineno++;
+        char op;
+        unsigned long address;
+        int size, used = 0;
+        if (sscanf(line, " %c %lx,%d%n", &op, &address, &size, &used) < 3 || (op != 'L' && op != 'S' && op != 'M')) {
+            continue;  // The totals line
+        }
+        char got[BENCH_LINE_MAX] = "";
+        for (int pass = 0; pass < (op == 'M' ? 2 : 1); pass++) {
+            unsigned long evicted;
+            int result = cache_lookup(c, address, op == 'S' || pass == 1, &evicted, &stats);
+            strcat(got, pass ? " " : "");
+            strcat(got, result_names[result]);
+        }
+        // Compare ignoring the trailing space and newline of the reference
+        const char* want = line + used + strspn(line + used, " ");
+        size_t n = strcspn(want, "\r\n");
+        while (n > 0 && want[n - 1] == ' ') {
+            n--;
+        }
+        if (strlen(got) != n || strncmp(got, want, n) != 0) {
+            printf("%s:%d: got \"%s\", expected \"%.*s\"\n", ref->verbose, lineno, got, (int)n, want);
+            failed = 1;
+        }
+    }
+    fclose(expected);
+    freecache(c);
+    return failed;
+}
+
+int parse_geometries(const char* spec, geometry* out) {
+    int n = 0;
+    const char* p = spec;
+    while (*p) {
+        int s, E, b, used = 0;
+        if (n == BENCH_MAX_GEOMETRIES || sscanf(p, "%d:%d:%d%n", &s, &E, &b, &used) != 3) {
+            return -1;
+        }
+        if (s < 0 || s > 30 || E < 1 || b < 0 || b > 30) {
+            return -1;
+        }
+        out[n].s = s;
+        out[n].E = E;
+        out[n].b = b;
+        n++;
+        p += used;
+        if (*p == ',') {
+            p++;
+        }
+        else if (*p) {
+            return -1;
+        }
+    }
+    return n;
+}
+
+int in_list(const char* list, const char* name) {
+    size_t n = strlen(name);
+    for (const char* p = list; *p; p += strcspn(p, ",") + (p[strcspn(p, ",")] == ',')) {
+        if (strcspn(p, ",") == n && strncmp(p, name, n) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// xorshift64*, deterministic so every run times the same trace
+static uint64_t next_random(uint64_t* state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1DULL;
+}
+
+int generate_trace(const char* path, int pattern, const trace_options* opts) {
+    FILE* out = fopen(path, "w");
+    if (!out) {
+        printf("Error creating %s\n", path);
+        return 1;
+    }
+    static char buf[1 << 20];
+    setvbuf(out, buf, _IOFBF, sizeof(buf));
+
+    // Addresses stay 8-byte aligned inside the footprint, starting at a lackey-like heap base
+    const unsigned long base = 0x4000000;
+    unsigned long words = opts->footprint / 8;
+    unsigned long blocks = opts->footprint / 64;
+    uint64_t state = 0x9E3779B97F4A7C15ULL + (uint64_t)pattern;
+
+    // Zipfian ranks come from the inverse of the continuous approximation of the CDF,
+    // then are scattered over the footprint so the popular blocks do not share sets
+    double alpha = opts->zipf;
+    double hmax = alpha == 1.0 ? log((double)blocks + 1) : (pow((double)blocks + 1, 1 - alpha) - 1) / (1 - alpha);
+
+    unsigned long cursor = 0;
+    for (long i = 0; i < opts->accesses; i++) {
+        unsigned long offset;
+        uint64_t r = next_random(&state);
+        switch (pattern) {
+            case PATTERN_SEQUENTIAL:
+                offset = (cursor++ % words) * 8;
+                break;
+            case PATTERN_STRIDED:
+                offset = (cursor * opts->stride) % opts->footprint & ~7UL;
+                cursor++;
+                break;
+            case PATTERN_RANDOM:
+                offset = (r % words) * 8;
+                break;
+            default: {
+                double u = (double)(r >> 11) * (1.0 / 9007199254740992.0) * hmax;
+                double x = alpha == 1.0 ? exp(u) - 1 : pow(u * (1 - alpha) + 1, 1 / (1 - alpha)) - 1;
+                unsigned long rank = (unsigned long)x < blocks ? (unsigned long)x : blocks - 1;
+                unsigned long block = (rank * 0x9E3779B97F4A7C15ULL) % blocks;
+                offset = block * 64 + ((r >> 3) & 7) * 8;
+                break;
+            }
+        }
+        // About 70% loads, 20% stores and 10% modifies, 4 or 8 bytes each
+        unsigned kind = (unsigned)(r >> 56) % 10;
+        char op = kind < 7 ? 'L' : kind < 9 ? 'S' : 'M';
+        fprintf(out, " %c %lx,%d\n", op, base + offset, (r >> 48) & 1 ? 8 : 4);
+    }
+    if (fclose(out) != 0) {
+        printf("Error writing %s\n", path);
+        return 1;
+    }
+    return 0;
+}
+
+double bench_parse(const char* path, long* records) {
+    trace_reader* tracefile = trace_open(path);
+    if (!tracefile) {
+        printf("Error opening %s\n", path);
+        return -1;
+    }
+    double start = now();
+    char op;
+    unsigned long address;
+    int size;
+    long n = 0;
+    unsigned long sum = 0;  // keeps the decoded fields live
+    while (trace_next(tracefile, &op, &address, &size) > 0) {
+        sum += address + (unsigned long)size + (unsigned long)op;
+        n++;
+    }
+    double t = now() - start;
+    trace_close(tracefile);
+    bench_sink = sum;
+    *records = n;
+    return t;
+}
+
+double bench_simulate(cache_batch* batches, int nbatches, const geometry* g, int policy) {
+    cache* c = makecache(g->s, g->E, g->b, policy, WRITE_DEFAULT);
+    if (!c) {
+        printf("Error creating cache (%d,%d,%d)\n", g->s, g->E, g->b);
+        return -1;
+    }
+    cache_stats stats = {0, 0, 0, 0, 0, 0};
+    double start = now();
+    for (int i = 0; i < nbatches; i++) {
+        // Indexing depends on the geometry, so it is part of the simulation
+        cache_batch_index(c, &batches[i]);
+        cache_access_batch(c, &batches[i], &stats);
+    }
+    double t = now() - start;
+    freecache(c);
+    return t;
+}
+
+double bench_end_to_end(const char* path, const geometry* g, int policy) {
+    double start = now();
+    cache* c = makecache(g->s, g->E, g->b, policy, WRITE_DEFAULT);
+    trace_reader* tracefile = trace_open(path);
+    if (!c || !tracefile) {
+        printf("Error running %s on (%d,%d,%d)\n", path, g->s, g->E, g->b);
+        freecache(c);
+        if (tracefile) {
+            trace_close(tracefile);
+        }
+        return -1;
+    }
+    cache_stats stats = {0, 0, 0, 0, 0, 0};
+    int verbose = 0;
+    runsim(c, tracefile, &stats, &verbose);
+    trace_close(tracefile);
+    freecache(c);
+    return now() - start;
+}
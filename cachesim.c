@@ -1,74 +1,109 @@
 #include <getopt.h>
 #include <stdlib.h>
-#include <unistd.h>
 #include <stdio.h>
-#include <math.h>
-#include <errno.h>
+#include <string.h>
+#include "cachesim.h"
 
 /*
-Global variables
-    ADDRESS_LENGTH: Length of memory address in bits
-*/
-#define ADDRESS_LENGTH 64  // 64-bit memory addressing
-
-/*
-Structs:
-    - line: Defines a cache line
-    - set: Defines a cache set as an array of cache lines
-    - cache: Defines a cache as an array of cache sets and settings
-*/
-typedef struct {
-    int valid;  // Valid bit
-    unsigned long tag;  // Tag bits
-    int lru;  // Least recently Used (LRU) bit
-} line;
- 
-typedef struct {
-    line* lines;  // Array of cache lines
-} set;
+Command line front end of libcachesim: parses the options, then hands the trace to the
+library's simulation, sweep, stack distance, hierarchy or batch mode.
 
-typedef struct {
-    set* sets;  // Array of cache sets
-    int s;  // Number of set index bits
-    int E;  // Associativity (number of lines per set)
-    int b;  // Number of block bits
-    int S;  // Number of sets
-} cache;
-
-/*
 Functions:
     - main: Gets command line argument and runs simulation
-    - print_summary: Prints the summary of the cache simulation
     - print_usage: Prints the usage of the program
-    - makecache: Initializes cache structure
-    - freecache: Frees memory allocated for cache
-    - runsim: Reads from file and performs operations to run simulation
-    - access_cache: Accesses the cache and checks for hit or miss
-    - lru_update: Updates cache based on LRU policy
-    - find_lru: Finds the least recently used line in a set
 */
 /////////////////////// Function prototypes ///////////////////////////
-void print_summary(int hits, int misses, int evictions);
 void print_usage(char* argv[]);
-cache* makecache(int s, int E, int b);
-void runsim(cache* c, FILE* tracefile, int* hits, int* misses, int* evictions, int* verbose);
-void access_cache(cache* c, long unsigned int* address, int* hit, int* miss, int* evictions, int* verbose);
-void lru_update(cache* c, set* inset, line* line);
-int find_lru(cache* c, set* inset);
-void freecache(cache* c);
 int main(int argc, char* argv[])
 {
 	// Define variables
     int input; // getopt returns int for some reason
     int h = 0; // help flag that prints usage info
     int v = 0; // verbose flag that prints trace info
-    int s = 0; // number of set index bits (S = 2^s is the number of sets)
+    int s = -1; // number of set index bits (S = 2^s is the number of sets)
     int E = 0; // Associativity (number of lines per set)
-    int b = 0; // number of block bits (B = 2^b is the block size)
+    int b = -1; // number of block bits (B = 2^b is the block size)
     char* t = NULL; // name of the valgrind trace to replay
+    int p = POLICY_LRU; // replacement policy
+    int w = WRITE_DEFAULT; // write policy flags
+    int p_given = 0; // 1 once -p chose the replacement policy
+    int w_given = 0; // write policy flags -W and -A chose
+    char* sweep = NULL; // -S sweep specification
+    int M = 0; // largest associativity for the -M stack distance curve
+    int j = 1; // number of worker threads
+    char* H = NULL; // -H cache hierarchy config
+    char* set_stats = NULL; // --set-stats output, NULL when per-set counters are off
+    int profile = 0; // --profile level: 1 times each phase, 2 also reads hardware counters
+    int sample_sets = 1; // --sample-sets ratio, 1 simulates every set
+    time_sampling sample_time = {0, 0, 0}; // --sample-time windows, window 0 when off
+    char* cores[MC_MAX_CORES]; // --cores traces, one per simulated core
+    int ncores = 0; // number of --cores traces, 0 outside multicore mode
+    int llc_s = -1, llc_E = 0; // --llc geometry of the shared cache
+    int interleave = INTERLEAVE_ROUND_ROBIN; // --interleave order of the cores' accesses
+    int quantum = MC_QUANTUM; // --quantum accesses each core runs between shared-level syncs
+    char* save_state = NULL; // --save-state snapshot written after the run
+    char* load_state = NULL; // --load-state snapshot the cache and counters start from
+    stream_config stream = {0, 0, STREAM_CSV, stdout}; // --interval reports, none when both limits are 0
+    char* interval_out = NULL; // --interval-out file for the interval lines, stdout when NULL
+    int prefetch = PREFETCH_NONE; // --prefetch prefetcher in front of the cache
+    int prefetch_degree = 2; // --prefetch-degree blocks requested per trigger
+    int prefetch_latency = 0; // --prefetch-latency demand accesses a prefetch takes to arrive
+    int classify = 0; // --classify flag that splits misses into compulsory, capacity and conflict
+    int victim = 0; // --victim lines of the victim cache behind the cache, 0 for none
+    char* batch = NULL; // --batch manifest of trace and configuration jobs
+    int batch_format = BATCH_CSV; // --batch-format of the result table
+    char* batch_out = "-"; // --batch-out file for the result table, - for stdout
+    char* regions = NULL; // --regions map of labelled address ranges
+    char* region_include = NULL; // --region-include labels whose accesses are simulated, NULL for all
+    char* region_exclude = NULL; // --region-exclude labels whose accesses are skipped
+    int shard = 0, shards = 0; // --shard k/N, shards 0 simulates every set
+    char* shard_out = NULL; // --shard-out file for the shard's mergeable results
+    int merge = 0; // --merge flag that adds up shard files given as positional arguments
+
+    int convert = 0; // --convert flag that rewrites a trace in binary form
+
+    // Long options, their codes start past every short option character
+    enum { OPT_CONVERT = 256, OPT_SET_STATS, OPT_PROFILE, OPT_SAMPLE_SETS, OPT_SAMPLE_TIME, OPT_CORES, OPT_LLC, OPT_INTERLEAVE,
+           OPT_QUANTUM, OPT_SAVE_STATE, OPT_LOAD_STATE,
+           OPT_INTERVAL, OPT_INTERVAL_TIME, OPT_INTERVAL_FORMAT, OPT_INTERVAL_OUT,
+           OPT_PREFETCH, OPT_PREFETCH_DEGREE, OPT_PREFETCH_LATENCY, OPT_CLASSIFY,
+           OPT_VICTIM, OPT_BATCH, OPT_BATCH_FORMAT, OPT_BATCH_OUT,
+           OPT_REGIONS, OPT_REGION_INCLUDE, OPT_REGION_EXCLUDE, OPT_SHARD, OPT_SHARD_OUT, OPT_MERGE };
+    static const struct option long_options[] = {
+        {"convert", no_argument, NULL, OPT_CONVERT},
+        {"set-stats", required_argument, NULL, OPT_SET_STATS},
+        {"profile", optional_argument, NULL, OPT_PROFILE},
+        {"sample-sets", required_argument, NULL, OPT_SAMPLE_SETS},
+        {"sample-time", required_argument, NULL, OPT_SAMPLE_TIME},
+        {"cores", required_argument, NULL, OPT_CORES},
+        {"llc", required_argument, NULL, OPT_LLC},
+        {"interleave", required_argument, NULL, OPT_INTERLEAVE},
+        {"quantum", required_argument, NULL, OPT_QUANTUM},
+        {"save-state", required_argument, NULL, OPT_SAVE_STATE},
+        {"load-state", required_argument, NULL, OPT_LOAD_STATE},
+        {"interval", required_argument, NULL, OPT_INTERVAL},
+        {"interval-time", required_argument, NULL, OPT_INTERVAL_TIME},
+        {"interval-format", required_argument, NULL, OPT_INTERVAL_FORMAT},
+        {"interval-out", required_argument, NULL, OPT_INTERVAL_OUT},
+        {"prefetch", required_argument, NULL, OPT_PREFETCH},
+        {"prefetch-degree", required_argument, NULL, OPT_PREFETCH_DEGREE},
+        {"prefetch-latency", required_argument, NULL, OPT_PREFETCH_LATENCY},
+        {"classify", no_argument, NULL, OPT_CLASSIFY},
+        {"victim", required_argument, NULL, OPT_VICTIM},
+        {"batch", required_argument, NULL, OPT_BATCH},
+        {"batch-format", required_argument, NULL, OPT_BATCH_FORMAT},
+        {"batch-out", required_argument, NULL, OPT_BATCH_OUT},
+        {"regions", required_argument, NULL, OPT_REGIONS},
+        {"region-include", required_argument, NULL, OPT_REGION_INCLUDE},
+        {"region-exclude", required_argument, NULL, OPT_REGION_EXCLUDE},
+        {"shard", required_argument, NULL, OPT_SHARD},
+        {"shard-out", required_argument, NULL, OPT_SHARD_OUT},
+        {"merge", no_argument, NULL, OPT_MERGE},
+        {NULL, 0, NULL, 0}
+    };
 
     // Parse command line arguments
-    while ((input = getopt(argc, argv, "hvs:E:b:t:")) != -1) {
+    while ((input = getopt_long(argc, argv, "hvs:E:b:t:p:W:A:S:M:j:H:", long_options, NULL)) != -1) {
         switch (input) {
             case 'h':
                 h = 1;  // Set help flag
@@ -88,33 +123,499 @@ int main(int argc, char* argv[])
             case 't':
                 t = optarg;  // Set name of valgrind trace to replay
                 break;
+            case 'p':
+                p = parse_policy(optarg);  // Set replacement policy
+                p_given = 1;
+                if (p < 0) {
+                    printf("Unknown replacement policy: %s\n", optarg);
+                    print_usage(argv);
+                }
+                break;
+            case 'W':
+                // Set write hit policy
+                if (!parse_write_option(optarg, WRITE_BACK, "wb", "wt", &w)) {
+                    printf("Unknown write policy: %s\n", optarg);
+                    print_usage(argv);
+                }
+                w_given |= WRITE_BACK;
+                break;
+            case 'A':
+                // Set write miss policy
+                if (!parse_write_option(optarg, WRITE_ALLOCATE, "wa", "nwa", &w)) {
+                    printf("Unknown write miss policy: %s\n", optarg);
+                    print_usage(argv);
+                }
+                w_given |= WRITE_ALLOCATE;
+                break;
+            case 'S':
+                sweep = optarg;  // Set sweep specification
+                break;
+            case 'M':
+                M = atoi(optarg);  // Set largest associativity of the miss-ratio curve
+                break;
+            case 'j':
+                j = atoi(optarg);  // Set number of worker threads
+                break;
+            case 'H':
+                H = optarg;  // Set cache hierarchy config
+                break;
+            case OPT_CONVERT:
+                convert = 1;  // Set convert flag
+                break;
+            case OPT_SET_STATS:
+                set_stats = optarg;  // Set per-set statistics output
+                break;
+            case OPT_PROFILE:
+                // Set profile level, --profile=hw adds the hardware counters
+                if (optarg && strcmp(optarg, "hw") != 0) {
+                    printf("Unknown profile mode: %s\n", optarg);
+                    print_usage(argv);
+                }
+                profile = optarg ? 2 : 1;
+                break;
+            case OPT_SAMPLE_SETS:
+                sample_sets = atoi(optarg);  // Set the set sampling ratio
+                if (sample_sets < 1 || (sample_sets & (sample_sets - 1)) != 0) {
+                    printf("--sample-sets takes a power of two\n");
+                    return 1;
+                }
+                break;
+            case OPT_SAMPLE_TIME: {
+                // Set the time sampling windows as warmup,window,period
+                unsigned long long warmup, window, period;
+                char extra;
+                if (sscanf(optarg, "%llu,%llu,%llu%c", &warmup, &window, &period, &extra) != 3 || window == 0
+                        || period < warmup + window) {
+                    printf("--sample-time takes warmup,window,period with period >= warmup + window\n");
+                    return 1;
+                }
+                sample_time.warmup = warmup;
+                sample_time.window = window;
+                sample_time.period = period;
+                break;
+            }
+            case OPT_CORES:
+                // Set the per-core traces, split in place at the commas
+                ncores = 0;
+                for (char* path = strtok(optarg, ","); path; path = strtok(NULL, ",")) {
+                    if (ncores == MC_MAX_CORES) {
+                        printf("--cores takes at most %d traces\n", MC_MAX_CORES);
+                        return 1;
+                    }
+                    cores[ncores++] = path;
+                }
+                break;
+            case OPT_LLC: {
+                // Set the shared cache geometry as s,E
+                char extra;
+                if (sscanf(optarg, "%d,%d%c", &llc_s, &llc_E, &extra) != 2 || llc_s < 0 || llc_E <= 0) {
+                    printf("--llc takes s,E\n");
+                    return 1;
+                }
+                break;
+            }
+            case OPT_INTERLEAVE:
+                // Set the interleave order, rr or ts
+                if (strcmp(optarg, "rr") == 0) {
+                    interleave = INTERLEAVE_ROUND_ROBIN;
+                }
+                else if (strcmp(optarg, "ts") == 0) {
+                    interleave = INTERLEAVE_TIMESTAMP;
+                }
+                else {
+                    printf("Unknown interleave: %s\n", optarg);
+                    print_usage(argv);
+                }
+                break;
+            case OPT_QUANTUM:
+                quantum = atoi(optarg);  // Set the accesses per quantum
+                if (quantum < 1) {
+                    printf("--quantum takes a positive count\n");
+                    return 1;
+                }
+                break;
+            case OPT_SAVE_STATE:
+                save_state = optarg;  // Set the snapshot to write
+                break;
+            case OPT_LOAD_STATE:
+                load_state = optarg;  // Set the snapshot to resume from
+                break;
+            case OPT_INTERVAL: {
+                // Set the block accesses per interval report
+                char* end;
+                stream.every = strtoull(optarg, &end, 10);
+                if (*end != '\0' || stream.every == 0) {
+                    printf("--interval takes a positive access count\n");
+                    return 1;
+                }
+                break;
+            }
+            case OPT_INTERVAL_TIME:
+                stream.seconds = atof(optarg);  // Set the seconds per interval report
+                if (stream.seconds <= 0) {
+                    printf("--interval-time takes a positive number of seconds\n");
+                    return 1;
+                }
+                break;
+            case OPT_INTERVAL_FORMAT:
+                // Set the interval line format, csv or json
+                if (strcmp(optarg, "csv") == 0) {
+                    stream.format = STREAM_CSV;
+                }
+                else if (strcmp(optarg, "json") == 0) {
+                    stream.format = STREAM_JSON;
+                }
+                else {
+                    printf("Unknown interval format: %s\n", optarg);
+                    print_usage(argv);
+                }
+                break;
+            case OPT_INTERVAL_OUT:
+                interval_out = optarg;  // Set the interval report file
+                break;
+            case OPT_PREFETCH:
+                prefetch = parse_prefetcher(optarg);  // Set the prefetcher
+                if (prefetch < 0) {
+                    printf("Unknown prefetcher: %s\n", optarg);
+                    print_usage(argv);
+                }
+                break;
+            case OPT_PREFETCH_DEGREE:
+                prefetch_degree = atoi(optarg);  // Set the blocks requested per trigger
+                break;
+            case OPT_PREFETCH_LATENCY:
+                prefetch_latency = atoi(optarg);  // Set the accesses a prefetch takes to arrive
+                if (prefetch_latency < 0) {
+                    printf("--prefetch-latency takes a count of accesses\n");
+                    return 1;
+                }
+                break;
+            case OPT_CLASSIFY:
+                classify = 1;  // Set miss classification flag
+                break;
+            case OPT_VICTIM:
+                victim = atoi(optarg);  // Set victim cache lines, which also classifies the misses
+                classify = 1;
+                if (victim < 1) {
+                    printf("--victim takes a number of lines\n");
+                    return 1;
+                }
+                break;
+            case OPT_BATCH:
+                batch = optarg;  // Set the batch manifest
+                break;
+            case OPT_BATCH_FORMAT:
+                // Set the result table format, csv or json
+                if (strcmp(optarg, "csv") == 0) {
+                    batch_format = BATCH_CSV;
+                }
+                else if (strcmp(optarg, "json") == 0) {
+                    batch_format = BATCH_JSON;
+                }
+                else {
+                    printf("Unknown batch format: %s\n", optarg);
+                    print_usage(argv);
+                }
+                break;
+            case OPT_BATCH_OUT:
+                batch_out = optarg;  // Set the result table file
+                break;
+            case OPT_REGIONS:
+                regions = optarg;  // Set the region map
+                break;
+            case OPT_REGION_INCLUDE:
+                region_include = optarg;  // Set the labels to simulate
+                break;
+            case OPT_REGION_EXCLUDE:
+                region_exclude = optarg;  // Set the labels to skip
+                break;
+            case OPT_SHARD:
+                if (!parse_shard(optarg, &shard, &shards)) {
+                    printf("--shard takes k/N with 0 <= k < N: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case OPT_SHARD_OUT:
+                shard_out = optarg;  // Set the shard result file
+                break;
+            case OPT_MERGE:
+                merge = 1;  // Set merge flag
+                break;
             default:
                 print_usage(argv);  // Print usage info and exit on invalid option
                 exit(1); // Exit with code 1
         }
     }
     
+    // Convert mode takes the input and output traces as positional arguments
+    if (convert) {
+        if (argc - optind != 2) {
+            print_usage(argv);
+        }
+        return convert_trace(argv[optind], argv[optind + 1]);
+    }
+
+    // Merge mode takes the shard files as positional arguments
+    if (merge) {
+        if (argc - optind < 1) {
+            print_usage(argv);
+        }
+        return merge_shards(&argv[optind], argc - optind, set_stats);
+    }
+
+    // -j splits a single cache's sets, a batch's jobs or --cores' cores; the other modes run serially
+    if (j > 1 && (H || sweep || M != 0)) {
+        printf("-j only applies to single-cache, --cores and --batch runs, not -S, -M or -H\n");
+        return 1;
+    }
+
+    // Per-set counters belong to the one cache of a single-cache run
+    if (set_stats && (H || sweep || M != 0)) {
+        printf("--set-stats only applies to single-cache runs without -S, -M or -H\n");
+        return 1;
+    }
+
+    // Profiling breaks down the batched single-cache loop, the other modes run their own
+    if (profile && (H || sweep || M != 0 || j > 1 || v == 1)) {
+        printf("--profile only applies to single-cache runs without -v or -j\n");
+        return 1;
+    }
+    int sampled = sample_sets > 1 || sample_time.window > 0;
+    if (sampled && (H || sweep || M != 0 || j > 1 || v == 1 || profile)) {
+        printf("Sampling only applies to single-cache runs without -v, -j or --profile\n");
+        return 1;
+    }
+    if ((save_state || load_state) && (H || sweep || M != 0 || ncores > 0 || sampled)) {
+        printf("Snapshots only apply to single-cache runs without sampling\n");
+        return 1;
+    }
+    int streaming = stream.every > 0 || stream.seconds > 0;
+    if (streaming && (H || sweep || M != 0 || ncores > 0 || j > 1 || v == 1 || profile || sampled)) {
+        printf("--interval only applies to single-cache runs without -v, -j, --profile or sampling\n");
+        return 1;
+    }
+    if (prefetch != PREFETCH_NONE && (H || sweep || M != 0 || ncores > 0 || j > 1 || v == 1 || profile || sampled
+                                      || streaming)) {
+        printf("--prefetch only applies to single-cache runs without -v, -j, --profile, sampling or --interval\n");
+        return 1;
+    }
+    if (classify && (H || sweep || M != 0 || ncores > 0 || j > 1 || v == 1 || profile || sampled || streaming
+                     || prefetch != PREFETCH_NONE)) {
+        printf("--classify and --victim only apply to single-cache runs without -v, -j, --profile, sampling, --interval or --prefetch\n");
+        return 1;
+    }
+
+    if ((region_include || region_exclude) && !regions) {
+        printf("--region-include and --region-exclude need --regions\n");
+        return 1;
+    }
+    if (regions && (H || sweep || M != 0 || ncores > 0 || j > 1 || v == 1 || profile || sampled || streaming
+                    || prefetch != PREFETCH_NONE || classify || batch)) {
+        printf("--regions only applies to single-cache runs without -v, -j, --profile, sampling, --interval, --prefetch or --classify\n");
+        return 1;
+    }
+
+    // A shard simulates part of the sets of one run, to be added up by --merge with the others
+    if (shards != 0 && (!shard_out || H || sweep || ncores > 0 || v == 1 || profile || sampled || streaming
+                        || prefetch != PREFETCH_NONE || classify || regions || save_state || load_state || batch)) {
+        printf("--shard needs --shard-out and only applies to single-cache or -M runs without -v, sampling, --interval, --prefetch, --classify, --regions or snapshots\n");
+        return 1;
+    }
+    if (shard_out && shards == 0) {
+        printf("--shard-out needs --shard\n");
+        return 1;
+    }
+
+    // Batch mode takes its traces and geometries from the manifest, -p/-W/-A are the defaults
+    if (batch && h == 0) {
+        if (t || H || sweep || M != 0 || ncores > 0 || v == 1 || profile || sampled || streaming
+            || prefetch != PREFETCH_NONE || classify || save_state || load_state || set_stats) {
+            printf("--batch runs the manifest's jobs without -t, -v or another mode\n");
+            return 1;
+        }
+        batch_run* run = load_batch(batch, p, w);
+        if (!run) {
+            return 1;
+        }
+        int status = runbatch(run, j);
+        status |= write_batch(run, batch_out, batch_format);
+        freebatch(run);
+        return status;
+    }
+
+    // Hierarchy mode takes its geometry from the config file
+    if (H && h == 0 && t != NULL) {
+        hierarchy* hier = load_hierarchy(H, p, w);
+        if (!hier) {
+            return 1;
+        }
+        trace_reader* tracefile = trace_open(t);
+        if (!tracefile) {
+            printf("Error opening trace file. Make sure path and name is correct\n");
+            freehierarchy(hier);
+            return 1;
+        }
+        runhierarchy(hier, tracefile, v);
+        print_hierarchy(hier);
+        trace_close(tracefile);
+        freehierarchy(hier);
+        return 0;
+    }
+
+    // Multicore mode gives each trace a private -s/-E/-b L1 in front of a shared --llc
+    if (ncores > 0 && h == 0) {
+        if (s < 0 || E <= 0 || b < 0 || llc_s < 0) {
+            printf("--cores needs -s, -E, -b and --llc\n");
+            return 1;
+        }
+        if (w != WRITE_DEFAULT || v == 1 || sweep || M != 0 || profile || sampled || set_stats) {
+            printf("--cores simulates write-back, write-allocate caches without -v, -S, -M or the single-cache options\n");
+            return 1;
+        }
+        multicore* mc = makemulticore(cores, ncores, s, E, b, llc_s, llc_E, p, interleave);
+        if (!mc) {
+            return 1;
+        }
+        int status = runmulticore(mc, quantum, j);
+        if (status == 0) {
+            print_multicore(mc);
+        }
+        freemulticore(mc);
+        return status;
+    }
+
+    // Sweep mode replaces -s/-E/-b with a list of geometries
+    if (sweep && h == 0 && t != NULL) {
+        sweep_config* configs = NULL;
+        int n = parse_sweep(sweep, &configs);
+        if (n < 0) {
+            printf("Invalid sweep specification: %s\n", sweep);
+            return 1;
+        }
+        trace_reader* tracefile = trace_open(t);
+        if (!tracefile) {
+            printf("Error opening trace file. Make sure path and name is correct\n");
+            free(configs);
+            return 1;
+        }
+        int status = runsweep(configs, n, tracefile, p, w);
+        trace_close(tracefile);
+        free(configs);
+        return status;
+    }
+
+    // Stack distance mode reports every E up to M from one pass
+    if (M != 0 && h == 0 && t != NULL && s >= 0 && b >= 0) {
+        if (M < 0 || M > STACK_MAX_E || s > 30) {
+            printf("-M takes an associativity from 1 to %d\n", STACK_MAX_E);
+            return 1;
+        }
+        if (p != POLICY_LRU) {
+            printf("-M computes LRU results only\n");
+            return 1;
+        }
+        if (!(w & WRITE_ALLOCATE)) {
+            printf("-M assumes write-allocate\n");
+            return 1;
+        }
+        trace_reader* tracefile = trace_open(t);
+        if (!tracefile) {
+            printf("Error opening trace file. Make sure path and name is correct\n");
+            return 1;
+        }
+        int status = shards ? runstack_shard(tracefile, s, b, M, shard, shards, shard_out) : runstack(tracefile, s, b, M);
+        trace_close(tracefile);
+        return status;
+    }
+
     // Check for help or invalid parameters
-    if (h == 1 || argv[1] == NULL || s == 0 || E == 0 || b == 0 || t == NULL) {
+    if (j < 1 || j > PAR_MAX_THREADS) {
+        printf("-j takes a thread count from 1 to %d\n", PAR_MAX_THREADS);
+        return 1;
+    }
+    if (j > 1 && v == 1) {
+        printf("-v cannot be combined with -j\n");
+        return 1;
+    }
+    if (h == 1 || argv[1] == NULL || (!load_state && (s < 0 || E <= 0 || b < 0)) || t == NULL) {
         print_usage(argv);
         return 0;
     }
 
     // Initialize variables for cache simulation
-    int hit_count = 0, miss_count = 0, eviction_count = 0;
-    cache* cachsim = makecache(s, E, b);
-    
+    cache_stats stats = {0, 0, 0, 0, 0, 0};
+    cache_profile prof = {profile == 2};
+    sample_result sample;
+
     printf("Initializing Cache Simulation\n");
 
-    // Check for cache creation failure
+    // A snapshot brings its own geometry, policies and counters; -s/-E/-b/-p/-W/-A, if given, must agree
+    cache* cachsim = load_state ? cache_load_state(load_state, &stats) : makecache(s, E, b, p, w);
+    if (load_state && !cachsim) {
+        return 1;
+    }
     if (!cachsim) {
         printf("Error creating cache\n");
         return 1;
     }
+    if (load_state) {
+        int saved_s, saved_E, saved_b;
+        cache_geometry(cachsim, &saved_s, &saved_E, &saved_b);
+        if ((s >= 0 && s != saved_s) || (E > 0 && E != saved_E) || (b >= 0 && b != saved_b)) {
+            printf("%s holds a cache with s=%d E=%d b=%d\n", load_state, saved_s, saved_E, saved_b);
+            freecache(cachsim);
+            return 1;
+        }
+        int saved_p, saved_w;
+        cache_policies(cachsim, &saved_p, &saved_w);
+        if ((p_given && p != saved_p) || ((w ^ saved_w) & w_given)) {
+            printf("%s holds a cache with other -p, -W or -A policies\n", load_state);
+            freecache(cachsim);
+            return 1;
+        }
+    }
+    if (sample_sets > 1 && !cache_sample_sets(cachsim, sample_sets)) {
+        printf("Cannot sample 1 in %d of %d sets\n", sample_sets, 1 << s);
+        freecache(cachsim);
+        return 1;
+    }
+    if (shards && !cache_shard(cachsim, shard, shards)) {
+        printf("Cannot split %d sets into %d shards\n", 1 << s, shards);
+        freecache(cachsim);
+        return 1;
+    }
+    if (set_stats && !cache_enable_set_stats(cachsim)) {
+        printf("Error allocating per-set statistics\n");
+        freecache(cachsim);
+        return 1;
+    }
     printf("Cache created\n");
 
+    prefetcher* pf = NULL;
+    if (prefetch != PREFETCH_NONE && !(pf = makeprefetcher(cachsim, prefetch, prefetch_degree, prefetch_latency))) {
+        freecache(cachsim);
+        return 1;
+    }
+
+    classifier* cls = NULL;
+    if (classify && !(cls = makeclassifier(cachsim, victim))) {
+        freecache(cachsim);
+        return 1;
+    }
+
+    region_map* rmap = NULL;
+    if (regions) {
+        rmap = load_regions(regions);
+        if (!rmap || (region_include && region_filter(rmap, region_include, 1) != 0)
+            || (region_exclude && region_filter(rmap, region_exclude, 0) != 0)) {
+            freeregions(rmap);
+            freecache(cachsim);
+            return 1;
+        }
+    }
+
     // Open trace file
-    FILE* tracefile = fopen(t, "r");
+    trace_reader* tracefile = trace_open(t);
     if (!tracefile) {
         printf("Error opening trace file. Make sure path and name is correct\n");
         return 1;
@@ -122,210 +623,173 @@ int main(int argc, char* argv[])
 
     // Run the cache simulation
     printf("Running Cache Simulation\n");
-    runsim(cachsim, tracefile, &hit_count, &miss_count, &eviction_count, &v);
+    if (j > 1) {
+        if (runsim_parallel(cachsim, tracefile, j, &stats) != 0) {
+            trace_close(tracefile);
+            freecache(cachsim);
+            return 1;
+        }
+    }
+    else if (sampled) {
+        if (runsim_sampled(cachsim, tracefile, &sample_time, &sample) != 0) {
+            trace_close(tracefile);
+            freecache(cachsim);
+            return 1;
+        }
+        // The summary reports the estimate, the raw counts follow with the sampling details
+        stats = sample.estimate;
+    }
+    else if (streaming) {
+        FILE* out = interval_out && strcmp(interval_out, "-") != 0 ? fopen(interval_out, "w") : stdout;
+        if (!out) {
+            printf("Error opening %s\n", interval_out);
+            trace_close(tracefile);
+            freecache(cachsim);
+            return 1;
+        }
+        stream.out = out;
+        int failed = runsim_stream(cachsim, tracefile, &stream, &stats);
+        if (out != stdout) {
+            failed |= fclose(out) != 0;
+        }
+        if (failed) {
+            trace_close(tracefile);
+            freecache(cachsim);
+            return 1;
+        }
+    }
+    else if (pf) {
+        runsim_prefetch(cachsim, pf, tracefile, &stats);
+    }
+    else if (cls) {
+        if (runsim_classify(cachsim, cls, tracefile, &stats) != 0) {
+            trace_close(tracefile);
+            freeclassifier(cls);
+            freecache(cachsim);
+            return 1;
+        }
+    }
+    else if (rmap) {
+        runsim_regions(cachsim, rmap, tracefile, &stats);
+    }
+    else if (profile) {
+        runsim_profile(cachsim, tracefile, &stats, &prof);
+    }
+    else {
+        runsim(cachsim, tracefile, &stats, &v);
+    }
 
     // Print summary
     printf("Results:\n");
-    print_summary(hit_count, miss_count, eviction_count);
+    print_summary(&stats);
+    print_traffic(&stats);
+    if (sampled) {
+        print_sample(&sample);
+    }
+    if (pf) {
+        print_prefetch(pf, &stats);
+    }
+    if (cls) {
+        print_classify(cls);
+    }
+    if (rmap) {
+        print_regions(rmap);
+    }
+    if (profile) {
+        print_profile(&prof);
+        if (profile == 2 && !prof.hw) {
+            printf("Hardware counters unavailable (perf_event_open failed)\n");
+        }
+    }
+    int status = set_stats ? write_set_stats(cachsim, set_stats) : 0;
+    if (shard_out && status == 0) {
+        status = write_shard(cachsim, &stats, shard_out);
+    }
+    if (save_state && status == 0) {
+        status = cache_save_state(cachsim, &stats, save_state);
+    }
 
     // Cean up
-    fclose(tracefile);
+    trace_close(tracefile);
+    freeprefetcher(pf);
+    freeclassifier(cls);
+    freeregions(rmap);
     freecache(cachsim);
 
-    return 0;
-}
-
-void print_summary(int hits, int misses, int evictions){
-    printf("hits:%d misses:%d evictions:%d\n", hits, misses, evictions);
+    return status;
 }
 
 void print_usage(char* argv[]){
-    printf("Usage: %s [-hv] -s <num> -E <num> -b <num> -t <file>\n", argv[0]);
+    printf("Usage: %s [-hv] -s <num> -E <num> -b <num> -t <file> [-p <policy>] [-W wb|wt] [-A wa|nwa] [-j <num>]\n", argv[0]);
+    printf("       %s -S <sweep> -t <file> [-p <policy>]\n", argv[0]);
+    printf("       %s -s <num> -b <num> -M <num> -t <file>\n", argv[0]);
+    printf("       %s [-v] -H <config> -t <file> [-p <policy>]\n", argv[0]);
+    printf("       %s -s <num> -E <num> -b <num> --cores <file,...> --llc <s,E> [--interleave rr|ts] [-j <num>]\n", argv[0]);
+    printf("       %s --load-state <snapshot> -t <file> [--save-state <snapshot>] [-j <num>]\n", argv[0]);
+    printf("       %s --batch <manifest> [-j <num>] [--batch-format csv|json] [--batch-out <file>]\n", argv[0]);
+    printf("       %s --merge <shard> ... [--set-stats <file>]\n", argv[0]);
+    printf("       %s --convert <in> <out.ctr>\n", argv[0]);
     printf("Options:\n");
     printf("  -h         Print this help message.\n");
     printf("  -v         Optional verbose flag.\n");
     printf("  -s <num>   Number of set index bits.\n");
     printf("  -E <num>   Number of lines per set.\n");
     printf("  -b <num>   Number of block offset bits.\n");
-    printf("  -t <file>  Trace file.\n");
+    printf("  -t <file>  Trace file, text or binary .ctr, optionally gzip/zstd/xz compressed (- reads from stdin,\n");
+    printf("             unix:<path> listens on a UNIX socket and reads the first connection).\n");
+    printf("  -p <name>  Replacement policy: lru (default), fifo, random, plru, srrip, brrip.\n");
+    printf("  -W <name>  Write hit policy: wb write-back (default), wt write-through.\n");
+    printf("  -A <name>  Write miss policy: wa write-allocate (default), nwa no-write-allocate.\n");
+    printf("  -S <spec>  Sweep geometries in one trace pass, e.g. s=4..12,E=1,2,4,8,b=4..6.\n");
+    printf("  -M <num>   LRU results for E=1..num from one stack distance pass.\n");
+    printf("  -j <num>   Simulate with sets split across num worker threads.\n");
+    printf("  --set-stats <file>  Write per-set hits, misses and evictions as CSV (- for stdout).\n");
+    printf("  --sample-sets <num>  Simulate 1 in num sets (a power of two) and scale the counts.\n");
+    printf("  --sample-time <w,n,p>  Every p accesses, warm up for w then count n, and scale the counts.\n");
+    printf("  --profile[=hw]      Time decode, index and simulate per batch, with hw also host cache and branch misses.\n");
+    printf("  --save-state <file> After the run, write the cache contents and counters as a snapshot.\n");
+    printf("  --load-state <file> Start from a snapshot's cache and counters instead of a cold cache.\n");
+    printf("  --interval <num>    Report counters every num block accesses while the trace streams in.\n");
+    printf("  --interval-time <sec>  Report counters every sec seconds while the trace streams in.\n");
+    printf("  --interval-format <name>  Interval lines as csv (default) or json.\n");
+    printf("  --interval-out <file>  Write interval lines to file instead of stdout.\n");
+    printf("  --prefetch <name>   Prefetcher in front of the cache: none (default), next, stride, stream.\n");
+    printf("  --prefetch-degree <num>  Blocks a prefetcher requests per trigger (default 2).\n");
+    printf("  --prefetch-latency <num> Demand accesses a prefetch takes to arrive, earlier hits count as late.\n");
+    printf("  --classify          Split misses into compulsory, capacity and conflict with a shadow fully-associative LRU.\n");
+    printf("  --victim <num>      Add a num-line victim cache on the eviction path (implies --classify).\n");
+    printf("  --regions <file>    Count hits, misses and evictions per label of the \"<start> <end> <label>\" hex ranges in file.\n");
+    printf("  --region-include <labels>  Only simulate accesses in these comma separated labels (unmapped for the rest).\n");
+    printf("  --region-exclude <labels>  Skip accesses in these comma separated labels.\n");
+    printf("  -H <file>  Simulate the multi-level hierarchy described in file.\n");
+    printf("  --cores <files>     One trace per core, each with a private -s/-E/-b L1 kept coherent with MESI.\n");
+    printf("  --llc <s,E>         Shared last-level cache behind the --cores L1s, with their block size.\n");
+    printf("  --interleave <name> Core order: rr one access each in turn (default), ts by record position.\n");
+    printf("  --quantum <num>     Accesses per core between shared-level syncs (default %d); -j runs cores in parallel.\n", MC_QUANTUM);
+    printf("  --batch <file>      Run the jobs in file, one \"<trace> s=<num> E=<num> b=<num> [policy=..] [write=..] [alloc=..]\"\n");
+    printf("                      per line, on -j threads, decoding each trace once for all of its jobs.\n");
+    printf("  --batch-format <name>  Batch results as csv (default) or json.\n");
+    printf("  --batch-out <file>  Write the batch results to file instead of stdout.\n");
+    printf("  --shard <k/N>       Only simulate the sets with index %% N == k, dropping other accesses once decoded.\n");
+    printf("  --shard-out <file>  Write the shard's counters, with --set-stats also per set, for --merge.\n");
+    printf("  --merge  Add up the --shard-out files of every shard of a run into the run's results.\n");
+    printf("  --convert  Rewrite trace <in> as binary trace <out.ctr>.\n");
     printf("\nExamples:\n");
     printf("  linux>  %s -s 4 -E 1 -b 4 -t traces/trace01.dat\n", argv[0]);
     printf("  linux>  %s -v -s 8 -E 2 -b 4 -t traces/trace01.dat\n", argv[0]);
+    printf("  linux>  %s -s 4 -E 8 -b 4 -p srrip -t traces/trace04.dat\n", argv[0]);
+    printf("  linux>  %s -S s=2..6,E=1,2,4,b=4 -t traces/trace04.dat\n", argv[0]);
+    printf("  linux>  %s -s 0 -b 6 -M 64 -t traces/trace04.dat\n", argv[0]);
+    printf("  linux>  %s -s 4 -E 2 -b 4 --cores traces/trace04.dat,traces/trace04.dat --llc 8,8 -j 2\n", argv[0]);
+    printf("  linux>  %s -s 6 -E 4 -b 6 --prefetch stream --prefetch-degree 4 -t traces/trace04.dat\n", argv[0]);
+    printf("  linux>  %s -s 4 -E 1 -b 4 --victim 8 -t traces/trace04.dat\n", argv[0]);
+    printf("  linux>  %s -s 4 -E 2 -b 4 --regions app.regions --region-exclude stack -t traces/trace01.dat\n", argv[0]);
+    printf("  linux>  %s -s 4 -E 2 -b 4 -t part1.dat --save-state warm.snap\n", argv[0]);
+    printf("  linux>  %s --load-state warm.snap -t part2.dat\n", argv[0]);
+    printf("  linux>  valgrind --tool=lackey --trace-mem=yes --log-fd=1 ./app | %s -s 8 -E 4 -b 6 -t - --interval 1000000\n", argv[0]);
+    printf("  linux>  %s --batch nightly.jobs -j 16 --batch-format json --batch-out nightly.json\n", argv[0]);
+    printf("  linux>  %s -s 12 -E 8 -b 6 -t big.ctr -j 8 --shard 3/16 --shard-out shared/big.3.shard\n", argv[0]);
+    printf("  linux>  %s --merge shared/big.*.shard --set-stats big-sets.csv\n", argv[0]);
+    printf("  linux>  %s --convert traces/trace04.dat trace04.ctr\n", argv[0]);
     exit(0);
 }
-
-cache* makecache(int s, int E, int b) {
-    // Calculate the number of sets (S = 2^s)
-    int S = 1 << s;
-
-    // Allocate memory for the cache structure
-    cache* cachesim = (cache*)malloc(sizeof(cache));
-    if (!cachesim){
-       printf("Error allocating memory for cache sim");
-       return NULL; 
-    } 
-
-    // Initialize cache parameters
-    cachesim->s = s;
-    cachesim->E = E;
-    cachesim->b = b;
-    cachesim->S = S;
-
-    // Allocate memory for the sets
-    // had to add size_t cast to avoid warning (implicit conversion)
-    cachesim->sets = (set*)malloc((size_t)S * sizeof(set));
-    if (!cachesim->sets) { // Check for memory allocation of sets
-        printf("Error allocating memory for cache sets");
-        free(cachesim);
-        return NULL;
-    }
-
-    // Allocate memory for the lines within each set
-    for (int i = 0; i < S; i++) {
-        cachesim->sets[i].lines = (line*)malloc((size_t)E * sizeof(line));
-        if (!cachesim->sets[i].lines) { // Check for memory allocation of lines
-            printf("Error allocating memory for cache lines");
-            // Free memory if faliure detected
-            for (int j = 0; j < i; j++) {
-                free(cachesim->sets[j].lines);
-            }
-            free(cachesim->sets);
-            free(cachesim);
-            return NULL;
-        }
-
-        // Initialize each line's valid bit to 0 and other fields
-        for (int j = 0; j < E; j++) {
-            cachesim->sets[i].lines[j].valid = 0;
-            cachesim->sets[i].lines[j].tag = 0;
-            cachesim->sets[i].lines[j].lru = 0;
-        }
-    }
-    return cachesim;  // Return the created cache
-}
-
-void freecache(cache* c) {
-    if (c) {
-        // Free each set's lines
-        for (int i = 0; i < c->S; i++) {
-            free(c->sets[i].lines);
-        }
-
-        // Free the sets array and cache structure
-        free(c->sets);
-        free(c);
-    }
-}
-
-void runsim(cache* c, FILE* tracefile, int* hits, int* misses, int* evictions, int* verbose) {
-    // Initialize variables
-    char operation;
-    long unsigned int address;
-    int size;
-
-    // Read the trace file
-    while (fscanf(tracefile, " %c %lx,%d", &operation, &address, &size) > 0){
-        // Check for a memory access
-        if (operation == 'L' || operation == 'S'){
-            // Load and store operations
-            if(*verbose == 1){
-                printf("%c %lx, %d ", operation, address, size);
-                access_cache(c, &address, hits, misses, evictions, verbose);
-                printf("\n");
-            }
-            else{
-                access_cache(c, &address, hits, misses, evictions, verbose);
-            }
-        }
-        if (operation == 'M'){
-            // Modify operation is load and store combined
-            if(*verbose == 1){
-                printf("%c %lx, %d ", operation, address, size);
-                access_cache(c, &address, hits, misses, evictions, verbose);
-                access_cache(c, &address, hits, misses, evictions, verbose);
-                printf("\n");
-            }
-            else{
-                access_cache(c, &address, hits, misses, evictions, verbose);
-                access_cache(c, &address, hits, misses, evictions, verbose);
-            }
-        }
-        else{
-            // Skip instruction load operations
-            continue;
-        }
-    }
-}
-
-void access_cache(cache* c, long unsigned int* address, int* hit, int* miss, int* evictions, int* verb){
-    // Calculate the set index and tag
-    // Calculate set index by shifting the address right by b bits and masking with S - 1
-        // Shift right by b bits to get rid of block bits
-        // Mask with S - 1 to zero out all bits except the set index bits
-    long unsigned int cache_set = (*address >> c->b) & ((1UL << c->s) - 1);
-
-    // Calculate tag by shifting the address right by set idx and block bits
-    long unsigned int tag = *address >> (c->s + c->b);
-
-    // Check for a hit
-    for (int i = 0; i < c->E; i++){
-        if (c->sets[cache_set].lines[i].valid && c->sets[cache_set].lines[i].tag == tag){
-            if (*verb == 1){
-                printf("hit ");
-            }
-            *hit += 1;
-            lru_update(c, &c->sets[cache_set], &c->sets[cache_set].lines[i]);
-            return;
-        }
-    }
-    // Check for a miss and find empty line
-    for(int i = 0; i < c->E; i++){
-        if (!c->sets[cache_set].lines[i].valid){ //Check for empty line
-            c->sets[cache_set].lines[i].valid = 1;  // Set valid
-            c->sets[cache_set].lines[i].tag = tag;
-            if (*verb == 1){
-                printf("miss ");
-            }
-            *miss += 1;
-            lru_update(c, &c->sets[cache_set], &c->sets[cache_set].lines[i]);
-            return;
-        }
-    }
-
-    // Check for eviction
-    int lru_idx = find_lru(c, &c->sets[cache_set]);
-    if(*verb == 1){
-        printf("miss eviction ");
-    }
-    *miss += 1;
-    *evictions += 1;
-
-    // Evict the LRU line
-    c->sets[cache_set].lines[lru_idx].tag = tag; //update the tag
-    lru_update(c, &c->sets[cache_set], &c->sets[cache_set].lines[lru_idx]); //run update
-    return;
-}
-
-int find_lru(cache* c, set* inset){
-    int lru_idx = 0;
-    // Find the least recently used line
-    for (int i = 0; i < c->E; i++){
-        if (inset->lines[i].lru == c->E - 1){
-            lru_idx = i;
-            break;
-        }
-    }
-    return lru_idx;
-}
-
-void lru_update(cache* c, set* inset, line* cache_line) {
-    // Update the age of each line in the set
-    for (int i = 0; i < c->E; i++){
-        if (inset->lines[i].valid){
-            if(inset->lines[i].lru < cache_line->lru){
-                inset->lines[i].lru = inset->lines[i].lru + 1;
-            }
-        }
-    }
-    cache_line->lru = 0;
-}
\ No newline at end of file
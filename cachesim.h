@@ -0,0 +1,379 @@
+#ifndef CACHESIM_H
+#define CACHESIM_H
+
+// Public interface of libcachesim. Link with -lcachesim -lm -pthread (plus -lz, -lzstd
+// or -llzma when the library was built with compressed trace support).
+
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+Library limits
+    CACHE_BATCH: Accesses in a cache_batch
+    STACK_MAX_E: Largest associativity runstack reports
+    PAR_MAX_THREADS: Most worker threads runsim_parallel accepts
+    MC_MAX_CORES: Most per-core traces a multicore run takes (sharer sets are 64-bit masks)
+    MC_QUANTUM: Default interleave positions each core advances between synchronizations
+*/
+#define CACHE_BATCH 4096
+#define STACK_MAX_E 65536
+#define PAR_MAX_THREADS 1024
+#define MC_MAX_CORES 64
+#define MC_QUANTUM 1024
+
+/*
+Write policy flags
+    WRITE_BACK: Stores dirty the line and reach the next level on eviction (otherwise write-through)
+    WRITE_ALLOCATE: Store misses fill the line (otherwise the store bypasses the cache)
+*/
+enum { WRITE_BACK = 1, WRITE_ALLOCATE = 2 };
+#define WRITE_DEFAULT (WRITE_BACK | WRITE_ALLOCATE)
+
+/*
+Replacement policies, in the order parse_policy knows their names
+*/
+enum { POLICY_LRU, POLICY_FIFO, POLICY_RANDOM, POLICY_PLRU, POLICY_SRRIP, POLICY_BRRIP, POLICY_COUNT };
+
+/*
+Lookup results
+    CACHE_HIT: The block was present
+    CACHE_MISS: The block was filled into an empty line
+    CACHE_EVICT: The block replaced a victim line
+*/
+enum { CACHE_HIT, CACHE_MISS, CACHE_EVICT };
+
+/*
+Line states reported by cache_line_state
+    LINE_ABSENT: The block is not cached
+    LINE_CLEAN: The block is cached and matches the next level
+    LINE_DIRTY: The block is cached and was written since it was filled
+*/
+enum { LINE_ABSENT, LINE_CLEAN, LINE_DIRTY };
+
+/*
+Multicore trace interleavings
+    INTERLEAVE_ROUND_ROBIN: Cores take turns, one load, store or modify each
+    INTERLEAVE_TIMESTAMP: Every record, instruction fetches included, advances its core's clock by one
+      and the core with the lowest clock goes next
+*/
+enum { INTERLEAVE_ROUND_ROBIN, INTERLEAVE_TIMESTAMP };
+
+/*
+Prefetchers, in the order of their --prefetch names
+    PREFETCH_NONE: Demand fills only
+    PREFETCH_NEXT_LINE: Tagged next-N-line, triggered by a miss or the first hit on a prefetched line
+    PREFETCH_STRIDE: Per-region stride detector, no PC needed
+    PREFETCH_STREAM: Stream table that detects ascending or descending runs of misses and runs ahead of them
+*/
+enum { PREFETCH_NONE, PREFETCH_NEXT_LINE, PREFETCH_STRIDE, PREFETCH_STREAM, PREFETCH_COUNT };
+
+/*
+Interval line formats of runsim_stream
+    STREAM_CSV: A header line, then one comma-separated line per interval
+    STREAM_JSON: One JSON object per line
+*/
+enum { STREAM_CSV, STREAM_JSON };
+
+/*
+Result table formats of write_batch
+    BATCH_CSV: A header line, then one comma-separated line per job
+    BATCH_JSON: A JSON array with one object per job
+*/
+enum { BATCH_CSV, BATCH_JSON };
+
+/*
+Profiled phases of runsim_profile
+    PROFILE_DECODE: Reading and parsing trace records into a cache_batch
+    PROFILE_INDEX: Computing the set and tag of every access in the batch
+    PROFILE_SIMULATE: Simulating the indexed batch
+*/
+enum { PROFILE_DECODE, PROFILE_INDEX, PROFILE_SIMULATE, PROFILE_PHASES };
+
+/*
+Hardware counters runsim_profile reads through perf_event_open
+    PROFILE_CACHE_MISSES: Host last-level cache misses
+    PROFILE_BRANCH_MISSES: Host branch mispredicts
+*/
+enum { PROFILE_CACHE_MISSES, PROFILE_BRANCH_MISSES, PROFILE_COUNTERS };
+
+/*
+Structs:
+    - cache: A simulated cache, opaque outside the library
+    - trace_reader: An open trace, opaque outside the library
+    - sweep_config: One geometry of a sweep, opaque outside the library
+    - hierarchy: A multi-level cache hierarchy, opaque outside the library
+    - prefetcher: A prefetcher attached to one cache, opaque outside the library
+    - classifier: Shadow caches that classify the misses of one cache, and its optional victim cache, opaque outside the library
+    - multicore: Private L1s of several cores kept coherent in front of a shared LLC, opaque outside the library
+    - batch_run: Trace and configuration jobs of a batch manifest with their results, opaque outside the library
+    - region_map: Labelled address ranges with filters and per-label counters, opaque outside the library
+    - cache_stats: Access counters of a cache, including the traffic to and from the next level.
+      Owned by the caller, so several runs can share or split counters; zero it to reset
+    - set_counts: Counters of one set, kept only when per-set statistics are requested
+    - cache_batch: Block of accesses decoded ahead of simulation, as (set, tag, op) columns.
+      Callers filling it by hand set addr, bytes, write and count, then call cache_batch_index
+    - cache_profile: Time and host counters per phase of a profiled run
+    - time_sampling: Periodic measurement windows of a time-sampled run, in block accesses
+    - sample_result: Measured counts of a sampled run, their scaled estimate and its confidence
+    - prefetch_stats: What became of the prefetches of a run, counted apart from the demand hits and misses
+    - classify_stats: Misses split into compulsory, capacity and conflict, and the victim cache's counters
+    - stream_config: When and where a streamed run reports interval statistics
+*/
+typedef struct cache cache;
+typedef struct trace_reader trace_reader;
+typedef struct sweep_config sweep_config;
+typedef struct hierarchy hierarchy;
+typedef struct multicore multicore;
+typedef struct prefetcher prefetcher;
+typedef struct classifier classifier;
+typedef struct batch_run batch_run;
+typedef struct region_map region_map;
+
+typedef struct {
+    uint64_t hits;  // Hit count
+    uint64_t misses;  // Miss count
+    uint64_t evictions;  // Eviction count
+    uint64_t dirty_evictions;  // Evicted lines that were written back
+    uint64_t bytes_read;  // Bytes fetched from the next level by line fills
+    uint64_t bytes_written;  // Bytes written to the next level by write-backs and write-throughs
+} cache_stats;
+
+typedef struct {
+    uint64_t hits;  // Hit count
+    uint64_t misses;  // Miss count
+    uint64_t evictions;  // Eviction count
+} set_counts;
+
+typedef struct {
+    uint64_t addr[CACHE_BATCH];  // Address of each access, block-split so it stays in one block
+    uint64_t set[CACHE_BATCH];  // Set index, filled by cache_batch_index
+    uint64_t tag[CACHE_BATCH];  // Tag, filled by cache_batch_index
+    uint32_t bytes[CACHE_BATCH];  // Bytes the access touches, for write-through traffic
+    uint8_t write[CACHE_BATCH];  // 1 for a store
+    int count;  // Accesses in use
+    unsigned long pending_address;  // Trace record that did not fit in the batch: first byte
+    unsigned long pending_last;  // its last byte
+    unsigned long pending_next;  // first byte not emitted yet
+    int pending_write;  // 1 while emitting a store
+    int pending_passes;  // Passes left, a modify is a load pass then a store pass
+} cache_batch;
+
+typedef struct {
+    int hw;  // Set to 1 to request hardware counters, left 1 only if they could be read
+    uint64_t batches;  // Batches simulated
+    uint64_t accesses;  // Block accesses simulated
+    uint64_t ns[PROFILE_PHASES];  // Wall time of each phase
+    uint64_t counters[PROFILE_PHASES][PROFILE_COUNTERS];  // Host counters of each phase, when hw is 1
+} cache_profile;
+
+typedef struct {
+    uint64_t warmup;  // Accesses simulated but not counted before each window
+    uint64_t window;  // Accesses counted per window, 0 to count every access
+    uint64_t period;  // Accesses from one warm-up start to the next, at least warmup + window
+} time_sampling;
+
+typedef struct {
+    cache_stats measured;  // Counts of the simulated accesses in measured windows and sampled sets
+    cache_stats estimate;  // measured scaled to the whole trace and every set
+    double half_width[3];  // 95% confidence half-width of the hits, misses and evictions estimates
+    int sets;  // Sets simulated
+    int total_sets;  // Sets in the cache
+    uint64_t windows;  // Measured windows, 1 without time sampling
+    uint64_t accesses;  // Block accesses in the trace
+    uint64_t measured_accesses;  // Block accesses inside measured windows, sampled sets or not
+} sample_result;
+
+typedef struct {
+    uint64_t issued;  // Prefetch requests raised
+    uint64_t redundant;  // Requests dropped because the block was already cached
+    uint64_t fills;  // Lines brought in by a prefetch
+    uint64_t useful;  // Prefetched lines a demand access hit in time
+    uint64_t late;  // Prefetched lines a demand access hit before the prefetch latency had passed
+    uint64_t useless;  // Prefetched lines evicted before any demand access used them
+    uint64_t polluting;  // Demand misses on blocks a prefetch fill had evicted
+    uint64_t evictions;  // Lines evicted by prefetch fills
+} prefetch_stats;
+
+typedef struct {
+    uint64_t compulsory;  // Misses on blocks never accessed before
+    uint64_t capacity;  // Other misses a fully-associative LRU cache of the same size also takes
+    uint64_t conflict;  // Misses the fully-associative LRU cache would have hit
+    uint64_t victim_hits;  // Misses the victim cache served instead of the next level
+    uint64_t victim_fills;  // Lines evicted from the cache into the victim cache
+    uint64_t victim_evictions;  // Lines the victim cache dropped to make room
+} classify_stats;
+
+typedef struct {
+    uint64_t every;  // Block accesses per interval, 0 for no access-count intervals
+    double seconds;  // Wall time per interval, 0 for no timed intervals
+    int format;  // STREAM_*
+    FILE* out;  // Where interval lines go, flushed after each one
+} stream_config;
+
+/*
+Functions:
+    - makecache: Creates a cache of 2^s sets of E lines of 2^b bytes, NULL on failure
+    - freecache: Frees a cache
+    - cache_reset: Empties a cache and its per-set counters, keeping its geometry and policies
+    - cache_sets: Number of sets of a cache
+    - cache_geometry: Set index, associativity and block bits of a cache
+    - cache_policies: Replacement policy (POLICY_*) and write policy flags (WRITE_*) of a cache
+    - cache_save_state: Writes a cache's lines, replacement state and the run's counters to a snapshot file
+    - cache_load_state: Recreates a cache and its run's counters from a snapshot file, NULL on failure
+    - access_cache: Simulates and counts a one-byte access
+    - cache_lookup: Accesses one block without counting, returns CACHE_* and reports any evicted block
+    - cache_invalidate: Removes a block from the cache if present
+    - cache_line_state: Reports whether a block is absent, clean or dirty (LINE_*)
+    - cache_clean: Clears a block's dirty bit, returns whether it was set
+    - cache_batch_new: Allocates an empty cache_batch
+    - cache_batch_fill: Decodes trace records into a cache_batch, splitting at block boundaries
+    - cache_batch_index: Computes the set and tag of every access in a cache_batch
+    - cache_access_batch: Simulates every access of an indexed cache_batch in order
+    - cache_enable_set_stats: Starts per-set hit/miss/eviction counting
+    - cache_set_stats: Per-set counters, one per set, NULL unless enabled
+    - cache_sample_sets: Restricts simulation to 1 in ratio sets, chosen by hashing the set index
+    - write_set_stats: Writes the per-set counters as CSV
+    - print_summary: Prints the hit, miss and eviction counts
+    - print_traffic: Prints dirty evictions and bytes moved to and from the next level
+    - parse_policy: Maps a policy name to its POLICY_* value
+    - parse_write_option: Applies a wb|wt or wa|nwa value to a set of WRITE_* flags
+    - trace_open: Opens a trace file ("-" for stdin, "unix:<path>" to accept one connection on a socket), plain or gzip/zstd/xz compressed, for reading
+    - trace_close: Releases a trace reader
+    - trace_next: Parses the next trace record
+    - convert_trace: Rewrites a trace in the binary .ctr format
+    - runsim: Replays a trace through a cache
+    - runsim_profile: Replays a trace through a cache like runsim, timing each phase per batch
+    - print_profile: Prints the per-phase breakdown of a profiled run
+    - runsim_sampled: Replays a trace through a set- and/or time-sampled cache and estimates the full counts
+    - print_sample: Prints what a sampled run covered and the confidence of its estimate
+    - parse_prefetcher: Maps a prefetcher name to its PREFETCH_* value
+    - makeprefetcher: Creates a prefetcher for a cache, NULL on failure
+    - freeprefetcher: Frees a prefetcher
+    - prefetch_access: Simulates and counts one demand block access, then issues the prefetches it triggers
+    - runsim_prefetch: Replays a trace through a cache with a prefetcher
+    - print_prefetch: Prints the prefetch counters and the accuracy and coverage they give
+    - makeclassifier: Creates the miss classifier of a cache, with a victim cache of victim_entries lines (0 for none)
+    - freeclassifier: Frees a miss classifier
+    - classify_access: Simulates and counts one block access, classifying a miss and consulting the victim cache
+    - runsim_classify: Replays a trace through a cache with a miss classifier
+    - print_classify: Prints the miss classes and the victim cache counters
+    - runsim_stream: Replays a trace, typically a live pipe or socket, emitting counters per interval
+    - runsim_parallel: Replays a trace with sets partitioned across worker threads
+    - parse_sweep: Expands a sweep specification into a list of configurations
+    - runsweep: Simulates every sweep configuration in a single pass over the trace
+    - runstack: Computes LRU results for every E up to a limit from one stack distance pass
+    - runstack_shard: runstack over one shard of the sets, optionally writing its shard file
+    - parse_shard: Parses a k/N shard specification
+    - cache_shard: Restricts a cache to the sets of shard k of N, dropping other accesses once decoded
+    - write_shard: Writes the counters, and per-set counters if enabled, of a sharded run
+    - merge_shards: Adds up the shard files of a run and prints the whole run's results
+    - load_hierarchy: Builds a cache hierarchy from a config file
+    - freehierarchy: Frees a cache hierarchy
+    - hier_access: Sends one access down a cache hierarchy
+    - runhierarchy: Replays a trace through a cache hierarchy
+    - print_hierarchy: Prints per level counters
+    - hier_stats: Counters of the level with a given name, NULL if there is none
+    - makemulticore: Opens one trace per core and builds their private L1s and the shared LLC
+    - freemulticore: Closes the traces and frees the caches of a multicore run
+    - runmulticore: Interleaves the core traces through the L1s, keeping them coherent with MESI
+    - print_multicore: Prints per core, LLC and coherence counters
+    - multicore_stats: L1 counters of one core, NULL if there is no such core
+    - load_batch: Reads a batch manifest of trace and configuration jobs
+    - freebatch: Frees a batch run and its results
+    - runbatch: Runs every job of a batch on a pool of worker threads, each trace decoded once
+    - write_batch: Writes one result row per job as CSV or JSON
+    - load_regions: Reads a region map of labelled address ranges
+    - freeregions: Frees a region map
+    - region_filter: Keeps only (include) or drops (exclude) the accesses of a comma separated list of labels
+    - region_access: Simulates and counts one block access under its region's label, unless filtered out
+    - runsim_regions: Replays a trace through a cache, attributing every access to a region
+    - print_regions: Prints the hits, misses and evictions of every region label
+    - verbose_flush: Writes out buffered verbose output
+*/
+cache* makecache(int s, int E, int b, int policy, int write_policy);
+void freecache(cache* c);
+void cache_reset(cache* c);
+int cache_sets(const cache* c);
+void cache_geometry(const cache* c, int* s, int* E, int* b);
+void cache_policies(const cache* c, int* policy, int* write_policy);
+int cache_save_state(const cache* c, const cache_stats* stats, const char* path);
+cache* cache_load_state(const char* path, cache_stats* stats);
+void access_cache(cache* c, long unsigned int* address, int write, cache_stats* stats, int* verbose);
+int cache_lookup(cache* c, unsigned long address, int write, unsigned long* evicted, cache_stats* stats);
+int cache_invalidate(cache* c, unsigned long address);
+int cache_line_state(const cache* c, unsigned long address);
+int cache_clean(cache* c, unsigned long address);
+cache_batch* cache_batch_new(void);
+int cache_batch_fill(cache_batch* batch, trace_reader* tracefile, int b);
+void cache_batch_index(const cache* c, cache_batch* batch);
+void cache_access_batch(cache* c, const cache_batch* batch, cache_stats* stats);
+int cache_enable_set_stats(cache* c);
+const set_counts* cache_set_stats(const cache* c);
+int cache_sample_sets(cache* c, int ratio);
+int write_set_stats(const cache* c, const char* path);
+void print_summary(const cache_stats* stats);
+void print_traffic(const cache_stats* stats);
+int parse_policy(const char* name);
+int parse_write_option(const char* name, int flag, const char* set, const char* clear, int* write_policy);
+trace_reader* trace_open(const char* path);
+void trace_close(trace_reader* r);
+int trace_next(trace_reader* r, char* op, unsigned long* address, int* size);
+int convert_trace(const char* inpath, const char* outpath);
+void runsim(cache* c, trace_reader* tracefile, cache_stats* stats, int* verbose);
+void runsim_profile(cache* c, trace_reader* tracefile, cache_stats* stats, cache_profile* profile);
+void print_profile(const cache_profile* profile);
+int runsim_sampled(cache* c, trace_reader* tracefile, const time_sampling* sampling, sample_result* result);
+void print_sample(const sample_result* result);
+int parse_prefetcher(const char* name);
+prefetcher* makeprefetcher(const cache* c, int kind, int degree, int latency);
+void freeprefetcher(prefetcher* p);
+void prefetch_access(cache* c, prefetcher* p, unsigned long address, int write, unsigned long bytes, cache_stats* stats);
+void runsim_prefetch(cache* c, prefetcher* p, trace_reader* tracefile, cache_stats* stats);
+void print_prefetch(const prefetcher* p, const cache_stats* stats);
+classifier* makeclassifier(const cache* c, int victim_entries);
+void freeclassifier(classifier* k);
+void classify_access(cache* c, classifier* k, unsigned long address, int write, unsigned long bytes, cache_stats* stats);
+int runsim_classify(cache* c, classifier* k, trace_reader* tracefile, cache_stats* stats);
+void print_classify(const classifier* k);
+int runsim_stream(cache* c, trace_reader* tracefile, const stream_config* config, cache_stats* stats);
+int runsim_parallel(cache* c, trace_reader* tracefile, int nthreads, cache_stats* stats);
+int parse_sweep(const char* spec, sweep_config** out);
+int runsweep(sweep_config* configs, int n, trace_reader* tracefile, int policy, int write_policy);
+int runstack(trace_reader* tracefile, int s, int b, int Emax);
+int runstack_shard(trace_reader* tracefile, int s, int b, int Emax, int shard, int shards, const char* path);
+int parse_shard(const char* spec, int* shard, int* shards);
+int cache_shard(cache* c, int shard, int shards);
+int write_shard(const cache* c, const cache_stats* stats, const char* path);
+int merge_shards(char** paths, int n, const char* set_stats);
+hierarchy* load_hierarchy(const char* path, int policy, int write_policy);
+void freehierarchy(hierarchy* h);
+void hier_access(hierarchy* h, int entry, unsigned long address, int write, unsigned long bytes, int verbose);
+void runhierarchy(hierarchy* h, trace_reader* tracefile, int verbose);
+void print_hierarchy(const hierarchy* h);
+const cache_stats* hier_stats(const hierarchy* h, const char* name);
+multicore* makemulticore(char** paths, int n, int s, int E, int b, int llc_s, int llc_E, int policy, int interleave);
+void freemulticore(multicore* m);
+int runmulticore(multicore* m, int quantum, int threads);
+void print_multicore(const multicore* m);
+const cache_stats* multicore_stats(const multicore* m, int core);
+batch_run* load_batch(const char* path, int policy, int write_policy);
+void freebatch(batch_run* r);
+int runbatch(batch_run* r, int threads);
+int write_batch(const batch_run* r, const char* path, int format);
+region_map* load_regions(const char* path);
+void freeregions(region_map* m);
+int region_filter(region_map* m, const char* labels, int include);
+void region_access(cache* c, region_map* m, unsigned long address, int write, unsigned long bytes, cache_stats* stats);
+void runsim_regions(cache* c, region_map* m, trace_reader* tracefile, cache_stats* stats);
+void print_regions(const region_map* m);
+void verbose_flush(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,6048 @@
+#define _GNU_SOURCE  // mmap, fstat and friends are not exposed under plain -std=c99
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+#include "cachesim.h"
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LZMA
+#include <lzma.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+/*
+Global variables
+    ADDRESS_LENGTH: Length of memory address in bits
+*/
+#define ADDRESS_LENGTH 64  // 64-bit memory addressing
+
+/*
+Trace reader settings
+    TRACE_CHUNK: Bytes read per refill when the trace cannot be mmapped (pipes, stdin)
+    TRACE_LINE_MAX: Refill once fewer than this many bytes remain so a record never straddles the buffer end
+*/
+#define TRACE_CHUNK (1 << 20)
+#define TRACE_LINE_MAX 256
+
+/*
+Compressed trace settings
+    TRACE_RING: Bytes of decompressed trace buffered between the inflater thread and the parser
+    INFLATE_CHUNK: Bytes the inflater reads and decompresses per step
+    CODEC_MAGIC_MAX: Longest compression magic sniffed at open
+*/
+#define TRACE_RING (8 << 20)
+#define INFLATE_CHUNK (256 << 10)
+#define CODEC_MAGIC_MAX 6
+enum { CODEC_NONE, CODEC_GZIP, CODEC_ZSTD, CODEC_XZ };
+
+/*
+Binary trace settings
+    CTR_MAGIC: First bytes of a binary trace, followed by a version byte
+    CTR_VERSION: Binary trace format version
+    CTR_SIZE_ESCAPE: Size field value meaning the real size follows as a varint
+*/
+#define CTR_MAGIC "CSIMCTR"
+#define CTR_MAGIC_LEN 7
+#define CTR_VERSION 1
+#define CTR_SIZE_ESCAPE 63
+
+/*
+Snapshot settings
+    SNAP_MAGIC: First bytes of a --save-state snapshot
+    SNAP_VERSION: Snapshot format version
+    SNAP_ALIGN: File offset of the line arrays, a page so the body can be mapped in place
+*/
+#define SNAP_MAGIC "CSIMSNAP"
+#define SNAP_MAGIC_LEN 8
+#define SNAP_VERSION 2
+#define SNAP_ALIGN 4096
+
+/*
+Sweep settings
+    SWEEP_BATCH: Accesses decoded per batch before the batch is fed to every configuration
+    SWEEP_MAX_VALUES: Most values a single -S parameter can take
+    SWEEP_MAX_VALUE: Largest value accepted for s, E or b in a sweep
+*/
+#define SWEEP_BATCH 4096
+#define SWEEP_MAX_VALUES 64
+#define SWEEP_MAX_VALUE 65535
+
+/*
+Shard file settings
+    SHARD_MAGIC: First word of a shard result file
+    SHARD_VERSION: Shard result file format version
+    SHARD_LINE_MAX: Longest line of a shard result file
+*/
+#define SHARD_MAGIC "CSIMSHARD"
+#define SHARD_VERSION 1
+#define SHARD_LINE_MAX 256
+
+/*
+Stack distance settings
+    STACK_MAP_INIT: Initial entries in the block -> latest slot hash map (a power of two)
+    STACK_SET_INIT: Minimum slots in a set's Fenwick tree
+*/
+#define STACK_MAP_INIT (1 << 16)
+#define STACK_SET_INIT 64
+
+/*
+Parallel settings
+    PAR_BATCH: Accesses per batch handed to a worker thread
+    PAR_QUEUE_DEPTH: Batches each worker's queue can hold before the parser waits
+    WAIT_SPIN: Polls a thread waiting on a ring makes before it sleeps on the ring's wait_gate
+*/
+#define PAR_BATCH 4096
+#define PAR_QUEUE_DEPTH 8
+#define WAIT_SPIN 2048
+
+/*
+Hierarchy settings
+    HIER_MAX_LEVELS: Most levels a -H config can describe
+    HIER_LINE_MAX: Longest line of a -H config
+*/
+#define HIER_MAX_LEVELS 16
+#define HIER_LINE_MAX 512
+enum { LEVEL_UNIFIED, LEVEL_INSTR, LEVEL_DATA };
+enum { INCLUSION_NINE, INCLUSION_INCLUSIVE, INCLUSION_EXCLUSIVE };
+
+/*
+Batch settings
+    BATCH_CHUNK: Decoded accesses a batch job hands the simulation kernel per call
+    BATCH_POOL_BYTES: Cache arena bytes a batch worker keeps for reuse by its later jobs
+    BATCH_LINE_MAX: Longest line of a batch manifest
+*/
+#define BATCH_CHUNK (1 << 16)
+#define BATCH_POOL_BYTES ((size_t)256 << 20)
+#define BATCH_LINE_MAX 4096
+
+/*
+Region map settings
+    REGION_LINE_MAX: Longest line of a region map
+    REGION_UNMAPPED: Label of the accesses outside every range of a region map
+*/
+#define REGION_LINE_MAX 1024
+#define REGION_UNMAPPED "unmapped"
+
+/*
+Multicore settings
+    MC_DIR_INIT: Initial entries in the coherence directory (a power of two)
+*/
+#define MC_DIR_INIT (1 << 16)
+enum { MC_EVICT, MC_MISS, MC_UPGRADE };
+
+/*
+Batch settings
+    CACHE_PREFETCH: How many accesses ahead cache_access_batch prefetches set state
+    CACHE_PREFETCH_MIN_BYTES: Smallest tag array worth prefetching, smaller ones stay in the host caches
+*/
+#define CACHE_PREFETCH 16
+#define CACHE_PREFETCH_MIN_BYTES (1 << 20)
+
+/*
+Prefetcher settings
+    PF_MAX_DEGREE: Most blocks a prefetcher requests per trigger
+    PF_REGION_BITS: log2 of the bytes of a stride detector region (4 KiB pages)
+    PF_REGIONS: Entries in the stride detector, direct-mapped by region
+    PF_STRIDE_CONFIDENCE: Repeats of a stride before the detector prefetches along it
+    PF_STREAMS: Streams the stream prefetcher tracks at once, replaced LRU
+    PF_STREAM_WINDOW: Blocks around a stream's last miss that still count as part of it
+*/
+#define PF_MAX_DEGREE 16
+#define PF_REGION_BITS 12
+#define PF_REGIONS 256
+#define PF_STRIDE_CONFIDENCE 2
+#define PF_STREAMS 16
+#define PF_STREAM_WINDOW 16
+
+/*
+Miss classification settings
+    CLASSIFY_SEEN_INIT: Initial entries in the set of blocks accessed so far (a power of two)
+    VICTIM_MAX_ENTRIES: Most lines a victim cache can hold
+*/
+#define CLASSIFY_SEEN_INIT (1 << 16)
+#define VICTIM_MAX_ENTRIES 256
+
+/*
+Sampling settings
+    SAMPLE_Z: Normal quantile of the reported confidence intervals (95%)
+*/
+#define SAMPLE_Z 1.96
+
+/*
+Verbose output settings
+    VERBOSE_BUFFER: Bytes of -v output collected before each write to stdout
+*/
+#define VERBOSE_BUFFER (64 << 10)
+
+/*
+Cache storage settings
+    CACHE_ALIGN: Alignment of the cache allocation and of each array inside it (one host cache line)
+    CACHE_MAX_S: Most set index bits a cache can have, so the set count fits an int
+    ARENA_MAP_MIN: Smallest cache arena mapped directly instead of taken from the heap
+    ARENA_HUGE: Huge page size arenas are aligned to and rounded up to
+    CACHESIM_HUGEPAGES (environment): thp (default) asks for transparent huge pages, 2m or 1g maps
+      reserved hugetlbfs pages of that size, falling back to thp when none are free, off keeps
+      every arena on the heap
+*/
+#define CACHE_ALIGN 64
+#define CACHE_MAX_S 30
+#define ARENA_MAP_MIN (1 << 21)
+#define ARENA_HUGE (1 << 21)
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+enum { ARENA_OFF, ARENA_THP, ARENA_2M, ARENA_1G };
+
+/*
+Tag probe settings
+    TAG_MATCH_MIN: Rows narrower than this are compared inline instead of through the SIMD kernel
+*/
+#define TAG_MATCH_MIN 4
+
+/*
+Fixed-geometry kernel settings
+    FIXED_KERNEL_BASE: Index of the first fixed-geometry LRU kernel, after the generic ones
+    fixed_kernel_ways: Associativities with a fixed-geometry LRU kernel, in kernel table order
+*/
+#define FIXED_KERNEL_BASE (1 + 2 * POLICY_COUNT)
+static const int fixed_kernel_ways[] = {2, 4, 8, 16};
+
+/*
+Replacement policy settings
+    WIDE_SET_MIN_E: Associativity at which sets switch to the wide kernels (SIMD probe, LRU way list)
+    LRU_LIST_MAX_E: Largest associativity the 16-bit LRU way list can index
+    RRIP_MAX: Largest 2-bit re-reference prediction value (distant re-reference)
+    BRRIP_EPSILON: BRRIP inserts at RRIP_MAX - 1 once every this many fills on average
+*/
+#define WIDE_SET_MIN_E 8
+#define LRU_LIST_MAX_E 65535
+#define RRIP_MAX 3
+#define BRRIP_EPSILON 32
+
+/*
+Replacement policy names, in POLICY_* order
+*/
+static const char* policy_names[] = {"lru", "fifo", "random", "plru", "srrip", "brrip"};
+
+/*
+Structs:
+    - cache: Defines a cache and its settings. The header and all sets live in one arena as
+      structure-of-arrays rows: set i's tags are tags[i*E .. i*E+E-1], its valid bits
+      are the bitmap valid[i*valid_words ..] (dirty bits likewise), and its replacement
+      state is the repl_stride bytes at repl + i*repl_stride. The per-set counters, if
+      ever enabled, take the room reserved for them after the sets
+    - snap_header: Geometry, policies and counters at the start of a cache snapshot
+    - wait_gate: Condition variable a ring's consumer or producer sleeps on once polling gives up
+    - mem_access: One load or store from the trace, as its first and last byte
+    - trace_inflater: Decompression thread and the byte ring it fills for a compressed trace
+    - trace_reader: Buffered view of a text or binary trace, either an mmapped file or a refillable chunk buffer
+    - sweep_config: One geometry of a -S sweep with its cache and counters
+    - block_map: Open-addressing hash map from block number to latest stack slot
+    - stack_set: Per-set stack distance state of the -M engine
+    - par_batch: Block of accesses handed from the parser to a worker thread
+    - par_worker: Worker thread of -j with its queue and private counters
+    - hier_level: One level of a -H cache hierarchy with its counters
+    - hierarchy: Levels of a -H cache hierarchy and how accesses enter it
+    - verbose_writer: Buffer that -v output is formatted into
+    - pf_region: Stride detector entry of one memory region
+    - pf_stream: Stream prefetcher entry: where the stream is, which way it runs and how far it was prefetched
+    - prefetcher: Prefetcher state, per-line prefetch tags and counters
+    - classifier: Shadow fully-associative LRU cache, first-touch set and victim cache of a classified run
+    - window_sums: Running sums over the measured windows of a time-sampled run
+    - mc_dir: Coherence directory, open-addressing hash map from block to sharing cores
+    - mc_event: Shared-level request a core raised while running ahead on its private L1
+    - mc_core: One core of a multicore run: its trace, L1, pending requests and counters
+    - mc_worker: Host thread running the private L1 work of a subset of cores
+    - multicore: Cores, shared LLC and directory of a multicore run
+    - batch_config: Geometry and policies shared by the batch jobs that use them
+    - batch_job: One trace and configuration of a batch run with its counters
+    - batch_trace: One trace of a batch run, decoded once for all of its jobs
+    - batch_worker: Worker thread of a batch run with its job deque and kept caches
+    - batch_run: Jobs, traces and worker pool of a batch run
+    - region_map: Sorted labelled address ranges with the filters and counters of each label
+    - tag_match_fn: Tag match kernel, returns a bitmask of the ways in a tag row equal to a tag
+*/
+struct cache {
+    uint64_t* tags;  // Tag bits of every line, one packed row of E per set
+    uint64_t* valid;  // Valid bits, one bitmap of valid_words words per set
+    uint64_t* dirty;  // Dirty bits, laid out like valid
+    void* repl;  // Replacement policy state, layout depends on the policy
+    size_t repl_stride;  // Bytes of replacement state per set
+    int policy;  // Replacement policy (POLICY_*)
+    int write_policy;  // WRITE_* flags
+    int kernel;  // Index of the specialized simulation kernel for this policy and associativity
+    int wide;  // 1 for the wide-set kernels (SIMD probe, LRU way list)
+    int valid_words;  // 64-bit words per set in the valid bitmap
+    int s;  // Number of set index bits
+    int E;  // Associativity (number of lines per set)
+    int b;  // Number of block bits
+    int S;  // Number of sets
+    size_t size;  // Bytes of the allocation holding the header and all sets
+    size_t mapped;  // Bytes of the arena mapping, 0 when the arena came from the heap
+    set_counts* set_stats;  // Per-set counters, NULL unless requested
+    set_counts* set_area;  // Room for the per-set counters at the end of the arena
+    uint64_t sample_mask;  // Set sampling keeps sets whose hash has these bits clear, 0 keeps every set
+    int shard;  // Shard this cache simulates, of shards
+    int shards;  // Sharded runs keep only the sets with set % shards == shard, 0 keeps every set
+};
+
+typedef struct {
+    uint64_t region;  // Region number + 1, 0 when unused
+    uint64_t last;  // Block last accessed in the region
+    int64_t stride;  // Last block distance seen
+    int confidence;  // Times in a row that distance repeated, capped at 3
+} pf_region;
+
+typedef struct {
+    uint64_t last;  // Block of the last miss in the stream
+    uint64_t head;  // Next block to prefetch
+    int dir;  // +1 or -1, 0 until a second miss shows the direction
+    int valid;  // 1 once allocated
+    uint64_t used;  // Trigger count at the last match, for LRU replacement
+} pf_stream;
+
+struct prefetcher {
+    int kind;  // PREFETCH_*
+    int degree;  // Blocks requested per trigger (stream: blocks kept ahead of the stream)
+    uint64_t latency;  // Demand accesses a prefetch takes to arrive
+    uint64_t* issued;  // Per line (set * E + way): demand count + 1 when a prefetch filled it, 0 once used or for demand fills
+    uint64_t outstanding;  // Lines with a nonzero issued entry
+    uint64_t* evicted;  // Block + 1 per slot of blocks prefetch fills evicted, direct-mapped by block hash
+    size_t evicted_mask;  // Slots in evicted - 1
+    uint64_t now;  // Demand accesses so far
+    uint64_t triggers;  // Stream triggers so far
+    uint64_t queue[PF_MAX_DEGREE];  // Blocks requested by the current trigger
+    int queued;  // Entries in queue
+    pf_region regions[PF_REGIONS];
+    pf_stream streams[PF_STREAMS];
+    prefetch_stats stats;
+};
+
+typedef struct {
+    char magic[SNAP_MAGIC_LEN];  // SNAP_MAGIC
+    uint32_t version;  // SNAP_VERSION
+    int32_t s, E, b;  // Geometry
+    int32_t policy;  // POLICY_*
+    int32_t write_policy;  // WRITE_* flags
+    int32_t wide;  // Set layout the lines were saved in, see makecache
+    int32_t set_stats;  // 1 if per-set counters follow the body
+    uint64_t sample_mask;  // Set sampling mask of the saved cache
+    uint64_t body;  // Bytes of line arrays and replacement state at offset SNAP_ALIGN
+    cache_stats stats;  // Counters of the run that saved the cache
+} snap_header;
+
+typedef struct {
+    pthread_mutex_t lock;  // Guards the sleep, the ring itself stays lock-free
+    pthread_cond_t cond;  // Broadcast when the ring moves while a thread sleeps
+    int sleepers;  // Threads asleep or about to sleep on cond
+} wait_gate;
+
+typedef struct {
+    unsigned long address;  // First byte
+    unsigned long last;  // Last byte
+    int write;  // 1 for a store
+} mem_access;
+
+typedef struct {
+    unsigned char* ring;  // TRACE_RING bytes of decompressed trace
+    size_t head;  // Bytes taken by the parser, written only by the parser
+    char pad_head[CACHE_ALIGN];  // Keeps head and tail on separate host cache lines
+    size_t tail;  // Bytes produced, written only by the inflater thread
+    char pad_tail[CACHE_ALIGN];
+    int done;  // Set once the inflater has produced everything it will
+    int failed;  // 1 if decompression stopped on an error
+    int stop;  // Set by the parser to make the inflater give up early
+    wait_gate gate;  // Where the inflater waits for room and the parser for bytes
+    int fd;  // Compressed input
+    int codec;  // CODEC_* of the input
+    unsigned char prefix[CODEC_MAGIC_MAX];  // Input bytes consumed while sniffing a stream
+    size_t prefix_len;  // Bytes in prefix
+    pthread_t thread;  // Inflater thread
+} trace_inflater;
+
+struct trace_reader {
+    int fd;  // File descriptor of the trace (0 for stdin)
+    int mapped;  // 1 if buf is an mmap of the whole file, 0 if it is a chunk buffer
+    char* buf;  // Trace bytes
+    size_t pos;  // Offset of the next unread byte
+    size_t len;  // Number of valid bytes in buf
+    int eof;  // 1 once the underlying file has been fully read
+    int binary;  // 1 for the binary .ctr format, 0 for text lackey output
+    uint64_t last_address;  // Previous record's address (binary deltas are relative to it)
+    trace_inflater* inflater;  // Decompression thread feeding buf, NULL for uncompressed traces
+};
+
+struct sweep_config {
+    int s;  // Number of set index bits
+    int E;  // Associativity
+    int b;  // Number of block bits
+    cache* c;  // Cache simulating this configuration
+    cache_stats stats;  // Counters
+};
+
+typedef struct {
+    uint64_t* keys;  // Block number + 1 of each entry, 0 marks an empty entry
+    uint32_t* slots;  // Latest slot of each block in its set's Fenwick tree
+    size_t mask;  // Entries - 1
+    size_t count;  // Occupied entries
+} block_map;
+
+struct classifier {
+    block_map shadow_map;  // Block -> node of the shadow cache, sized for twice its lines so it never grows
+    uint64_t* shadow_block;  // Block held by each node
+    uint32_t* prev;  // Node toward the MRU end, UINT32_MAX at the head
+    uint32_t* next;  // Node toward the LRU end, UINT32_MAX at the tail
+    uint32_t head;  // MRU node
+    uint32_t tail;  // LRU node
+    uint32_t lines;  // Nodes in use
+    uint32_t capacity;  // Lines of the classified cache
+    uint64_t* seen;  // Block + 1 of every block accessed so far, 0 for an empty entry
+    size_t seen_mask;  // Entries in seen - 1
+    size_t seen_count;  // Occupied entries of seen
+    int failed;  // 1 once seen could not grow, first touches stop being recorded after that
+    uint64_t victim[VICTIM_MAX_ENTRIES];  // Block + 1 per victim cache line, 0 if empty
+    uint64_t victim_used[VICTIM_MAX_ENTRIES];  // Clock at the line's insertion; hits leave the victim cache, so oldest is LRU
+    int victim_entries;  // Victim cache lines, 0 without one
+    uint64_t clock;  // Victim cache insertions so far
+    classify_stats stats;
+};
+
+typedef struct {
+    uint32_t* tree;  // Fenwick tree over slots, 1 at the latest slot of each block in the set
+    uint64_t* owner;  // Block number that used each slot
+    uint32_t cap;  // Slots in tree and owner
+    uint32_t next;  // Next unused slot
+    uint32_t distinct;  // Distinct blocks seen by the set
+} stack_set;
+
+typedef struct {
+    mem_access accesses[PAR_BATCH];  // Loads and stores in trace order, split at block boundaries
+    int count;  // Accesses in use
+} par_batch;
+
+typedef struct {
+    par_batch* slots;  // Ring of PAR_QUEUE_DEPTH batches
+    unsigned head;  // Batches consumed, written only by the worker
+    char pad_head[CACHE_ALIGN];  // Keeps head and tail on separate host cache lines
+    unsigned tail;  // Batches published, written only by the parser
+    unsigned tail_local;  // Parser's copy of tail
+    int done;  // Set by the parser once no more batches will be published
+    char pad_tail[CACHE_ALIGN];
+    wait_gate gate;  // Where the worker waits for a batch and the parser for a free slot
+    cache* c;  // Shared cache, the worker only touches its own sets
+    pthread_t thread;  // Worker thread
+    cache_stats stats;  // Private counters
+} par_worker;
+
+typedef struct {
+    char name[32];  // Level name from the config, e.g. L1D
+    cache* c;  // The level's cache
+    int serves;  // LEVEL_* accesses this level takes from the core
+    int inclusion;  // INCLUSION_* relative to the levels above
+    int below;  // Index of the next level down, -1 for memory
+    unsigned above;  // Bitmask of every level whose misses reach this one
+    cache_stats stats;  // Demand hits and misses, evictions by demand or victim fills, traffic
+    uint64_t invalidations;  // Lines removed by back-invalidation from an inclusive level below
+    uint64_t victim_fills;  // Victims of the level above inserted into this exclusive level
+} hier_level;
+
+struct hierarchy {
+    hier_level levels[HIER_MAX_LEVELS];  // Levels in config order
+    int count;  // Levels in use
+    int entry_instr;  // First level for instruction fetches, -1 if fetches are not simulated
+    int entry_data;  // First level for loads and stores
+    uint64_t memory_accesses;  // Demand accesses that missed every level
+};
+
+typedef struct {
+    char buf[VERBOSE_BUFFER];  // Pending -v output
+    size_t len;  // Bytes in buf
+} verbose_writer;
+
+typedef struct {
+    double a, aa;  // Sum of window lengths in accesses, and of their squares
+    double y[3], yy[3], ya[3];  // Per counter: sum of window counts, of their squares, of count * length
+} window_sums;
+
+typedef struct {
+    uint64_t* keys;  // Block number + 1 of each entry, 0 marks an empty entry
+    uint64_t* sharers;  // Cores whose L1 holds the block
+    uint64_t* invalidated;  // Cores whose copy another core's store removed, until they miss on it
+    size_t mask;  // Entries - 1
+    size_t count;  // Occupied entries
+} mc_dir;
+
+typedef struct {
+    uint64_t time;  // Interleave position of the access that raised it
+    unsigned long address;  // Block address
+    int kind;  // MC_*
+    int flag;  // MC_MISS: 1 for a store, MC_EVICT: 1 if the victim was dirty
+} mc_event;
+
+typedef struct {
+    const char* path;  // Trace file
+    trace_reader* trace;  // The core's trace
+    cache* l1;  // Private L1
+    uint64_t clock;  // Interleave position of the next record
+    int pending;  // 1 if op, address and size hold a record the last quantum did not reach
+    char op;
+    unsigned long address;
+    int size;
+    int eof;  // 1 once the trace is exhausted
+    mc_event* events;  // Requests for the shared level raised this quantum, in order
+    size_t nevents;  // Requests in use
+    size_t cap;  // Requests allocated
+    int failed;  // 1 if the request queue could not grow
+    cache_stats stats;  // L1 hits, misses, evictions and traffic
+    uint64_t coherence_misses;  // Misses on blocks another core's store had invalidated
+    uint64_t upgrades;  // Stores to shared lines that had to invalidate the other copies
+    uint64_t invalidations;  // Lines this L1 lost to other cores' stores
+} mc_core;
+
+typedef struct {
+    multicore* m;  // The run
+    int first;  // First core this thread simulates, then every stride-th
+    int stride;  // Host threads in the run
+    pthread_t thread;
+} mc_worker;
+
+struct multicore {
+    mc_core cores[MC_MAX_CORES];  // Cores in --cores order
+    int count;  // Cores in use
+    int interleave;  // INTERLEAVE_*
+    cache* llc;  // Shared last-level cache
+    cache_stats llc_stats;  // LLC demand hits and misses, and traffic to memory
+    uint64_t llc_writebacks;  // Dirty L1 lines written into the LLC
+    mc_dir dir;  // Which L1s hold each block
+    uint64_t invalidations;  // Invalidation messages sent to L1s
+    uint64_t interventions;  // Dirty lines an L1 had to give up or write back for another core
+    uint64_t end;  // Interleave position the current quantum runs to
+    int stop;  // Set once every trace is exhausted
+    pthread_mutex_t gate;  // Held while the workers are started and the barriers sized to them
+    pthread_barrier_t start;  // Releases the workers into a quantum
+    pthread_barrier_t done;  // Collects them once their cores reach the quantum end
+};
+
+typedef struct {
+    int s;  // Number of set index bits
+    int E;  // Associativity
+    int b;  // Number of block bits
+    int policy;  // POLICY_*
+    int write_policy;  // WRITE_* flags
+} batch_config;
+
+typedef struct {
+    int trace;  // Index of the job's trace in the run
+    int config;  // Index of the job's geometry and policies in the run
+    int status;  // 0 once simulated, 1 when its trace or cache could not be set up
+    cache_stats stats;  // Counters
+} batch_job;
+
+typedef struct {
+    char* path;  // Trace file
+    int* jobs;  // Indices of the jobs replaying this trace
+    int count;  // Entries in jobs
+    int cap;  // Room in jobs
+    mem_access* accesses;  // The decoded trace, shared by its jobs until the last one finishes
+    size_t n;  // Entries in accesses
+    int remaining;  // Jobs of this trace not yet finished
+} batch_trace;
+
+typedef struct {
+    batch_run* run;  // The run this worker belongs to
+    int id;  // Index among the run's workers
+    int* deque;  // Job indices: the owner pushes and pops at bottom, thieves take from top
+    int top;  // First job thieves take
+    int bottom;  // One past the job the owner pops next
+    pthread_mutex_t lock;  // Guards deque, top and bottom
+    cache** caches;  // Per configuration, a cache kept from an earlier job or NULL
+    uint64_t* used;  // Per configuration, the job count at its cache's last use
+    size_t bytes;  // Arena bytes of the kept caches
+    uint64_t clock;  // Jobs this worker ran
+    pthread_t thread;
+} batch_worker;
+
+struct batch_run {
+    batch_job* jobs;  // Jobs in manifest order
+    int njobs;  // Entries in jobs
+    int jobs_cap;  // Room in jobs
+    batch_config* configs;  // Distinct geometry and policy combinations of the jobs
+    int nconfigs;  // Entries in configs
+    int configs_cap;  // Room in configs
+    block_map config_index;  // Packed configuration -> index in configs
+    batch_trace* traces;  // Distinct traces of the jobs
+    int ntraces;  // Entries in traces
+    int traces_cap;  // Room in traces
+    batch_worker* workers;  // Worker pool of runbatch
+    int nworkers;  // Entries in workers
+    pthread_mutex_t lock;  // Guards next_trace and decoding
+    pthread_cond_t wake;  // Signalled whenever a worker finishes decoding a trace
+    int next_trace;  // First trace no worker has taken yet
+    int decoding;  // Traces taken whose jobs are not pushed yet
+};
+
+struct region_map {
+    uint64_t* starts;  // First byte of each range, sorted
+    uint64_t* ends;  // One past the last byte of each range
+    int* labels;  // Label of each range
+    int count;  // Ranges
+    int cap;  // Room in starts, ends and labels
+    char** names;  // Label names, names[0] is REGION_UNMAPPED
+    int nlabels;  // Entries in names
+    int names_cap;  // Room in names
+    unsigned char* keep;  // Per label, 1 when the filters let its accesses through
+    set_counts* counts;  // Per label hits, misses and evictions
+    uint64_t filtered;  // Block accesses the filters skipped
+    int last;  // Range the previous lookup landed in, -1 for none
+};
+
+typedef uint64_t (*tag_match_fn)(const uint64_t* tags, int n, uint64_t tag);
+
+/*
+Functions (the public ones are listed in cachesim.h):
+    - trace_batch: Decodes trace records into a block of load/store first and last byte addresses
+    - select_tag_match: Picks the widest tag match kernel the host supports
+    - cache_alloc: Allocates an empty cache with a given set layout, the part of makecache a snapshot load repeats
+    - write_stack_shard: Writes the stack distance histogram and set fills of one shard of a -M run
+    - write_set_counts: Writes per-set counters as the --set-stats CSV
+*/
+/////////////////////// Function prototypes ///////////////////////////
+int trace_batch(trace_reader* r, mem_access* out, int max);
+static void select_tag_match(void);
+static cache* cache_alloc(int s, int E, int b, int policy, int write_policy, int wide);
+static int write_stack_shard(const char* path, int s, int b, int Emax, int shard, int shards,
+                             const uint64_t* hist, const uint64_t* fills);
+static int write_set_counts(const set_counts* sets, int S, const char* path);
+
+void print_summary(const cache_stats* stats){
+    printf("hits:%llu misses:%llu evictions:%llu\n", (unsigned long long)stats->hits,
+           (unsigned long long)stats->misses, (unsigned long long)stats->evictions);
+}
+
+void print_traffic(const cache_stats* stats) {
+    printf("dirty_evictions:%llu bytes_read:%llu bytes_written:%llu\n", (unsigned long long)stats->dirty_evictions,
+           (unsigned long long)stats->bytes_read, (unsigned long long)stats->bytes_written);
+}
+
+
+int parse_policy(const char* name) {
+    for (int i = 0; i < POLICY_COUNT; i++) {
+        if (strcmp(name, policy_names[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int parse_write_option(const char* name, int flag, const char* set, const char* clear, int* write_policy) {
+    if (strcmp(name, set) == 0) {
+        *write_policy |= flag;
+        return 1;
+    }
+    if (strcmp(name, clear) == 0) {
+        *write_policy &= ~flag;
+        return 1;
+    }
+    return 0;
+}
+
+// Rounds n up to a multiple of CACHE_ALIGN
+static size_t align_up(size_t n) {
+    return (n + CACHE_ALIGN - 1) & ~(size_t)(CACHE_ALIGN - 1);
+}
+
+// Bytes of replacement state one set needs under a policy
+static size_t repl_bytes(int policy, int E, int wide) {
+    switch (policy) {
+        case POLICY_LRU:
+            return wide ? (2 * (size_t)E + 2) * sizeof(uint16_t) : (size_t)E * sizeof(int);
+        case POLICY_FIFO:
+            return ((size_t)E + 2) * sizeof(uint32_t);  // Head, count, then the ways in fill order
+        case POLICY_RANDOM:
+            return sizeof(uint64_t);  // Random number state
+        case POLICY_PLRU:
+            return (((size_t)E - 1 + 63) / 64) * sizeof(uint64_t);
+        case POLICY_SRRIP:
+            return (((size_t)E + 31) / 32) * sizeof(uint64_t);
+        case POLICY_BRRIP:
+            return (((size_t)E + 31) / 32 + 1) * sizeof(uint64_t);  // Lanes, then random number state
+        default:
+            return 0;
+    }
+}
+
+cache* makecache(int s, int E, int b, int policy, int write_policy) {
+    // Tree PLRU needs a complete binary tree over the ways
+    if (policy == POLICY_PLRU && (E & (E - 1)) != 0) {
+        printf("PLRU needs a power-of-two number of lines per set\n");
+        return NULL;
+    }
+
+    // Narrow sets compare tags inline and use LRU counters, wide sets use the SIMD probe
+    // and the constant time way list
+    int wide = E >= WIDE_SET_MIN_E && E <= LRU_LIST_MAX_E;
+    const char* lru_mode = getenv("CACHESIM_LRU");  // counter|list overrides the choice for testing
+    if (policy == POLICY_LRU && lru_mode && strcmp(lru_mode, "counter") == 0) {
+        wide = 0;
+    }
+    else if (policy == POLICY_LRU && lru_mode && strcmp(lru_mode, "list") == 0 && E <= LRU_LIST_MAX_E) {
+        wide = 1;
+    }
+    return cache_alloc(s, E, b, policy, write_policy, wide);
+}
+
+/*
+Cache arenas
+    Small arenas come from the heap. Large ones are mapped anonymously, aligned to ARENA_HUGE so
+    they can be backed by huge pages, which keeps host TLB misses down on big geometries. Mapped
+    memory arrives zeroed and is not touched here, so each page is faulted in by the first
+    thread to simulate a set on it and, under the default first-touch policy, lands on that
+    thread's NUMA node
+*/
+static int arena_mode(void) {
+    const char* mode = getenv("CACHESIM_HUGEPAGES");
+    if (!mode || strcmp(mode, "thp") == 0) return ARENA_THP;
+    if (strcmp(mode, "off") == 0) return ARENA_OFF;
+    if (strcmp(mode, "2m") == 0) return ARENA_2M;
+    if (strcmp(mode, "1g") == 0) return ARENA_1G;
+    return ARENA_THP;
+}
+
+// Maps len bytes aligned to align, trimming the slack around the aligned range
+static void* arena_map_aligned(size_t len, size_t align) {
+    size_t slack = len + align;
+    char* raw = (char*)mmap(NULL, slack, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED) {
+        return NULL;
+    }
+    char* start = (char*)(((uintptr_t)raw + align - 1) & ~(uintptr_t)(align - 1));
+    if (start > raw) {
+        munmap(raw, (size_t)(start - raw));
+    }
+    size_t tail = (size_t)(raw + slack - (start + len));
+    if (tail) {
+        munmap(start + len, tail);
+    }
+    return start;
+}
+
+// Zeroed memory for a cache arena; *mapped is the mapping length to unmap, 0 for heap memory
+static void* arena_alloc(size_t bytes, size_t* mapped) {
+    int mode = arena_mode();
+    *mapped = 0;
+    if (mode == ARENA_OFF || bytes < ARENA_MAP_MIN) {
+        void* block = NULL;
+        if (posix_memalign(&block, CACHE_ALIGN, bytes) != 0) {
+            return NULL;
+        }
+        memset(block, 0, bytes);
+        return block;
+    }
+    if (mode == ARENA_2M || mode == ARENA_1G) {
+        size_t page = mode == ARENA_1G ? (size_t)1 << 30 : (size_t)1 << 21;
+        size_t len = (bytes + page - 1) & ~(page - 1);
+        int size_flag = (mode == ARENA_1G ? 30 : 21) << MAP_HUGE_SHIFT;
+        void* block = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | size_flag, -1, 0);
+        if (block != MAP_FAILED) {
+            *mapped = len;
+            return block;
+        }
+        // No reserved pages of that size: transparent huge pages are the next best thing
+    }
+    size_t len = (bytes + ARENA_HUGE - 1) & ~(size_t)(ARENA_HUGE - 1);
+    void* block = arena_map_aligned(len, ARENA_HUGE);
+    if (!block) {
+        return NULL;
+    }
+#ifdef MADV_HUGEPAGE
+    madvise(block, len, MADV_HUGEPAGE);
+#endif
+    *mapped = len;
+    return block;
+}
+
+static cache* cache_alloc(int s, int E, int b, int policy, int write_policy, int wide) {
+    // The tag match kernel is picked once, by whichever cache is created first
+    static pthread_once_t tag_match_once = PTHREAD_ONCE_INIT;
+    pthread_once(&tag_match_once, select_tag_match);
+
+    // The set count must fit an int, the tag shift must stay below the address width, and the
+    // line array must fit in memory before any of it is sized
+    if (s < 0 || s > CACHE_MAX_S || b < 0 || s + b >= ADDRESS_LENGTH || E <= 0
+            || (size_t)E > (SIZE_MAX / sizeof(uint64_t)) >> (s + 1)) {
+        printf("Invalid cache geometry s=%d E=%d b=%d: s takes 0 to %d, E at least 1, and s + b must be below %d\n",
+               s, E, b, CACHE_MAX_S, ADDRESS_LENGTH);
+        return NULL;
+    }
+
+    // Calculate the number of sets (S = 2^s)
+    int S = 1 << s;
+    int valid_words = (E + 63) / 64;
+
+    // Lay out the header and the four per-set arrays back to back in one block
+    size_t lines = (size_t)S * (size_t)E;
+    size_t stride = E == 1 ? 0 : repl_bytes(policy, E, wide);
+    size_t bitmap = align_up((size_t)S * (size_t)valid_words * sizeof(uint64_t));
+    size_t tags_off = align_up(sizeof(cache));
+    size_t valid_off = tags_off + align_up(lines * sizeof(uint64_t));
+    size_t dirty_off = valid_off + bitmap;
+    size_t repl_off = dirty_off + bitmap;
+    size_t total = repl_off + align_up((size_t)S * stride);
+    size_t arena = total + align_up((size_t)S * sizeof(set_counts));
+
+    // Allocate memory for the whole cache. Every line starts invalid with tag 0, and all
+    // replacement state starts at zero
+    size_t mapped;
+    void* block = arena_alloc(arena, &mapped);
+    if (!block) {
+       printf("Error allocating memory for cache sim\n");
+       return NULL;
+    }
+
+    // Initialize cache parameters
+    cache* cachesim = (cache*)block;
+    cachesim->tags = (uint64_t*)((char*)block + tags_off);
+    cachesim->valid = (uint64_t*)((char*)block + valid_off);
+    cachesim->dirty = (uint64_t*)((char*)block + dirty_off);
+    cachesim->repl = (char*)block + repl_off;
+    cachesim->repl_stride = stride;
+    cachesim->policy = policy;
+    cachesim->write_policy = write_policy;
+    cachesim->kernel = E == 1 ? 0 : 1 + 2 * policy + wide;
+    const char* kernel_mode = getenv("CACHESIM_KERNEL");  // generic skips the fixed kernels for testing
+    if (policy == POLICY_LRU && !(kernel_mode && strcmp(kernel_mode, "generic") == 0)) {
+        for (int i = 0; i < (int)(sizeof(fixed_kernel_ways) / sizeof(fixed_kernel_ways[0])); i++) {
+            // A fixed kernel only takes over when its LRU state layout is the one this cache uses
+            if (fixed_kernel_ways[i] == E && (E >= WIDE_SET_MIN_E) == wide) {
+                cachesim->kernel = FIXED_KERNEL_BASE + i;
+            }
+        }
+    }
+    cachesim->wide = wide;
+    cachesim->valid_words = valid_words;
+    cachesim->s = s;
+    cachesim->E = E;
+    cachesim->b = b;
+    cachesim->S = S;
+    cachesim->size = total;
+    cachesim->mapped = mapped;
+    cachesim->set_area = (set_counts*)((char*)block + total);
+    return cachesim;  // Return the created cache
+}
+
+void cache_reset(cache* c) {
+    // Same state makecache leaves behind: every line invalid and clean, all replacement state zero
+    memset(c->tags, 0, c->size - (size_t)((char*)c->tags - (char*)c));
+    if (c->set_stats) {
+        memset(c->set_stats, 0, (size_t)c->S * sizeof(set_counts));
+    }
+}
+
+int cache_sets(const cache* c) {
+    return c->S;
+}
+
+void cache_geometry(const cache* c, int* s, int* E, int* b) {
+    *s = c->s;
+    *E = c->E;
+    *b = c->b;
+}
+
+void cache_policies(const cache* c, int* policy, int* write_policy) {
+    *policy = c->policy;
+    *write_policy = c->write_policy;
+}
+
+void freecache(cache* c) {
+    // Everything the cache owns is in its arena
+    if (c && c->mapped) {
+        munmap(c, c->mapped);
+    }
+    else {
+        free(c);
+    }
+}
+
+/*
+Cache snapshots
+    A snapshot is a snap_header, zero padding up to SNAP_ALIGN, then the cache allocation from
+    the tags on byte for byte (tags, valid and dirty bitmaps, replacement state including the
+    per-set random state), then the per-set counters if they were on. The body keeps the
+    in-memory layout, so loading is one mapping and one copy and the result simulates exactly
+    like the cache that was saved. Snapshots are host-endian and tied to SNAP_VERSION
+*/
+int cache_save_state(const cache* c, const cache_stats* stats, const char* path) {
+    FILE* out = fopen(path, "wb");
+    if (!out) {
+        printf("Error opening %s\n", path);
+        return 1;
+    }
+    unsigned char page[SNAP_ALIGN] = {0};
+    snap_header* h = (snap_header*)page;
+    memcpy(h->magic, SNAP_MAGIC, SNAP_MAGIC_LEN);
+    h->version = SNAP_VERSION;
+    h->s = c->s;
+    h->E = c->E;
+    h->b = c->b;
+    h->policy = c->policy;
+    h->write_policy = c->write_policy;
+    h->wide = c->wide;
+    h->set_stats = c->set_stats != NULL;
+    h->sample_mask = c->sample_mask;
+    h->body = c->size - (size_t)((char*)c->tags - (char*)c);
+    h->stats = *stats;
+
+    int ok = fwrite(page, 1, SNAP_ALIGN, out) == SNAP_ALIGN && fwrite(c->tags, 1, h->body, out) == h->body;
+    if (ok && c->set_stats) {
+        ok = fwrite(c->set_stats, sizeof(set_counts), (size_t)c->S, out) == (size_t)c->S;
+    }
+    ok = fclose(out) == 0 && ok;
+    if (!ok) {
+        printf("Error writing %s\n", path);
+    }
+    return !ok;
+}
+
+cache* cache_load_state(const char* path, cache_stats* stats) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        printf("Error opening %s\n", path);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return NULL;
+    }
+    size_t len = (size_t)st.st_size;
+    void* map = len >= SNAP_ALIGN ? mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    const snap_header* h = (const snap_header*)map;
+    if (map == MAP_FAILED || memcmp(h->magic, SNAP_MAGIC, SNAP_MAGIC_LEN) != 0 || h->version != SNAP_VERSION) {
+        printf("%s is not a cache snapshot\n", path);
+        if (map != MAP_FAILED) {
+            munmap(map, len);
+        }
+        return NULL;
+    }
+
+    // The header is checked against the layout it implies before anything is copied
+    cache* c = NULL;
+    if (h->s >= 0 && h->s <= CACHE_MAX_S && h->E > 0 && h->b >= 0 && h->s + h->b < ADDRESS_LENGTH && h->policy >= 0
+            && h->policy < POLICY_COUNT && (h->policy != POLICY_PLRU || (h->E & (h->E - 1)) == 0)
+            && (h->wide == 0 || (h->wide == 1 && h->E <= LRU_LIST_MAX_E))) {
+        c = cache_alloc(h->s, h->E, h->b, h->policy, h->write_policy, h->wide);
+    }
+    size_t body = c ? c->size - (size_t)((char*)c->tags - (char*)c) : 0;
+    size_t counts = c && h->set_stats ? (size_t)c->S * sizeof(set_counts) : 0;
+    if (!c || h->body != body || len != SNAP_ALIGN + body + counts || (counts && !cache_enable_set_stats(c))) {
+        printf("%s is truncated or does not match its geometry\n", path);
+        freecache(c);
+        munmap(map, len);
+        return NULL;
+    }
+    memcpy(c->tags, (const char*)map + SNAP_ALIGN, body);
+    if (counts) {
+        memcpy(c->set_stats, (const char*)map + SNAP_ALIGN + body, counts);
+    }
+    c->sample_mask = h->sample_mask;
+    *stats = h->stats;
+    munmap(map, len);
+    return c;
+}
+
+/*
+Blocking waits
+    The single-producer single-consumer rings poll the other side's index for WAIT_SPIN tries,
+    which covers the short stalls, and then sleep on the ring's wait_gate. A thread that moves
+    an index calls wait_wake, which only takes the lock when someone sleeps. Both sides touch
+    the sleeper count with a read-modify-write: if the waker's comes first, the sleeper's reads
+    from it and its last check sees the new index, otherwise the waker sees the sleeper, so no
+    wake-up is lost.
+*/
+static int wait_gate_init(wait_gate* g) {
+    g->sleepers = 0;
+    if (pthread_mutex_init(&g->lock, NULL) != 0) {
+        return 0;
+    }
+    if (pthread_cond_init(&g->cond, NULL) != 0) {
+        pthread_mutex_destroy(&g->lock);
+        return 0;
+    }
+    return 1;
+}
+
+static void wait_gate_destroy(wait_gate* g) {
+    pthread_cond_destroy(&g->cond);
+    pthread_mutex_destroy(&g->lock);
+}
+
+// Returns once ready(arg) holds
+static void wait_until(wait_gate* g, int (*ready)(const void* arg), const void* arg) {
+    for (int i = 0; i < WAIT_SPIN; i++) {
+        if (ready(arg)) {
+            return;
+        }
+    }
+    pthread_mutex_lock(&g->lock);
+    __atomic_add_fetch(&g->sleepers, 1, __ATOMIC_ACQ_REL);
+    while (!ready(arg)) {
+        pthread_cond_wait(&g->cond, &g->lock);
+    }
+    __atomic_sub_fetch(&g->sleepers, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&g->lock);
+}
+
+// Wakes whoever sleeps on the gate, called after every store a sleeper may be waiting for
+static inline void wait_wake(wait_gate* g) {
+    if (__atomic_fetch_add(&g->sleepers, 0, __ATOMIC_ACQ_REL)) {
+        pthread_mutex_lock(&g->lock);
+        pthread_cond_broadcast(&g->cond);
+        pthread_mutex_unlock(&g->lock);
+    }
+}
+
+static void trace_refill(trace_reader* r);
+
+// Switches the reader to the binary format if the trace starts with the .ctr header
+static void trace_detect(trace_reader* r) {
+    if (r->len - r->pos > CTR_MAGIC_LEN && memcmp(r->buf + r->pos, CTR_MAGIC, CTR_MAGIC_LEN) == 0
+            && (unsigned char)r->buf[r->pos + CTR_MAGIC_LEN] == CTR_VERSION) {
+        r->binary = 1;
+        r->pos += CTR_MAGIC_LEN + 1;
+    }
+}
+
+/*
+Compressed traces
+    gzip, zstd and xz traces are recognised by their magic bytes and decompressed by a
+    separate thread into a TRACE_RING byte ring. The parser drains the ring through the same
+    chunk buffer pipes use, so decompression overlaps with simulation and nothing is written
+    to disk. The ring is single-producer single-consumer: tail is advanced only by the
+    inflater thread and head only by the parser. Codecs are compiled in when their library
+    is available (HAVE_ZLIB, HAVE_ZSTD, HAVE_LZMA).
+*/
+static int detect_codec(const unsigned char* m, size_t n) {
+    if (n >= 2 && m[0] == 0x1f && m[1] == 0x8b) return CODEC_GZIP;
+    if (n >= 4 && m[0] == 0x28 && m[1] == 0xb5 && m[2] == 0x2f && m[3] == 0xfd) return CODEC_ZSTD;
+    if (n >= 6 && memcmp(m, "\xfd" "7zXZ\0", 6) == 0) return CODEC_XZ;
+    return CODEC_NONE;
+}
+
+static const char* codec_names[] = {"none", "gzip", "zstd", "xz"};
+
+// Parser side: the ring holds bytes or the inflater is done
+static int inflater_has_data(const void* arg) {
+    const trace_inflater* z = (const trace_inflater*)arg;
+    return __atomic_load_n(&z->tail, __ATOMIC_ACQUIRE) != z->head || __atomic_load_n(&z->done, __ATOMIC_ACQUIRE);
+}
+
+// Helpers shared by the codec loops, only built when at least one codec is
+#if defined(HAVE_ZLIB) || defined(HAVE_ZSTD) || defined(HAVE_LZMA)
+// Reads compressed input, the sniffed prefix first. Returns bytes read, 0 at EOF, -1 on error
+static ssize_t inflater_input(trace_inflater* z, unsigned char* dst, size_t n) {
+    if (z->prefix_len) {
+        size_t k = z->prefix_len < n ? z->prefix_len : n;
+        memcpy(dst, z->prefix, k);
+        memmove(z->prefix, z->prefix + k, z->prefix_len - k);
+        z->prefix_len -= k;
+        return (ssize_t)k;
+    }
+    for (;;) {
+        ssize_t got = read(z->fd, dst, n);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        return got;
+    }
+}
+
+// Inflater side: the ring has room or the parser asked to stop
+static int inflater_has_room(const void* arg) {
+    const trace_inflater* z = (const trace_inflater*)arg;
+    return z->tail - __atomic_load_n(&z->head, __ATOMIC_ACQUIRE) != TRACE_RING || __atomic_load_n(&z->stop, __ATOMIC_ACQUIRE);
+}
+
+// Copies decompressed bytes into the ring, waiting for the parser to make room. Returns 0 if asked to stop
+static int inflater_output(trace_inflater* z, const unsigned char* src, size_t n) {
+    while (n > 0) {
+        size_t head = __atomic_load_n(&z->head, __ATOMIC_ACQUIRE);
+        size_t room = TRACE_RING - (z->tail - head);
+        if (room == 0) {
+            if (__atomic_load_n(&z->stop, __ATOMIC_ACQUIRE)) {
+                return 0;
+            }
+            wait_until(&z->gate, inflater_has_room, z);
+            continue;
+        }
+        size_t k = n < room ? n : room;
+        size_t at = z->tail % TRACE_RING;
+        size_t first = k < TRACE_RING - at ? k : TRACE_RING - at;
+        memcpy(z->ring + at, src, first);
+        memcpy(z->ring, src + first, k - first);
+        src += k;
+        n -= k;
+        __atomic_store_n(&z->tail, z->tail + k, __ATOMIC_RELEASE);
+        wait_wake(&z->gate);
+    }
+    return 1;
+}
+#endif
+
+#ifdef HAVE_ZLIB
+static int inflate_gzip(trace_inflater* z, unsigned char* in, unsigned char* out) {
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit2(&zs, 15 + 32) != Z_OK) {  // +32: accept gzip and zlib headers
+        return 0;
+    }
+    int ok = 1, ret = Z_OK;
+    for (;;) {
+        if (zs.avail_in == 0) {
+            ssize_t got = inflater_input(z, in, INFLATE_CHUNK);
+            if (got <= 0) {
+                ok = got == 0 && ret == Z_STREAM_END;
+                break;
+            }
+            zs.next_in = in;
+            zs.avail_in = (uInt)got;
+        }
+        // Concatenated gzip members decode back to back
+        if (ret == Z_STREAM_END && inflateReset(&zs) != Z_OK) {
+            ok = 0;
+            break;
+        }
+        zs.next_out = out;
+        zs.avail_out = INFLATE_CHUNK;
+        ret = inflate(&zs, Z_NO_FLUSH);
+        if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+            ok = 0;
+            break;
+        }
+        if (!inflater_output(z, out, INFLATE_CHUNK - zs.avail_out)) {
+            break;
+        }
+    }
+    inflateEnd(&zs);
+    return ok;
+}
+#endif
+
+#ifdef HAVE_ZSTD
+static int inflate_zstd(trace_inflater* z, unsigned char* in, unsigned char* out) {
+    ZSTD_DStream* ds = ZSTD_createDStream();
+    if (!ds) {
+        return 0;
+    }
+    ZSTD_initDStream(ds);
+    int ok = 1;
+    size_t ret = 0;
+    ZSTD_inBuffer src = {in, 0, 0};
+    for (;;) {
+        if (src.pos == src.size) {
+            ssize_t got = inflater_input(z, in, INFLATE_CHUNK);
+            if (got <= 0) {
+                ok = got == 0 && ret == 0;  // ret 0 means the last frame was complete
+                break;
+            }
+            src.size = (size_t)got;
+            src.pos = 0;
+        }
+        ZSTD_outBuffer dst = {out, INFLATE_CHUNK, 0};
+        ret = ZSTD_decompressStream(ds, &dst, &src);
+        if (ZSTD_isError(ret)) {
+            ok = 0;
+            break;
+        }
+        if (!inflater_output(z, out, dst.pos)) {
+            break;
+        }
+    }
+    ZSTD_freeDStream(ds);
+    return ok;
+}
+#endif
+
+#ifdef HAVE_LZMA
+static int inflate_xz(trace_inflater* z, unsigned char* in, unsigned char* out) {
+    lzma_stream xs = LZMA_STREAM_INIT;
+    if (lzma_stream_decoder(&xs, UINT64_MAX, LZMA_CONCATENATED) != LZMA_OK) {
+        return 0;
+    }
+    int ok = 1;
+    lzma_action action = LZMA_RUN;
+    for (;;) {
+        if (xs.avail_in == 0 && action == LZMA_RUN) {
+            ssize_t got = inflater_input(z, in, INFLATE_CHUNK);
+            if (got < 0) {
+                ok = 0;
+                break;
+            }
+            if (got == 0) {
+                action = LZMA_FINISH;  // Lets the decoder check the stream really ended
+            }
+            xs.next_in = in;
+            xs.avail_in = (size_t)got;
+        }
+        xs.next_out = out;
+        xs.avail_out = INFLATE_CHUNK;
+        lzma_ret ret = lzma_code(&xs, action);
+        if (!inflater_output(z, out, INFLATE_CHUNK - xs.avail_out)) {
+            break;
+        }
+        if (ret == LZMA_STREAM_END) {
+            break;
+        }
+        if (ret != LZMA_OK) {
+            ok = 0;
+            break;
+        }
+    }
+    lzma_end(&xs);
+    return ok;
+}
+#endif
+
+static void* inflater_main(void* arg) {
+    trace_inflater* z = (trace_inflater*)arg;
+    unsigned char* in = (unsigned char*)malloc(INFLATE_CHUNK);
+    unsigned char* out = (unsigned char*)malloc(INFLATE_CHUNK);
+    int ok = 0;
+    if (in && out) {
+        switch (z->codec) {
+#ifdef HAVE_ZLIB
+            case CODEC_GZIP: ok = inflate_gzip(z, in, out); break;
+#endif
+#ifdef HAVE_ZSTD
+            case CODEC_ZSTD: ok = inflate_zstd(z, in, out); break;
+#endif
+#ifdef HAVE_LZMA
+            case CODEC_XZ: ok = inflate_xz(z, in, out); break;
+#endif
+            default: break;
+        }
+    }
+    free(in);
+    free(out);
+    z->failed = !ok;
+    __atomic_store_n(&z->done, 1, __ATOMIC_RELEASE);
+    wait_wake(&z->gate);
+    return NULL;
+}
+
+static int codec_supported(int codec) {
+    switch (codec) {
+#ifdef HAVE_ZLIB
+        case CODEC_GZIP: return 1;
+#endif
+#ifdef HAVE_ZSTD
+        case CODEC_ZSTD: return 1;
+#endif
+#ifdef HAVE_LZMA
+        case CODEC_XZ: return 1;
+#endif
+        default: return 0;
+    }
+}
+
+// Copies up to n decompressed bytes out of the ring. Returns bytes copied, 0 once the stream has ended
+static ssize_t inflater_read(trace_inflater* z, char* dst, size_t n) {
+    for (;;) {
+        size_t tail = __atomic_load_n(&z->tail, __ATOMIC_ACQUIRE);
+        size_t avail = tail - z->head;
+        if (avail == 0) {
+            if (__atomic_load_n(&z->done, __ATOMIC_ACQUIRE)) {
+                // Recheck: the last bytes may have landed between the two loads
+                if (__atomic_load_n(&z->tail, __ATOMIC_ACQUIRE) != z->head) {
+                    continue;
+                }
+                if (z->failed) {
+                    printf("Error decompressing %s trace, results cover only the data before the error\n", codec_names[z->codec]);
+                }
+                return 0;
+            }
+            wait_until(&z->gate, inflater_has_data, z);
+            continue;
+        }
+        size_t k = n < avail ? n : avail;
+        size_t at = z->head % TRACE_RING;
+        size_t first = k < TRACE_RING - at ? k : TRACE_RING - at;
+        memcpy(dst, z->ring + at, first);
+        memcpy(dst + first, z->ring, k - first);
+        __atomic_store_n(&z->head, z->head + k, __ATOMIC_RELEASE);
+        wait_wake(&z->gate);
+        return (ssize_t)k;
+    }
+}
+
+// Starts an inflater thread for fd, replaying the already consumed prefix bytes first
+static trace_inflater* inflater_start(int fd, int codec, const unsigned char* prefix, size_t prefix_len) {
+    trace_inflater* z = (trace_inflater*)calloc(1, sizeof(trace_inflater));
+    if (!z) {
+        return NULL;
+    }
+    z->ring = (unsigned char*)malloc(TRACE_RING);
+    z->fd = fd;
+    z->codec = codec;
+    memcpy(z->prefix, prefix, prefix_len);
+    z->prefix_len = prefix_len;
+    if (!z->ring || !wait_gate_init(&z->gate)) {
+        free(z->ring);
+        free(z);
+        return NULL;
+    }
+    if (pthread_create(&z->thread, NULL, inflater_main, z) != 0) {
+        wait_gate_destroy(&z->gate);
+        free(z->ring);
+        free(z);
+        return NULL;
+    }
+    return z;
+}
+
+static void inflater_stop(trace_inflater* z) {
+    __atomic_store_n(&z->stop, 1, __ATOMIC_RELEASE);
+    wait_wake(&z->gate);
+    pthread_join(z->thread, NULL);
+    wait_gate_destroy(&z->gate);
+    free(z->ring);
+    free(z);
+}
+
+// Listens on a UNIX socket at path and returns the first connection, so a tracer can stream
+// into the simulator. The socket file is removed once the connection is made
+static int trace_accept(const char* path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        printf("Socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0 || bind(listener, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(listener, 1) != 0) {
+        printf("Error listening on %s: %s\n", path, strerror(errno));
+        if (listener >= 0) {
+            close(listener);
+        }
+        return -1;
+    }
+    int fd;
+    while ((fd = accept(listener, NULL, NULL)) < 0 && errno == EINTR) {
+    }
+    close(listener);
+    unlink(path);
+    return fd;
+}
+
+trace_reader* trace_open(const char* path) {
+    trace_reader* r = (trace_reader*)calloc(1, sizeof(trace_reader));
+    if (!r) {
+        return NULL;
+    }
+
+    // Open the trace, "-" means the trace is piped in on stdin
+    if (path[0] == '-' && path[1] == '\0') {
+        r->fd = STDIN_FILENO;
+    }
+    else if (strncmp(path, "unix:", 5) == 0) {
+        r->fd = trace_accept(path + 5);
+        if (r->fd < 0) {
+            free(r);
+            return NULL;
+        }
+    }
+    else {
+        r->fd = open(path, O_RDONLY);
+        if (r->fd < 0) {
+            free(r);
+            return NULL;
+        }
+    }
+
+    // Sniff the first bytes for a compression magic. Files are peeked with pread, streams
+    // have to consume them and hand them on
+    unsigned char magic[CODEC_MAGIC_MAX];
+    size_t magic_len = 0;
+    struct stat st;
+    int regular = fstat(r->fd, &st) == 0 && S_ISREG(st.st_mode);
+    if (regular) {
+        ssize_t got = pread(r->fd, magic, sizeof(magic), 0);
+        magic_len = got > 0 ? (size_t)got : 0;
+    }
+    else {
+        while (magic_len < sizeof(magic)) {
+            ssize_t got = read(r->fd, magic + magic_len, sizeof(magic) - magic_len);
+            if (got < 0 && errno == EINTR) {
+                continue;
+            }
+            if (got <= 0) {
+                break;
+            }
+            magic_len += (size_t)got;
+        }
+    }
+    int codec = detect_codec(magic, magic_len);
+    if (codec != CODEC_NONE && !codec_supported(codec)) {
+        printf("This build of cachesim cannot read %s compressed traces\n", codec_names[codec]);
+        trace_close(r);
+        return NULL;
+    }
+
+    // Uncompressed regular files get mapped whole so parsing never has to copy or refill
+    if (codec == CODEC_NONE && regular && st.st_size > 0) {
+        void* map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, r->fd, 0);
+        if (map != MAP_FAILED) {
+            madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+            r->mapped = 1;
+            r->buf = (char*)map;
+            r->len = (size_t)st.st_size;
+            r->eof = 1;
+            trace_detect(r);
+            return r;
+        }
+    }
+
+    // Pipes, sockets, compressed traces and anything mmap refuses fall back to chunked reads
+    r->buf = (char*)malloc(TRACE_CHUNK);
+    if (!r->buf) {
+        trace_close(r);
+        return NULL;
+    }
+    if (codec != CODEC_NONE) {
+        r->inflater = inflater_start(r->fd, codec, regular ? NULL : magic, regular ? 0 : magic_len);
+        if (!r->inflater) {
+            trace_close(r);
+            return NULL;
+        }
+    }
+    else if (!regular) {
+        // The sniffed bytes are the start of the trace itself
+        memcpy(r->buf, magic, magic_len);
+        r->len = magic_len;
+    }
+    trace_refill(r);
+    trace_detect(r);
+    return r;
+}
+
+void trace_close(trace_reader* r) {
+    if (r) {
+        if (r->inflater) {
+            inflater_stop(r->inflater);
+        }
+        if (r->mapped) {
+            munmap(r->buf, r->len);
+        }
+        else {
+            free(r->buf);
+        }
+        if (r->fd != STDIN_FILENO) {
+            close(r->fd);
+        }
+        free(r);
+    }
+}
+
+static int trace_next_binary(trace_reader* r, char* op, unsigned long* address, int* size);
+
+// Whether the buffer holds the whole next record; short buffers wait until the binary header is sniffable
+static int trace_has_record(const trace_reader* r) {
+    const unsigned char* p = (const unsigned char*)r->buf + r->pos;
+    const unsigned char* end = (const unsigned char*)r->buf + r->len;
+    if (end - p >= TRACE_LINE_MAX) {
+        return 1;
+    }
+    if (end - p <= CTR_MAGIC_LEN) {
+        return 0;
+    }
+    if (r->binary) {
+        // The head byte, then one or two varints
+        int varints = (*p++ >> 2) == CTR_SIZE_ESCAPE ? 2 : 1;
+        while (p < end && varints > 0) {
+            varints -= (*p++ & 0x80) == 0;
+        }
+        return varints == 0;
+    }
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) {
+        p++;
+    }
+    return p < end && memchr(p, '\n', (size_t)(end - p)) != NULL;
+}
+
+// Moves the unread tail to the front of the chunk buffer and reads until it holds a whole record,
+// is full or the input ends, so a live stream is parsed as it arrives rather than a chunk at a time
+static void trace_refill(trace_reader* r) {
+    size_t rest = r->len - r->pos;
+    memmove(r->buf, r->buf + r->pos, rest);
+    r->pos = 0;
+    r->len = rest;
+    while (r->len < TRACE_CHUNK && !r->eof && !trace_has_record(r)) {
+        ssize_t n = r->inflater ? inflater_read(r->inflater, r->buf + r->len, TRACE_CHUNK - r->len)
+                                : read(r->fd, r->buf + r->len, TRACE_CHUNK - r->len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            r->eof = 1;
+            break;
+        }
+        r->len += (size_t)n;
+    }
+}
+
+// Value of a hex digit, or -1 if the character is not one
+static inline int hex_digit(char ch) {
+    if (ch >= '0' && ch <= '9') return ch - '0';
+    if (ch >= 'a' && ch <= 'f') return ch - 'a' + 10;
+    if (ch >= 'A' && ch <= 'F') return ch - 'A' + 10;
+    return -1;
+}
+
+int trace_next(trace_reader* r, char* op, unsigned long* address, int* size) {
+    if (r->binary) {
+        return trace_next_binary(r, op, address, size);
+    }
+    for (;;) {
+        // Keep at least one full record in the buffer when reading in chunks
+        if (!r->eof && r->len - r->pos < TRACE_LINE_MAX) {
+            trace_refill(r);
+        }
+        const char* p = r->buf + r->pos;
+        const char* end = r->buf + r->len;
+
+        // Skip whitespace before the operation, like the " %c" it replaces
+        while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) {
+            p++;
+        }
+        if (p == end) {
+            r->pos = r->len;
+            if (r->eof) {
+                return 0;
+            }
+            continue;
+        }
+        const char* start = p;
+        char operation = *p++;
+        while (p < end && (*p == ' ' || *p == '\t')) {
+            p++;
+        }
+
+        // Hex address, with the optional 0x prefix %lx accepts
+        if (end - p > 2 && p[0] == '0' && (p[1] == 'x' || p[1] == 'X') && hex_digit(p[2]) >= 0) {
+            p += 2;
+        }
+        unsigned long addr = 0;
+        int digits = 0, d;
+        while (p < end && (d = hex_digit(*p)) >= 0) {
+            addr = (addr << 4) | (unsigned long)d;
+            p++;
+            digits++;
+        }
+
+        // Comma followed by the decimal access size
+        int sz = 0, ok = digits > 0 && p < end && *p == ',';
+        if (ok) {
+            p++;
+            ok = p < end && *p >= '0' && *p <= '9';
+            while (p < end && *p >= '0' && *p <= '9') {
+                sz = sz * 10 + (*p - '0');
+                p++;
+            }
+        }
+
+        // Skip the rest of the line, dropping it if it wasn't a record (e.g. valgrind banners)
+        while (p < end && *p != '\n') {
+            p++;
+        }
+        if (p == end && !r->eof && start != r->buf) {
+            // Line ran past the buffer end, reparse it after a refill
+            r->pos = (size_t)(start - r->buf);
+            trace_refill(r);
+            continue;
+        }
+        r->pos = (size_t)(p - r->buf);
+        if (ok) {
+            *op = operation;
+            *address = addr;
+            *size = sz;
+            return 1;
+        }
+    }
+}
+
+/*
+Tag match kernels
+    Each kernel compares one tag against n (<= 64) packed tags and returns a bitmask with
+    bit i set when tags[i] == tag. The widest kernel the host supports is picked once at
+    startup (CACHESIM_ISA=scalar|sse2|avx2|avx512|neon overrides the choice for testing).
+*/
+static uint64_t match_tags_scalar(const uint64_t* tags, int n, uint64_t tag) {
+    uint64_t mask = 0;
+    for (int i = 0; i < n; i++) {
+        mask |= (uint64_t)(tags[i] == tag) << i;
+    }
+    return mask;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+static uint64_t match_tags_sse2(const uint64_t* tags, int n, uint64_t tag) {
+    // SSE2 has no 64-bit compare, so compare 32-bit halves and AND each half with its partner
+    __m128i key = _mm_set1_epi64x((long long)tag);
+    uint64_t mask = 0;
+    int i = 0;
+    for (; i + 2 <= n; i += 2) {
+        __m128i eq = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*)(tags + i)), key);
+        eq = _mm_and_si128(eq, _mm_shuffle_epi32(eq, _MM_SHUFFLE(2, 3, 0, 1)));
+        mask |= (uint64_t)_mm_movemask_pd(_mm_castsi128_pd(eq)) << i;
+    }
+    for (; i < n; i++) {
+        mask |= (uint64_t)(tags[i] == tag) << i;
+    }
+    return mask;
+}
+
+__attribute__((target("avx2")))
+static uint64_t match_tags_avx2(const uint64_t* tags, int n, uint64_t tag) {
+    __m256i key = _mm256_set1_epi64x((long long)tag);
+    uint64_t mask = 0;
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i eq = _mm256_cmpeq_epi64(_mm256_loadu_si256((const __m256i*)(tags + i)), key);
+        mask |= (uint64_t)_mm256_movemask_pd(_mm256_castsi256_pd(eq)) << i;
+    }
+    for (; i < n; i++) {
+        mask |= (uint64_t)(tags[i] == tag) << i;
+    }
+    return mask;
+}
+
+__attribute__((target("avx512f")))
+static uint64_t match_tags_avx512(const uint64_t* tags, int n, uint64_t tag) {
+    // The tail uses a masked load, so no scalar cleanup loop is needed
+    __m512i key = _mm512_set1_epi64((long long)tag);
+    uint64_t mask = 0;
+    for (int i = 0; i < n; i += 8) {
+        __mmask8 lanes = n - i >= 8 ? (__mmask8)0xFF : (__mmask8)((1u << (n - i)) - 1);
+        __m512i row = _mm512_maskz_loadu_epi64(lanes, tags + i);
+        mask |= (uint64_t)_mm512_mask_cmpeq_epi64_mask(lanes, row, key) << i;
+    }
+    return mask;
+}
+#endif
+
+#if defined(__aarch64__)
+static uint64_t match_tags_neon(const uint64_t* tags, int n, uint64_t tag) {
+    uint64x2_t key = vdupq_n_u64(tag);
+    uint64_t mask = 0;
+    int i = 0;
+    for (; i + 2 <= n; i += 2) {
+        uint64x2_t eq = vceqq_u64(vld1q_u64(tags + i), key);
+        mask |= (vgetq_lane_u64(eq, 0) & 1) << i;
+        mask |= (vgetq_lane_u64(eq, 1) & 1) << (i + 1);
+    }
+    for (; i < n; i++) {
+        mask |= (uint64_t)(tags[i] == tag) << i;
+    }
+    return mask;
+}
+#endif
+
+static tag_match_fn match_tags = match_tags_scalar;
+
+static void select_tag_match(void) {
+    const char* isa = getenv("CACHESIM_ISA");
+    if (isa && isa[0] == '\0') {
+        isa = NULL;  // Treat an empty override as unset
+    }
+    const char* want = isa ? isa : "";
+    match_tags = match_tags_scalar;
+    if (strcmp(want, "scalar") == 0) {
+        return;
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if ((!isa || strcmp(want, "avx512") == 0) && __builtin_cpu_supports("avx512f")) {
+        match_tags = match_tags_avx512;
+    }
+    else if ((!isa || strcmp(want, "avx512") == 0 || strcmp(want, "avx2") == 0) && __builtin_cpu_supports("avx2")) {
+        match_tags = match_tags_avx2;
+    }
+    else if (__builtin_cpu_supports("sse2")) {
+        match_tags = match_tags_sse2;
+    }
+#elif defined(__aarch64__)
+    match_tags = match_tags_neon;  // Advanced SIMD is mandatory on AArch64
+#endif
+}
+
+// Finds the way in a set holding tag, or -1, and the first invalid way in the same pass.
+// simd is a constant at every call site: narrow sets compare inline, wide sets use the kernel.
+static inline int tag_probe(const cache* c, const uint64_t* tags, const uint64_t* valid, uint64_t tag, int* empty, int simd) {
+    *empty = -1;
+    for (int w = 0, base = 0; base < c->E; w++, base += 64) {
+        int n = c->E - base < 64 ? c->E - base : 64;
+        uint64_t live = n == 64 ? ~0ULL : (1ULL << n) - 1;
+
+        // Rows narrower than TAG_MATCH_MIN are cheaper to compare inline than through the kernel pointer
+        uint64_t found = (simd && n >= TAG_MATCH_MIN ? match_tags(tags + base, n, tag) : match_tags_scalar(tags + base, n, tag)) & valid[w];
+        if (found) {
+            return base + __builtin_ctzll(found);
+        }
+        uint64_t open = ~valid[w] & live;
+        if (open && *empty < 0) {
+            *empty = base + __builtin_ctzll(open);
+        }
+    }
+    return -1;
+}
+
+static inline int probe_direct(const cache* c, const uint64_t* tags, const uint64_t* valid, uint64_t tag, int* empty) {
+    (void)c;
+    *empty = (valid[0] & 1) ? -1 : 0;
+    return (tags[0] == tag && (valid[0] & 1)) ? 0 : -1;
+}
+
+static inline int probe_narrow(const cache* c, const uint64_t* tags, const uint64_t* valid, uint64_t tag, int* empty) {
+    return tag_probe(c, tags, valid, tag, empty, 0);
+}
+
+static inline int probe_wide(const cache* c, const uint64_t* tags, const uint64_t* valid, uint64_t tag, int* empty) {
+    return tag_probe(c, tags, valid, tag, empty, 1);
+}
+
+/*
+Replacement policies
+    Every policy provides four hooks that the kernels below call with a set index and way:
+        hit: a line was referenced again
+        fill: a line was just filled into an empty way
+        victim: picks the way to evict from a full set
+        replace: the victim way now holds the new tag
+    Each policy keeps repl_stride bytes of state per set, starting at repl_row().
+*/
+static inline void* repl_row(const cache* c, unsigned long set_idx) {
+    return (char*)c->repl + set_idx * c->repl_stride;
+}
+
+// xorshift64* step for Random and BRRIP. Each set keeps its own state in the last 8 bytes of
+// its row, seeded from the set index, so results do not depend on how sets are split across threads
+static inline uint64_t repl_rand(cache* c, unsigned long set_idx) {
+    uint64_t* state = (uint64_t*)((char*)repl_row(c, set_idx) + c->repl_stride - sizeof(uint64_t));
+    uint64_t x = *state ? *state : (0x9E3779B97F4A7C15ULL * (set_idx + 1)) | 1;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+// No state (direct-mapped sets, FIFO hits, Random)
+static inline void repl_none(cache* c, unsigned long set_idx, int way) {
+    (void)c; (void)set_idx; (void)way;
+}
+
+static inline int repl_first_way(cache* c, unsigned long set_idx) {
+    (void)c; (void)set_idx;
+    return 0;
+}
+
+/*
+Counter LRU
+    One age per line, 0 = most recently used and E-1 = least recently used.
+*/
+// The _ways forms take the associativity as a parameter, a constant in the fixed-geometry kernels
+static inline int lru_counter_victim_ways(cache* c, unsigned long set_idx, const int E) {
+    int* ages = (int*)repl_row(c, set_idx);
+    int lru_idx = 0;
+    // Find the least recently used line
+    for (int i = 0; i < E; i++){
+        if (ages[i] == E - 1){
+            lru_idx = i;
+            break;
+        }
+    }
+    return lru_idx;
+}
+
+static inline void lru_counter_touch_ways(cache* c, unsigned long set_idx, int way, const int E, const int words) {
+    int* ages = (int*)repl_row(c, set_idx);
+    uint64_t* valid = c->valid + set_idx * (unsigned long)words;
+    // Update the age of each line in the set
+    for (int i = 0; i < E; i++){
+        if ((valid[i >> 6] >> (i & 63)) & 1){
+            if(ages[i] < ages[way]){
+                ages[i] = ages[i] + 1;
+            }
+        }
+    }
+    ages[way] = 0;
+}
+
+static inline void lru_counter_fill_ways(cache* c, unsigned long set_idx, int way, const int E, const int words) {
+    // A new line starts out older than everything so that every other valid line ages
+    ((int*)repl_row(c, set_idx))[way] = E - 1;
+    lru_counter_touch_ways(c, set_idx, way, E, words);
+}
+
+static inline int lru_counter_victim(cache* c, unsigned long set_idx) {
+    return lru_counter_victim_ways(c, set_idx, c->E);
+}
+
+static inline void lru_counter_touch(cache* c, unsigned long set_idx, int way) {
+    lru_counter_touch_ways(c, set_idx, way, c->E, c->valid_words);
+}
+
+static inline void lru_counter_fill(cache* c, unsigned long set_idx, int way) {
+    lru_counter_fill_ways(c, set_idx, way, c->E, c->valid_words);
+}
+
+/*
+Way list LRU
+    Each set keeps its valid ways in a doubly linked list ordered from most to least recently
+    used: MRU way, LRU way, prev[E], next[E]. Links are stored as way + 1 so a zeroed row is
+    an empty list, which makes every update a constant number of writes regardless of associativity.
+*/
+static inline void lru_list_unlink(uint16_t* row, int E, int way) {
+    uint16_t* prev = row + 2;
+    uint16_t* next = row + 2 + E;
+    if (prev[way]) next[prev[way] - 1] = next[way]; else row[0] = next[way];
+    if (next[way]) prev[next[way] - 1] = prev[way]; else row[1] = prev[way];
+}
+
+static inline void lru_list_push(uint16_t* row, int E, int way) {
+    uint16_t* prev = row + 2;
+    uint16_t* next = row + 2 + E;
+    prev[way] = 0;
+    next[way] = row[0];
+    if (row[0]) prev[row[0] - 1] = (uint16_t)(way + 1); else row[1] = (uint16_t)(way + 1);
+    row[0] = (uint16_t)(way + 1);
+}
+
+static inline int lru_list_victim(cache* c, unsigned long set_idx) {
+    return ((uint16_t*)repl_row(c, set_idx))[1] - 1;  // Tail of the way list
+}
+
+static inline void lru_list_touch_ways(cache* c, unsigned long set_idx, int way, const int E) {
+    // Move the way to the front of the list
+    uint16_t* row = (uint16_t*)repl_row(c, set_idx);
+    if (row[0] != way + 1) {
+        lru_list_unlink(row, E, way);
+        lru_list_push(row, E, way);
+    }
+}
+
+static inline void lru_list_touch(cache* c, unsigned long set_idx, int way) {
+    lru_list_touch_ways(c, set_idx, way, c->E);
+}
+
+static inline void lru_list_fill(cache* c, unsigned long set_idx, int way) {
+    lru_list_push((uint16_t*)repl_row(c, set_idx), c->E, way);
+}
+
+/*
+FIFO
+    Each set keeps its valid ways in fill order as a ring: head, count, order[E], with the
+    oldest line at order[head]. An invalidated line leaves the ring and its way rejoins at the
+    back when it is filled again, so lines are evicted in the order they came in even when a
+    hierarchy or coherence invalidates some of them.
+*/
+static inline void fifo_fill(cache* c, unsigned long set_idx, int way) {
+    uint32_t* row = (uint32_t*)repl_row(c, set_idx);
+    uint32_t tail = row[0] + row[1];
+    row[2 + (tail >= (uint32_t)c->E ? tail - (uint32_t)c->E : tail)] = (uint32_t)way;
+    row[1]++;
+}
+
+static inline int fifo_victim(cache* c, unsigned long set_idx) {
+    uint32_t* row = (uint32_t*)repl_row(c, set_idx);
+    return (int)row[2 + row[0]];
+}
+
+static inline void fifo_replace(cache* c, unsigned long set_idx, int way) {
+    // The set is full, so the victim at the head becomes the back of the ring by moving the head
+    (void)way;
+    uint32_t* row = (uint32_t*)repl_row(c, set_idx);
+    row[0] = row[0] + 1 == (uint32_t)c->E ? 0 : row[0] + 1;
+}
+
+static void fifo_remove(cache* c, unsigned long set_idx, int way) {
+    // Close the gap the way leaves by shifting the younger lines one place towards the head
+    uint32_t* row = (uint32_t*)repl_row(c, set_idx);
+    uint32_t E = (uint32_t)c->E;
+    uint32_t* order = row + 2;
+    uint32_t i = 0;
+    while (i < row[1] && order[(row[0] + i) % E] != (uint32_t)way) {
+        i++;
+    }
+    for (; i + 1 < row[1]; i++) {
+        order[(row[0] + i) % E] = order[(row[0] + i + 1) % E];
+    }
+    row[1]--;
+}
+
+// Random
+static inline int random_victim(cache* c, unsigned long set_idx) {
+    return (int)(repl_rand(c, set_idx) % (uint64_t)c->E);
+}
+
+/*
+Tree PLRU
+    E-1 node bits per set stored as a heap (node n at bit n-1, children 2n and 2n+1, way w at
+    leaf w+E). A set bit means the pseudo-LRU side is the right child.
+*/
+static inline int plru_victim(cache* c, unsigned long set_idx) {
+    uint64_t* bits = (uint64_t*)repl_row(c, set_idx);
+    unsigned node = 1;
+    while (node < (unsigned)c->E) {
+        node = 2 * node + (unsigned)((bits[(node - 1) >> 6] >> ((node - 1) & 63)) & 1);
+    }
+    return (int)(node - (unsigned)c->E);
+}
+
+static inline void plru_touch(cache* c, unsigned long set_idx, int way) {
+    // Point every node on the path away from the touched way
+    uint64_t* bits = (uint64_t*)repl_row(c, set_idx);
+    for (unsigned node = (unsigned)(way + c->E); node > 1; node >>= 1) {
+        unsigned parent = node >> 1;
+        uint64_t bit = 1ULL << ((parent - 1) & 63);
+        if (node & 1) bits[(parent - 1) >> 6] &= ~bit; else bits[(parent - 1) >> 6] |= bit;
+    }
+}
+
+/*
+RRIP
+    A 2-bit re-reference prediction value per line, 32 lanes per 64-bit word. Hits predict a
+    near re-reference (0). SRRIP inserts at a long re-reference interval (RRIP_MAX - 1), BRRIP
+    inserts at distant (RRIP_MAX) except for one fill in BRRIP_EPSILON. The victim is the first
+    line predicted distant; if there is none every line is aged until one is.
+*/
+static inline void rrip_set(cache* c, unsigned long set_idx, int way, uint64_t rrpv) {
+    uint64_t* lanes = (uint64_t*)repl_row(c, set_idx);
+    int shift = 2 * (way & 31);
+    lanes[way >> 5] = (lanes[way >> 5] & ~(3ULL << shift)) | (rrpv << shift);
+}
+
+static inline void rrip_hit(cache* c, unsigned long set_idx, int way) {
+    rrip_set(c, set_idx, way, 0);
+}
+
+static inline void srrip_fill(cache* c, unsigned long set_idx, int way) {
+    rrip_set(c, set_idx, way, RRIP_MAX - 1);
+}
+
+static inline void brrip_fill(cache* c, unsigned long set_idx, int way) {
+    rrip_set(c, set_idx, way, repl_rand(c, set_idx) % BRRIP_EPSILON == 0 ? RRIP_MAX - 1 : RRIP_MAX);
+}
+
+static inline int rrip_victim(cache* c, unsigned long set_idx) {
+    uint64_t* lanes = (uint64_t*)repl_row(c, set_idx);
+    int words = (c->E + 31) / 32;
+    for (;;) {
+        for (int w = 0; w < words; w++) {
+            int n = c->E - 32 * w < 32 ? c->E - 32 * w : 32;
+            uint64_t live = n == 32 ? 0x5555555555555555ULL : 0x5555555555555555ULL & ((1ULL << (2 * n)) - 1);
+            uint64_t distant = lanes[w] & (lanes[w] >> 1) & live;
+            if (distant) {
+                return 32 * w + __builtin_ctzll(distant) / 2;
+            }
+        }
+        // No lane is at RRIP_MAX, so adding one to every lane cannot carry into its neighbour
+        for (int w = 0; w < words; w++) {
+            int n = c->E - 32 * w < 32 ? c->E - 32 * w : 32;
+            lanes[w] += n == 32 ? 0x5555555555555555ULL : 0x5555555555555555ULL & ((1ULL << (2 * n)) - 1);
+        }
+    }
+}
+
+// -v names of the CACHE_* lookup results
+static const char* result_names[] = {"hit ", "miss ", "miss eviction "};
+
+// Kernel bodies are always inlined into their callers, even where GCC would rather share them
+#define KERNEL_INLINE static inline __attribute__((always_inline))
+#define KERNEL_COLD static __attribute__((noinline, cold))
+
+/*
+Verbose output
+    -v prints a line per trace record. Formatting it with printf per token costs far more
+    than simulating the record, so the line is assembled by hand into verbose_out and
+    handed to stdio a VERBOSE_BUFFER at a time. Call verbose_flush before printing anything
+    else to stdout.
+*/
+static verbose_writer verbose_out;
+
+void verbose_flush(void) {
+    fwrite(verbose_out.buf, 1, verbose_out.len, stdout);
+    verbose_out.len = 0;
+}
+
+// Makes room for n more bytes
+KERNEL_INLINE char* verbose_reserve(size_t n) {
+    if (verbose_out.len + n > VERBOSE_BUFFER) {
+        verbose_flush();
+    }
+    return verbose_out.buf + verbose_out.len;
+}
+
+static void verbose_write(const char* text) {
+    size_t n = strlen(text);
+    memcpy(verbose_reserve(n), text, n);
+    verbose_out.len += n;
+}
+
+// Writes "<op> <hex address>, <size> " like printf("%c %lx, %d ")
+static void verbose_record(char operation, unsigned long address, int size) {
+    char* out = verbose_reserve(48);
+    char* p = out;
+    *p++ = operation;
+    *p++ = ' ';
+    int digits = 1;
+    while (digits < 16 && (address >> (4 * digits)) != 0) {
+        digits++;
+    }
+    for (int i = digits - 1; i >= 0; i--) {
+        *p++ = "0123456789abcdef"[(address >> (4 * i)) & 15];
+    }
+    *p++ = ',';
+    *p++ = ' ';
+    unsigned int magnitude = size < 0 ? 0u - (unsigned int)size : (unsigned int)size;
+    if (size < 0) {
+        *p++ = '-';
+    }
+    char dec[10];
+    int n = 0;
+    do {
+        dec[n++] = (char)('0' + magnitude % 10);
+        magnitude /= 10;
+    } while (magnitude != 0);
+    while (n > 0) {
+        *p++ = dec[--n];
+    }
+    *p++ = ' ';
+    verbose_out.len += (size_t)(p - out);
+}
+
+// Last byte touched by an access of size bytes, saturating at the top of the address space
+KERNEL_INLINE unsigned long access_last(unsigned long address, int size) {
+    unsigned long last = address + (unsigned long)(size > 1 ? size - 1 : 0);
+    return last < address ? ~0UL : last;
+}
+
+// 1 if an access from address to last crosses a 2^b block boundary
+KERNEL_INLINE int access_splits(unsigned long address, unsigned long last, int b) {
+    return ((address ^ last) >> b) != 0;
+}
+
+// Sets or clears one line's bit in a dirty bitmap
+KERNEL_INLINE void dirty_set(uint64_t* dirty, int way, int value) {
+    uint64_t bit = 1ULL << (way & 63);
+    dirty[way >> 6] = (dirty[way >> 6] & ~bit) | ((uint64_t)-(int64_t)value & bit);
+}
+
+// Prefetches the tag row and replacement state of a set. The valid and dirty bitmaps pack
+// 64 lines per word, so they are rarely the line that misses
+KERNEL_INLINE void prefetch_set(const cache* c, unsigned long set_idx) {
+    __builtin_prefetch(c->tags + set_idx * (unsigned long)c->E);
+    __builtin_prefetch((const char*)c->repl + set_idx * c->repl_stride, 1);
+}
+
+// Counts the bytes of a store that go on to the next level: every store under write-through,
+// and store misses that were not allocated under write-back
+KERNEL_INLINE void store_through(const cache* c, int write, int result, unsigned long bytes, cache_stats* stats) {
+    if (write && (!(c->write_policy & WRITE_BACK) || (result != CACHE_HIT && !(c->write_policy & WRITE_ALLOCATE)))) {
+        stats->bytes_written += bytes;
+    }
+}
+
+// Adds one lookup result to the counters
+KERNEL_INLINE void count_result(cache* c, unsigned long set_idx, int write, unsigned long bytes, int result, cache_stats* stats, int per_set) {
+    stats->hits += result == CACHE_HIT;
+    stats->misses += result != CACHE_HIT;
+    stats->evictions += result == CACHE_EVICT;
+    if (per_set) {
+        set_counts* set = &c->set_stats[set_idx];
+        set->hits += result == CACHE_HIT;
+        set->misses += result != CACHE_HIT;
+        set->evictions += result == CACHE_EVICT;
+    }
+    store_through(c, write, result, bytes, stats);
+}
+
+/*
+Simulation kernels
+    DEFINE_KERNEL stamps out an access function and a trace loop for one (probe, policy) pair,
+    so the policy hooks are direct calls the compiler can inline. Kernels are indexed by
+    cache.kernel: 0 is direct-mapped, then a narrow and a wide kernel for each policy.
+    An access that crosses a block boundary is one access per block it touches; the common
+    single-block case is one compare of the first and last byte's block numbers. Stores
+    follow cache.write_policy, and every line fill, write-back and write-through is counted
+    in the caller's cache_stats. The trace and batch loops come in two builds, with and
+    without per-set counters, so a run that did not ask for them pays nothing. The refs
+    loop simulates a cache_batch whose set and tag were computed ahead of time, prefetching
+    the sets it is about to touch. DEFINE_KERNEL_WAYS takes the associativity and bitmap words
+    per set as expressions, so a kernel for one fixed geometry gets them as constants.
+*/
+#define DEFINE_KERNEL(name, PROBE, HIT, FILL, VICTIM, REPLACE) \
+    DEFINE_KERNEL_WAYS(name, PROBE, HIT, FILL, VICTIM, REPLACE, c->E, c->valid_words)
+#define DEFINE_KERNEL_WAYS(name, PROBE, HIT, FILL, VICTIM, REPLACE, WAYS, WORDS) \
+KERNEL_INLINE int lookup_set_##name(cache* c, unsigned long cache_set, uint64_t tag, int write, unsigned long* evicted, cache_stats* stats) { \
+    uint64_t* tags = c->tags + cache_set * (unsigned long)(WAYS); \
+    uint64_t* valid = c->valid + cache_set * (unsigned long)(WORDS); \
+    uint64_t* dirty = c->dirty + cache_set * (unsigned long)(WORDS); \
+    /* A write-back store leaves the line dirty, a write-through store never does */ \
+    int dirties = write && (c->write_policy & WRITE_BACK); \
+    /* Check for a hit, noting the first empty line on the way */ \
+    int empty; \
+    int i = PROBE(c, tags, valid, tag, &empty); \
+    if (i >= 0) { \
+        HIT(c, cache_set, i); \
+        if (dirties) { \
+            dirty[i >> 6] |= 1ULL << (i & 63); \
+        } \
+        return CACHE_HIT; \
+    } \
+    /* A store miss without write-allocate goes straight to the next level */ \
+    if (write && !(c->write_policy & WRITE_ALLOCATE)) { \
+        return CACHE_MISS; \
+    } \
+    stats->bytes_read += 1UL << c->b; \
+    /* Check for a miss and fill the empty line */ \
+    if (empty >= 0) { \
+        valid[empty >> 6] |= 1ULL << (empty & 63); \
+        dirty_set(dirty, empty, dirties); \
+        tags[empty] = tag; \
+        FILL(c, cache_set, empty); \
+        return CACHE_MISS; \
+    } \
+    /* Evict the victim line, writing it back if dirty and reporting the block it held */ \
+    int victim = VICTIM(c, cache_set); \
+    if ((dirty[victim >> 6] >> (victim & 63)) & 1) { \
+        stats->dirty_evictions++; \
+        stats->bytes_written += 1UL << c->b; \
+    } \
+    dirty_set(dirty, victim, dirties); \
+    *evicted = ((unsigned long)tags[victim] << (c->s + c->b)) | (cache_set << c->b); \
+    tags[victim] = tag; \
+    REPLACE(c, cache_set, victim); \
+    return CACHE_EVICT; \
+} \
+KERNEL_INLINE int lookup_##name(cache* c, unsigned long address, int write, unsigned long* evicted, cache_stats* stats) { \
+    /* Set index is the b bits above the block offset, the tag is everything above that */ \
+    unsigned long cache_set = (address >> c->b) & ((1UL << c->s) - 1); \
+    return lookup_set_##name(c, cache_set, address >> (c->s + c->b), write, evicted, stats); \
+} \
+static int cache_lookup_##name(cache* c, unsigned long address, int write, unsigned long* evicted, cache_stats* stats) { \
+    return lookup_##name(c, address, write, evicted, stats); \
+} \
+KERNEL_INLINE void access_##name(cache* c, unsigned long address, int write, unsigned long bytes, cache_stats* stats, int verbose, int per_set) { \
+    unsigned long evicted; \
+    unsigned long cache_set = (address >> c->b) & ((1UL << c->s) - 1); \
+    int result = lookup_set_##name(c, cache_set, address >> (c->s + c->b), write, &evicted, stats); \
+    count_result(c, cache_set, write, bytes, result, stats, per_set); \
+    if (verbose) { \
+        verbose_write(result_names[result]); \
+    } \
+} \
+static void access_once_##name(cache* c, unsigned long address, int write, cache_stats* stats, int verbose) { \
+    access_##name(c, address, write, 1, stats, verbose, c->set_stats != NULL); \
+} \
+KERNEL_INLINE void span_loop_##name(cache* c, unsigned long address, unsigned long last, int write, cache_stats* stats, int verbose, int per_set) { \
+    /* Touch every block from the first byte's to the last byte's, each with its share of the bytes */ \
+    unsigned long block = address >> c->b, end = last >> c->b; \
+    do { \
+        unsigned long lo = block == address >> c->b ? address : block << c->b; \
+        unsigned long hi = block == end ? last : ((block + 1) << c->b) - 1; \
+        access_##name(c, lo, write, hi - lo + 1, stats, verbose, per_set); \
+    } while (block++ != end); \
+} \
+KERNEL_COLD void span_##name(cache* c, unsigned long address, unsigned long last, int write, cache_stats* stats, int per_set) { \
+    span_loop_##name(c, address, last, write, stats, 0, per_set); \
+} \
+KERNEL_COLD void span_verbose_##name(cache* c, unsigned long address, unsigned long last, int write, cache_stats* stats, int per_set) { \
+    span_loop_##name(c, address, last, write, stats, 1, per_set); \
+} \
+KERNEL_INLINE void run_loop_##name(cache* c, trace_reader* tracefile, cache_stats* stats, int verbose, int per_set) { \
+    /* Count into a local copy the compiler can keep out of memory, and store it once */ \
+    cache_stats local = *stats; \
+    char operation; \
+    unsigned long address; \
+    int size; \
+    while (trace_next(tracefile, &operation, &address, &size) > 0) { \
+        /* Skip instruction load operations */ \
+        if (operation != 'L' && operation != 'S' && operation != 'M') { \
+            continue; \
+        } \
+        if (verbose) { \
+            verbose_record(operation, address, size); \
+        } \
+        /* Modify operation is load and store combined, so only its second access writes */ \
+        int write = operation == 'S'; \
+        unsigned long last = access_last(address, size); \
+        if (__builtin_expect(!access_splits(address, last, c->b), 1)) { \
+            access_##name(c, address, write, last - address + 1, &local, verbose, per_set); \
+            if (operation == 'M') { \
+                access_##name(c, address, 1, last - address + 1, &local, verbose, per_set); \
+            } \
+        } \
+        else { \
+            void (*span)(cache*, unsigned long, unsigned long, int, cache_stats*, int) = verbose ? span_verbose_##name : span_##name; \
+            span(c, address, last, write, &local, per_set); \
+            if (operation == 'M') { \
+                span(c, address, last, 1, &local, per_set); \
+            } \
+        } \
+        if (verbose) { \
+            verbose_write("\n"); \
+        } \
+    } \
+    *stats = local; \
+} \
+static void runsim_##name(cache* c, trace_reader* tracefile, cache_stats* stats) { \
+    run_loop_##name(c, tracefile, stats, 0, 0); \
+} \
+static void runsim_sets_##name(cache* c, trace_reader* tracefile, cache_stats* stats) { \
+    run_loop_##name(c, tracefile, stats, 0, 1); \
+} \
+static void runsim_verbose_##name(cache* c, trace_reader* tracefile, cache_stats* stats) { \
+    /* Verbose runs are bound by output, so the per-set choice can stay a runtime test */ \
+    run_loop_##name(c, tracefile, stats, 1, c->set_stats != NULL); \
+    verbose_flush(); \
+} \
+KERNEL_INLINE void batch_loop_##name(cache* c, const mem_access* accesses, int n, cache_stats* stats, int per_set) { \
+    cache_stats local = *stats; \
+    for (int k = 0; k < n; k++) { \
+        const mem_access* a = &accesses[k]; \
+        if (__builtin_expect(!access_splits(a->address, a->last, c->b), 1)) { \
+            access_##name(c, a->address, a->write, a->last - a->address + 1, &local, 0, per_set); \
+        } \
+        else { \
+            span_##name(c, a->address, a->last, a->write, &local, per_set); \
+        } \
+    } \
+    *stats = local; \
+} \
+static void batch_##name(cache* c, const mem_access* accesses, int n, cache_stats* stats) { \
+    batch_loop_##name(c, accesses, n, stats, 0); \
+} \
+static void batch_sets_##name(cache* c, const mem_access* accesses, int n, cache_stats* stats) { \
+    batch_loop_##name(c, accesses, n, stats, 1); \
+} \
+KERNEL_INLINE void refs_loop_##name(cache* c, const cache_batch* batch, cache_stats* stats, int per_set) { \
+    cache_stats local = *stats; \
+    int n = batch->count; \
+    int prefetch = (size_t)c->S * (size_t)c->E * sizeof(uint64_t) >= CACHE_PREFETCH_MIN_BYTES; \
+    for (int k = 0; k < n; k++) { \
+        /* Start loading the set CACHE_PREFETCH accesses ahead while this one is simulated */ \
+        if (prefetch && k + CACHE_PREFETCH < n) { \
+            prefetch_set(c, batch->set[k + CACHE_PREFETCH]); \
+        } \
+        unsigned long evicted; \
+        int result = lookup_set_##name(c, batch->set[k], batch->tag[k], batch->write[k], &evicted, &local); \
+        count_result(c, batch->set[k], batch->write[k], batch->bytes[k], result, &local, per_set); \
+    } \
+    *stats = local; \
+} \
+static void refs_##name(cache* c, const cache_batch* batch, cache_stats* stats) { \
+    refs_loop_##name(c, batch, stats, 0); \
+} \
+static void refs_sets_##name(cache* c, const cache_batch* batch, cache_stats* stats) { \
+    refs_loop_##name(c, batch, stats, 1); \
+}
+
+DEFINE_KERNEL(direct, probe_direct, repl_none, repl_none, repl_first_way, repl_none)
+DEFINE_KERNEL(lru_counter, probe_narrow, lru_counter_touch, lru_counter_fill, lru_counter_victim, lru_counter_touch)
+DEFINE_KERNEL(lru_list, probe_wide, lru_list_touch, lru_list_fill, lru_list_victim, lru_list_touch)
+DEFINE_KERNEL(fifo_narrow, probe_narrow, repl_none, fifo_fill, fifo_victim, fifo_replace)
+DEFINE_KERNEL(fifo_wide, probe_wide, repl_none, fifo_fill, fifo_victim, fifo_replace)
+DEFINE_KERNEL(random_narrow, probe_narrow, repl_none, repl_none, random_victim, repl_none)
+DEFINE_KERNEL(random_wide, probe_wide, repl_none, repl_none, random_victim, repl_none)
+DEFINE_KERNEL(plru_narrow, probe_narrow, plru_touch, plru_touch, plru_victim, plru_touch)
+DEFINE_KERNEL(plru_wide, probe_wide, plru_touch, plru_touch, plru_victim, plru_touch)
+DEFINE_KERNEL(srrip_narrow, probe_narrow, rrip_hit, srrip_fill, rrip_victim, srrip_fill)
+DEFINE_KERNEL(srrip_wide, probe_wide, rrip_hit, srrip_fill, rrip_victim, srrip_fill)
+DEFINE_KERNEL(brrip_narrow, probe_narrow, rrip_hit, brrip_fill, rrip_victim, brrip_fill)
+DEFINE_KERNEL(brrip_wide, probe_wide, rrip_hit, brrip_fill, rrip_victim, brrip_fill)
+
+/*
+Fixed-geometry LRU kernels
+    The associativities run most often get kernels with E a compile-time constant: the probe
+    builds one hit mask over the set in a single pass (unrolled for narrow sets, one fixed-length
+    SIMD compare for wide ones), and the LRU updates loop a known number of times. Each keeps
+    the replacement state layout the generic LRU kernel for that E uses (age counters below
+    WIDE_SET_MIN_E, the way list from there on), so a cache can switch between the two and
+    cache_lookup, snapshots and every other path see the same state.
+*/
+KERNEL_INLINE int probe_fixed(const uint64_t* tags, const uint64_t* valid, uint64_t tag, int* empty, const int E) {
+    uint64_t found = 0;
+    if (E >= WIDE_SET_MIN_E) {
+        found = match_tags(tags, E, tag);  // Wide rows still beat the unrolled compare through SIMD
+    }
+    else {
+        for (int i = 0; i < E; i++) {
+            found |= (uint64_t)(tags[i] == tag) << i;
+        }
+    }
+    found &= valid[0];
+    uint64_t open = ~valid[0] & ((1ULL << E) - 1);
+    *empty = open ? __builtin_ctzll(open) : -1;
+    return found ? __builtin_ctzll(found) : -1;
+}
+
+#define DEFINE_FIXED_COUNTER_KERNEL(n) \
+static inline int probe_e##n(const cache* c, const uint64_t* tags, const uint64_t* valid, uint64_t tag, int* empty) { \
+    (void)c; \
+    return probe_fixed(tags, valid, tag, empty, n); \
+} \
+static inline int lru_counter_victim_e##n(cache* c, unsigned long set_idx) { return lru_counter_victim_ways(c, set_idx, n); } \
+static inline void lru_counter_touch_e##n(cache* c, unsigned long set_idx, int way) { lru_counter_touch_ways(c, set_idx, way, n, 1); } \
+static inline void lru_counter_fill_e##n(cache* c, unsigned long set_idx, int way) { lru_counter_fill_ways(c, set_idx, way, n, 1); } \
+DEFINE_KERNEL_WAYS(lru_e##n, probe_e##n, lru_counter_touch_e##n, lru_counter_fill_e##n, lru_counter_victim_e##n, lru_counter_touch_e##n, n, 1)
+
+#define DEFINE_FIXED_LIST_KERNEL(n) \
+static inline int probe_e##n(const cache* c, const uint64_t* tags, const uint64_t* valid, uint64_t tag, int* empty) { \
+    (void)c; \
+    return probe_fixed(tags, valid, tag, empty, n); \
+} \
+static inline void lru_list_touch_e##n(cache* c, unsigned long set_idx, int way) { lru_list_touch_ways(c, set_idx, way, n); } \
+static inline void lru_list_fill_e##n(cache* c, unsigned long set_idx, int way) { lru_list_push((uint16_t*)repl_row(c, set_idx), n, way); } \
+DEFINE_KERNEL_WAYS(lru_e##n, probe_e##n, lru_list_touch_e##n, lru_list_fill_e##n, lru_list_victim, lru_list_touch_e##n, n, 1)
+
+DEFINE_FIXED_COUNTER_KERNEL(2)
+DEFINE_FIXED_COUNTER_KERNEL(4)
+DEFINE_FIXED_LIST_KERNEL(8)
+DEFINE_FIXED_LIST_KERNEL(16)
+
+static const struct {
+    void (*access)(cache* c, unsigned long address, int write, cache_stats* stats, int verbose);
+    // Indexed by whether the cache keeps per-set counters
+    void (*run[2])(cache* c, trace_reader* tracefile, cache_stats* stats);
+    void (*run_verbose)(cache* c, trace_reader* tracefile, cache_stats* stats);
+    void (*batch[2])(cache* c, const mem_access* accesses, int n, cache_stats* stats);
+    void (*refs[2])(cache* c, const cache_batch* batch, cache_stats* stats);
+    int (*lookup)(cache* c, unsigned long address, int write, unsigned long* evicted, cache_stats* stats);
+} kernels[] = {
+#define KERNEL_ENTRY(name) {access_once_##name, {runsim_##name, runsim_sets_##name}, runsim_verbose_##name, \
+                            {batch_##name, batch_sets_##name}, {refs_##name, refs_sets_##name}, cache_lookup_##name}
+    KERNEL_ENTRY(direct),
+    KERNEL_ENTRY(lru_counter), KERNEL_ENTRY(lru_list),
+    KERNEL_ENTRY(fifo_narrow), KERNEL_ENTRY(fifo_wide),
+    KERNEL_ENTRY(random_narrow), KERNEL_ENTRY(random_wide),
+    KERNEL_ENTRY(plru_narrow), KERNEL_ENTRY(plru_wide),
+    KERNEL_ENTRY(srrip_narrow), KERNEL_ENTRY(srrip_wide),
+    KERNEL_ENTRY(brrip_narrow), KERNEL_ENTRY(brrip_wide),
+    KERNEL_ENTRY(lru_e2), KERNEL_ENTRY(lru_e4), KERNEL_ENTRY(lru_e8), KERNEL_ENTRY(lru_e16),
+#undef KERNEL_ENTRY
+};
+
+void access_cache(cache* c, long unsigned int* address, int write, cache_stats* stats, int* verb){
+    // Single accesses from outside the trace loop pay one table lookup
+    kernels[c->kernel].access(c, *address, write, stats, *verb == 1);
+    if (*verb == 1) {
+        verbose_flush();
+    }
+}
+
+void runsim(cache* c, trace_reader* tracefile, cache_stats* stats, int* verbose) {
+    // Verbose runs need each record's results next to it, so they stay one record at a time
+    if (*verbose == 1) {
+        kernels[c->kernel].run_verbose(c, tracefile, stats);
+        return;
+    }
+
+    // Otherwise decode a batch, index it in one pass, then simulate it
+    cache_batch* batch = cache_batch_new();
+    if (!batch) {
+        // Without the batch buffer fall back to the record at a time loop
+        kernels[c->kernel].run[c->set_stats != NULL](c, tracefile, stats);
+        return;
+    }
+    while (cache_batch_fill(batch, tracefile, c->b) > 0) {
+        cache_batch_index(c, batch);
+        cache_access_batch(c, batch, stats);
+    }
+    free(batch);
+}
+
+// Set sampling choice: scatters the kept sets across the index range so strided
+// traces do not line up with them
+static inline int set_sampled(const cache* c, uint64_t set) {
+    return (((set * 0x9E3779B97F4A7C15ULL) >> 32) & c->sample_mask) == 0;
+}
+
+// Shard choice: sets are dealt out round robin, so every shard gets an even share of a strided trace
+static inline int set_in_shard(const cache* c, uint64_t set) {
+    return c->shards == 0 || set % (uint64_t)c->shards == (uint64_t)c->shard;
+}
+
+// Monotonic time in nanoseconds
+static uint64_t profile_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// Opens the PROFILE_* counters as one group on the calling thread, fds[0] is the leader.
+// Returns 0 if the host or its perf_event_paranoid setting does not allow it
+static int profile_open(int* fds) {
+#ifdef __linux__
+    static const uint64_t configs[PROFILE_COUNTERS] = {PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES};
+    for (int i = 0; i < PROFILE_COUNTERS; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = configs[i];
+        attr.read_format = PERF_FORMAT_GROUP;
+        attr.disabled = i == 0;  // Members follow the leader
+        attr.exclude_kernel = 1;  // Allowed at the default perf_event_paranoid level
+        attr.exclude_hv = 1;
+        fds[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, i == 0 ? -1 : fds[0], 0);
+        if (fds[i] < 0) {
+            while (i-- > 0) {
+                close(fds[i]);
+            }
+            return 0;
+        }
+    }
+    ioctl(fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+static void profile_close(const int* fds) {
+    for (int i = PROFILE_COUNTERS - 1; i >= 0; i--) {
+        close(fds[i]);
+    }
+}
+
+static int profile_read(int leader, uint64_t* values) {
+    struct {
+        uint64_t nr;
+        uint64_t values[PROFILE_COUNTERS];
+    } group;
+    if (read(leader, &group, sizeof(group)) != (ssize_t)sizeof(group)) {
+        return 0;
+    }
+    memcpy(values, group.values, sizeof(group.values));
+    return 1;
+}
+
+// Charges the time and counters since the previous mark to a phase and starts a new mark
+static void profile_mark(cache_profile* profile, int phase, int leader, uint64_t* last_ns, uint64_t* last) {
+    uint64_t t = profile_clock();
+    profile->ns[phase] += t - *last_ns;
+    *last_ns = t;
+    uint64_t values[PROFILE_COUNTERS];
+    if (leader >= 0 && profile_read(leader, values)) {
+        for (int i = 0; i < PROFILE_COUNTERS; i++) {
+            profile->counters[phase][i] += values[i] - last[i];
+            last[i] = values[i];
+        }
+    }
+}
+
+void runsim_profile(cache* c, trace_reader* tracefile, cache_stats* stats, cache_profile* profile) {
+    // Same pipeline as runsim, with a mark at every phase boundary: a few per batch, none per access
+    int hw = profile->hw;
+    memset(profile, 0, sizeof(*profile));
+    cache_batch* batch = cache_batch_new();
+    if (!batch) {
+        int verbose = 0;
+        runsim(c, tracefile, stats, &verbose);
+        return;
+    }
+    int fds[PROFILE_COUNTERS];
+    int leader = hw && profile_open(fds) ? fds[0] : -1;
+    uint64_t last[PROFILE_COUNTERS] = {0};
+    if (leader >= 0 && !profile_read(leader, last)) {
+        profile_close(fds);
+        leader = -1;
+    }
+    profile->hw = leader >= 0;
+
+    uint64_t last_ns = profile_clock();
+    for (;;) {
+        int n = cache_batch_fill(batch, tracefile, c->b);
+        profile_mark(profile, PROFILE_DECODE, leader, &last_ns, last);
+        if (n <= 0) {
+            break;
+        }
+        cache_batch_index(c, batch);
+        profile_mark(profile, PROFILE_INDEX, leader, &last_ns, last);
+        cache_access_batch(c, batch, stats);
+        profile_mark(profile, PROFILE_SIMULATE, leader, &last_ns, last);
+        profile->batches++;
+        profile->accesses += (uint64_t)n;
+    }
+    if (leader >= 0) {
+        profile_close(fds);
+    }
+    free(batch);
+}
+
+void print_profile(const cache_profile* profile) {
+    static const char* phase_names[PROFILE_PHASES] = {"decode", "index", "simulate"};
+    uint64_t total = 0;
+    for (int i = 0; i < PROFILE_PHASES; i++) {
+        total += profile->ns[i];
+    }
+    double accesses = profile->accesses ? (double)profile->accesses : 1;
+    printf("Profile: %llu accesses in %llu batches\n", (unsigned long long)profile->accesses,
+           (unsigned long long)profile->batches);
+    printf("%-10s %10s %6s %10s", "phase", "ms", "%", "ns/access");
+    if (profile->hw) {
+        printf(" %14s %14s", "cache_misses", "branch_misses");
+    }
+    printf("\n");
+    for (int i = 0; i <= PROFILE_PHASES; i++) {
+        // The last row is the total of the phases
+        uint64_t ns = i < PROFILE_PHASES ? profile->ns[i] : total;
+        printf("%-10s %10.3f %6.1f %10.2f", i < PROFILE_PHASES ? phase_names[i] : "total", ns / 1e6,
+               total ? 100.0 * ns / total : 0, ns / accesses);
+        if (profile->hw) {
+            for (int k = 0; k < PROFILE_COUNTERS; k++) {
+                uint64_t v = 0;
+                for (int p = 0; p < PROFILE_PHASES; p++) {
+                    v += i == PROFILE_PHASES || p == i ? profile->counters[p][k] : 0;
+                }
+                printf(" %14llu", (unsigned long long)v);
+            }
+        }
+        printf("\n");
+    }
+}
+
+// Ways a time-sampled batch is treated, decided by where the batch starts in its period
+enum { SAMPLE_SKIP, SAMPLE_WARM, SAMPLE_MEASURE };
+
+static int sample_phase(const time_sampling* sampling, uint64_t position) {
+    if (!sampling || sampling->window == 0) {
+        return SAMPLE_MEASURE;
+    }
+    uint64_t offset = position % sampling->period;
+    if (offset < sampling->warmup) {
+        return SAMPLE_WARM;
+    }
+    return offset < sampling->warmup + sampling->window ? SAMPLE_MEASURE : SAMPLE_SKIP;
+}
+
+// Closes a measured window of a accesses: its counts join the totals and the window sums
+static void sample_flush(sample_result* result, cache_stats* window, uint64_t a, window_sums* sums) {
+    const uint64_t counts[3] = {window->hits, window->misses, window->evictions};
+    sums->a += (double)a;
+    sums->aa += (double)a * (double)a;
+    for (int i = 0; i < 3; i++) {
+        sums->y[i] += (double)counts[i];
+        sums->yy[i] += (double)counts[i] * (double)counts[i];
+        sums->ya[i] += (double)counts[i] * (double)a;
+    }
+    result->measured.hits += window->hits;
+    result->measured.misses += window->misses;
+    result->measured.evictions += window->evictions;
+    result->measured.dirty_evictions += window->dirty_evictions;
+    result->measured.bytes_read += window->bytes_read;
+    result->measured.bytes_written += window->bytes_written;
+    result->windows++;
+    memset(window, 0, sizeof(*window));
+}
+
+// Variance of the ratio estimate N * sum(y) / sum(a) of a population total from K windows,
+// where N is the population's total of a. Windows differ in length by whole batches
+static double ratio_variance(const window_sums* sums, int i, double K, double N) {
+    double mean_a = sums->a / K;
+    if (K < 2 || N <= sums->a) {
+        return 0;
+    }
+    double r = sums->y[i] / sums->a;
+    double resid = (sums->yy[i] - 2 * r * sums->ya[i] + r * r * sums->aa) / (K - 1);
+    return N * N * (1 - sums->a / N) * resid / (K * mean_a * mean_a);
+}
+
+// Variance of the estimate of a population total from n of N units with these sums
+static double sample_variance(double n, double N, double sum, double sumsq) {
+    if (n < 2 || N <= n) {
+        return 0;  // A single unit has no spread, a census has no sampling error
+    }
+    double var = (sumsq - sum * sum / n) / (n - 1);
+    return N * N * (1 - n / N) * var / n;
+}
+
+int runsim_sampled(cache* c, trace_reader* tracefile, const time_sampling* sampling, sample_result* result) {
+    memset(result, 0, sizeof(*result));
+    if (sampling && sampling->window && sampling->period < sampling->warmup + sampling->window) {
+        printf("The sampling period must cover the warm-up and the window\n");
+        return 1;
+    }
+    cache_batch* batch = cache_batch_new();
+    if (!batch) {
+        printf("Error allocating the trace batch\n");
+        return 1;
+    }
+
+    // Windows are whole batches, each batch takes the role of the position it starts at
+    cache_stats window = {0, 0, 0, 0, 0, 0}, warm = {0, 0, 0, 0, 0, 0};
+    window_sums sums;
+    memset(&sums, 0, sizeof(sums));
+    uint64_t window_accesses = 0;
+    uint64_t current = UINT64_MAX;
+    int n;
+    while ((n = cache_batch_fill(batch, tracefile, c->b)) > 0) {
+        uint64_t start = result->accesses;
+        result->accesses += (uint64_t)n;
+        int phase = sample_phase(sampling, start);
+        if (phase == SAMPLE_SKIP) {
+            continue;  // Decoded only to keep the position, never indexed or simulated
+        }
+        cache_batch_index(c, batch);
+        if (phase == SAMPLE_WARM) {
+            // Warm-up brings the sets up to date with the skipped stretch, it counts nowhere
+            set_counts* per_set = c->set_stats;
+            c->set_stats = NULL;
+            cache_access_batch(c, batch, &warm);
+            c->set_stats = per_set;
+            continue;
+        }
+        uint64_t w = sampling && sampling->window ? start / sampling->period : 0;
+        if (w != current && current != UINT64_MAX) {
+            sample_flush(result, &window, window_accesses, &sums);
+            window_accesses = 0;
+        }
+        current = w;
+        cache_access_batch(c, batch, &window);
+        window_accesses += (uint64_t)n;
+        result->measured_accesses += (uint64_t)n;
+    }
+    if (current != UINT64_MAX) {
+        sample_flush(result, &window, window_accesses, &sums);
+    }
+    free(batch);
+
+    // Scale by the share of the trace measured and the share of sets simulated
+    result->total_sets = c->S;
+    result->sets = c->S;
+    if (c->sample_mask) {
+        result->sets = 0;
+        for (int i = 0; i < c->S; i++) {
+            result->sets += set_sampled(c, (uint64_t)i);
+        }
+    }
+    double time_scale = result->measured_accesses ? (double)result->accesses / (double)result->measured_accesses : 0;
+    double set_scale = (double)result->total_sets / (double)result->sets;
+    double scale = time_scale * set_scale;
+    result->estimate.hits = (uint64_t)llround((double)result->measured.hits * scale);
+    result->estimate.misses = (uint64_t)llround((double)result->measured.misses * scale);
+    result->estimate.evictions = (uint64_t)llround((double)result->measured.evictions * scale);
+    result->estimate.dirty_evictions = (uint64_t)llround((double)result->measured.dirty_evictions * scale);
+    result->estimate.bytes_read = (uint64_t)llround((double)result->measured.bytes_read * scale);
+    result->estimate.bytes_written = (uint64_t)llround((double)result->measured.bytes_written * scale);
+
+    // Windows are a sample of every window the trace holds, the sampled sets a sample of every
+    // set. Their variances are added, which treats the two as independent
+    for (int i = 0; i < 3; i++) {
+        double K = (double)result->windows;
+        double var = set_scale * set_scale * ratio_variance(&sums, i, K, (double)result->accesses);
+        if (c->sample_mask) {
+            double sum = 0, sumsq = 0;
+            for (int k = 0; k < c->S; k++) {
+                if (set_sampled(c, (uint64_t)k)) {
+                    const set_counts* set = &c->set_stats[k];
+                    double x = (double)(i == 0 ? set->hits : i == 1 ? set->misses : set->evictions);
+                    sum += x;
+                    sumsq += x * x;
+                }
+            }
+            var += time_scale * time_scale * sample_variance(result->sets, result->total_sets, sum, sumsq);
+        }
+        result->half_width[i] = SAMPLE_Z * sqrt(var);
+    }
+    return 0;
+}
+
+void print_sample(const sample_result* result) {
+    printf("Sampled %d of %d sets, %llu windows covering %llu of %llu accesses\n", result->sets,
+           result->total_sets, (unsigned long long)result->windows, (unsigned long long)result->measured_accesses,
+           (unsigned long long)result->accesses);
+    printf("measured hits:%llu misses:%llu evictions:%llu\n", (unsigned long long)result->measured.hits,
+           (unsigned long long)result->measured.misses, (unsigned long long)result->measured.evictions);
+    printf("95%% confidence: hits:+-%.0f misses:+-%.0f evictions:+-%.0f\n", result->half_width[0],
+           result->half_width[1], result->half_width[2]);
+}
+
+/*
+Streaming
+    runsim_stream is the batched loop of runsim with interval reports on top. Memory is fixed:
+    the trace reader's chunk buffer (or decompression ring) and one batch, however long the
+    stream runs. Reads block, so a producer writing faster than the simulator gets stalled by
+    the full pipe or socket buffer rather than queueing data here. Access-count intervals end
+    exactly every config->every block accesses, splitting batches where needed; timed intervals
+    are checked between batches, so they close on the first batch done after the deadline
+*/
+
+// Drops the first k accesses of an indexed batch
+static void batch_drop(cache_batch* batch, int k) {
+    int rest = batch->count - k;
+    memmove(batch->addr, batch->addr + k, (size_t)rest * sizeof(batch->addr[0]));
+    memmove(batch->set, batch->set + k, (size_t)rest * sizeof(batch->set[0]));
+    memmove(batch->tag, batch->tag + k, (size_t)rest * sizeof(batch->tag[0]));
+    memmove(batch->bytes, batch->bytes + k, (size_t)rest * sizeof(batch->bytes[0]));
+    memmove(batch->write, batch->write + k, (size_t)rest * sizeof(batch->write[0]));
+    batch->count = rest;
+}
+
+// Writes one interval line: the position and time it ends at and the counts it added
+static int stream_emit(const stream_config* config, uint64_t interval, uint64_t accesses, double seconds,
+                       const cache_stats* now, const cache_stats* then) {
+    uint64_t hits = now->hits - then->hits, misses = now->misses - then->misses;
+    double miss_rate = hits + misses ? (double)misses / (double)(hits + misses) : 0;
+    const char* format = config->format == STREAM_JSON
+        ? "{\"interval\":%llu,\"accesses\":%llu,\"seconds\":%.6f,\"hits\":%llu,\"misses\":%llu,\"evictions\":%llu,"
+          "\"dirty_evictions\":%llu,\"bytes_read\":%llu,\"bytes_written\":%llu,\"miss_rate\":%.6f}\n"
+        : "%llu,%llu,%.6f,%llu,%llu,%llu,%llu,%llu,%llu,%.6f\n";
+    fprintf(config->out, format, (unsigned long long)interval, (unsigned long long)accesses, seconds,
+            (unsigned long long)hits, (unsigned long long)misses,
+            (unsigned long long)(now->evictions - then->evictions),
+            (unsigned long long)(now->dirty_evictions - then->dirty_evictions),
+            (unsigned long long)(now->bytes_read - then->bytes_read),
+            (unsigned long long)(now->bytes_written - then->bytes_written), miss_rate);
+    return fflush(config->out) == 0 && !ferror(config->out);
+}
+
+int runsim_stream(cache* c, trace_reader* tracefile, const stream_config* config, cache_stats* stats) {
+    cache_batch* batch = cache_batch_new();
+    if (!batch) {
+        printf("Error allocating the trace batch\n");
+        return 1;
+    }
+    if (config->format == STREAM_CSV) {
+        fprintf(config->out, "interval,accesses,seconds,hits,misses,evictions,dirty_evictions,bytes_read,bytes_written,miss_rate\n");
+    }
+
+    const uint64_t start = profile_clock();
+    const uint64_t period = config->seconds > 0 ? (uint64_t)(config->seconds * 1e9) : 0;
+    uint64_t deadline = period ? start + period : UINT64_MAX;
+    cache_stats then = *stats;  // Counters when the open interval began
+    uint64_t accesses = 0, open = 0, interval = 0;
+    int ok = 1;
+    while (ok && cache_batch_fill(batch, tracefile, c->b) > 0) {
+        cache_batch_index(c, batch);
+        while (ok && batch->count > 0) {
+            // Stop the batch short where an access-count interval ends
+            int n = batch->count, k = n;
+            if (config->every && open + (uint64_t)n > config->every) {
+                k = (int)(config->every - open);
+            }
+            batch->count = k;
+            cache_access_batch(c, batch, stats);
+            batch->count = n;
+            batch_drop(batch, k);
+            accesses += (uint64_t)k;
+            open += (uint64_t)k;
+
+            uint64_t now = period ? profile_clock() : 0;
+            if ((config->every && open == config->every) || now >= deadline) {
+                now = now ? now : profile_clock();
+                ok = stream_emit(config, interval++, accesses, (double)(now - start) * 1e-9, stats, &then);
+                then = *stats;
+                open = 0;
+                while (deadline <= now) {
+                    deadline += period;
+                }
+            }
+        }
+    }
+    if (ok && open > 0) {
+        ok = stream_emit(config, interval, accesses, (double)(profile_clock() - start) * 1e-9, stats, &then);
+    }
+    free(batch);
+    if (!ok) {
+        printf("Error writing interval statistics\n");
+    }
+    return !ok;
+}
+
+cache_batch* cache_batch_new(void) {
+    cache_batch* batch = NULL;
+    if (posix_memalign((void**)&batch, CACHE_ALIGN, sizeof(cache_batch)) != 0) {
+        return NULL;
+    }
+    batch->count = 0;
+    batch->pending_passes = 0;
+    return batch;
+}
+
+// Emits the pending access block by block, returns 0 if the batch filled up first
+static int cache_batch_emit(cache_batch* batch, int b) {
+    while (batch->pending_passes > 0) {
+        unsigned long end = batch->pending_last >> b;
+        for (;;) {
+            if (batch->count == CACHE_BATCH) {
+                return 0;
+            }
+            unsigned long lo = batch->pending_next;
+            unsigned long block = lo >> b;
+            unsigned long hi = block == end ? batch->pending_last : ((block + 1) << b) - 1;
+            int k = batch->count++;
+            batch->addr[k] = lo;
+            batch->write[k] = (uint8_t)batch->pending_write;
+            batch->bytes[k] = (uint32_t)(hi - lo + 1);
+            if (block == end) {
+                break;
+            }
+            batch->pending_next = (block + 1) << b;
+        }
+        // A modify's second pass is the store
+        batch->pending_passes--;
+        batch->pending_write = 1;
+        batch->pending_next = batch->pending_address;
+    }
+    return 1;
+}
+
+int cache_batch_fill(cache_batch* batch, trace_reader* tracefile, int b) {
+    // Finish the record that did not fit last time, then decode until the batch is full
+    batch->count = 0;
+    if (!cache_batch_emit(batch, b)) {
+        return batch->count;
+    }
+    char operation;
+    unsigned long address;
+    int size;
+    while (batch->count < CACHE_BATCH && trace_next(tracefile, &operation, &address, &size) > 0) {
+        if (operation != 'L' && operation != 'S' && operation != 'M') {
+            continue;
+        }
+        // Common case: the access stays in one block and fits, a modify is two entries
+        unsigned long last = access_last(address, size);
+        int k = batch->count;
+        if (__builtin_expect(!access_splits(address, last, b) && k + 2 <= CACHE_BATCH, 1)) {
+            batch->addr[k] = address;
+            batch->write[k] = operation == 'S';
+            batch->bytes[k] = (uint32_t)(last - address + 1);
+            if (operation == 'M') {
+                batch->addr[k + 1] = address;
+                batch->write[k + 1] = 1;
+                batch->bytes[k + 1] = (uint32_t)(last - address + 1);
+                k++;
+            }
+            batch->count = k + 1;
+            continue;
+        }
+        batch->pending_address = batch->pending_next = address;
+        batch->pending_last = last;
+        batch->pending_write = operation == 'S';
+        batch->pending_passes = operation == 'M' ? 2 : 1;
+        if (!cache_batch_emit(batch, b)) {
+            break;
+        }
+    }
+    return batch->count;
+}
+
+// cache_batch_index under set sampling or sharding: accesses to other sets are dropped as
+// soon as their set is known, so they never touch cache state
+static void cache_batch_index_kept(const cache* c, cache_batch* batch) {
+    const int b = c->b, sb = c->s + c->b;
+    const uint64_t mask = (1ULL << c->s) - 1;
+    const int n = batch->count;
+    int m = 0;
+    for (int k = 0; k < n; k++) {
+        uint64_t addr = batch->addr[k];
+        uint64_t set = (addr >> b) & mask;
+        if (set_sampled(c, set) && set_in_shard(c, set)) {
+            batch->addr[m] = addr;
+            batch->bytes[m] = batch->bytes[k];
+            batch->write[m] = batch->write[k];
+            batch->set[m] = set;
+            batch->tag[m] = addr >> sb;
+            m++;
+        }
+    }
+    batch->count = m;
+}
+
+void cache_batch_index(const cache* c, cache_batch* batch) {
+    if (c->sample_mask || c->shards) {
+        cache_batch_index_kept(c, batch);
+        return;
+    }
+    // Straight-line shift and mask over the whole batch, which the compiler vectorizes
+    const int b = c->b, sb = c->s + c->b;
+    const uint64_t mask = (1ULL << c->s) - 1;
+    const int n = batch->count;
+    const uint64_t* restrict addr = batch->addr;
+    uint64_t* restrict set = batch->set;
+    uint64_t* restrict tag = batch->tag;
+    for (int k = 0; k < n; k++) {
+        set[k] = (addr[k] >> b) & mask;
+        tag[k] = addr[k] >> sb;
+    }
+}
+
+void cache_access_batch(cache* c, const cache_batch* batch, cache_stats* stats) {
+    kernels[c->kernel].refs[c->set_stats != NULL](c, batch, stats);
+}
+
+// Recorded per set only after this is called, so runs that do not need them pay nothing
+int cache_enable_set_stats(cache* c) {
+    if (c->set_stats) {
+        return 1;
+    }
+    // The arena reserved zeroed room for them, untouched and so not even paged in until now
+    c->set_stats = c->set_area;
+    return 1;
+}
+
+const set_counts* cache_set_stats(const cache* c) {
+    return c->set_stats;
+}
+
+int cache_sample_sets(cache* c, int ratio) {
+    // The confidence interval comes from the spread of the sampled sets' own counts
+    if (ratio < 1 || (ratio & (ratio - 1)) != 0 || ratio > c->S || !cache_enable_set_stats(c)) {
+        return 0;
+    }
+    c->sample_mask = (uint64_t)ratio - 1;
+    int sets = 0;
+    for (int i = 0; i < c->S; i++) {
+        sets += set_sampled(c, (uint64_t)i);
+    }
+    if (sets == 0) {
+        c->sample_mask = 0;  // The hash kept nothing, which only a tiny cache can hit
+    }
+    return sets;
+}
+
+int write_set_stats(const cache* c, const char* path) {
+    return write_set_counts(c->set_stats, c->S, path);
+}
+
+static int write_set_counts(const set_counts* sets, int S, const char* path) {
+    FILE* out = strcmp(path, "-") == 0 ? stdout : fopen(path, "w");
+    if (!out) {
+        printf("Error opening %s\n", path);
+        return 1;
+    }
+    fprintf(out, "set,hits,misses,evictions\n");
+    for (int i = 0; i < S; i++) {
+        const set_counts* set = &sets[i];
+        fprintf(out, "%d,%llu,%llu,%llu\n", i, (unsigned long long)set->hits,
+                (unsigned long long)set->misses, (unsigned long long)set->evictions);
+    }
+    int failed = out == stdout ? fflush(out) != 0 : fclose(out) != 0;
+    if (failed) {
+        printf("Error writing %s\n", path);
+    }
+    return failed;
+}
+
+int cache_invalidate(cache* c, unsigned long address) {
+    unsigned long cache_set = (address >> c->b) & ((1UL << c->s) - 1);
+    uint64_t tag = address >> (c->s + c->b);
+    uint64_t* tags = c->tags + cache_set * (unsigned long)c->E;
+    uint64_t* valid = c->valid + cache_set * (unsigned long)c->valid_words;
+    int empty;
+    int way = tag_probe(c, tags, valid, tag, &empty, 1);
+    if (way < 0) {
+        return 0;
+    }
+    valid[way >> 6] &= ~(1ULL << (way & 63));
+    dirty_set(c->dirty + cache_set * (unsigned long)c->valid_words, way, 0);
+
+    // LRU and FIFO drop the line from their order so the remaining lines keep theirs. PLRU and
+    // RRIP set the way's state again when it is next filled, and Random has none
+    if (c->E > 1 && c->policy == POLICY_FIFO) {
+        fifo_remove(c, cache_set, way);
+    }
+    else if (c->E > 1 && c->policy == POLICY_LRU) {
+        if (c->wide) {
+            lru_list_unlink((uint16_t*)repl_row(c, cache_set), c->E, way);
+        }
+        else {
+            int* ages = (int*)repl_row(c, cache_set);
+            for (int i = 0; i < c->E; i++) {
+                if (((valid[i >> 6] >> (i & 63)) & 1) && ages[i] > ages[way]) {
+                    ages[i]--;
+                }
+            }
+        }
+    }
+    return 1;
+}
+
+// Finds the way holding a block, -1 if absent, and the set it maps to
+static int cache_find(const cache* c, unsigned long address, unsigned long* cache_set) {
+    *cache_set = (address >> c->b) & ((1UL << c->s) - 1);
+    const uint64_t* tags = c->tags + *cache_set * (unsigned long)c->E;
+    const uint64_t* valid = c->valid + *cache_set * (unsigned long)c->valid_words;
+    int empty;
+    return tag_probe(c, tags, valid, address >> (c->s + c->b), &empty, 1);
+}
+
+int cache_line_state(const cache* c, unsigned long address) {
+    unsigned long cache_set;
+    int way = cache_find(c, address, &cache_set);
+    if (way < 0) {
+        return LINE_ABSENT;
+    }
+    const uint64_t* dirty = c->dirty + cache_set * (unsigned long)c->valid_words;
+    return (dirty[way >> 6] >> (way & 63)) & 1 ? LINE_DIRTY : LINE_CLEAN;
+}
+
+int cache_clean(cache* c, unsigned long address) {
+    unsigned long cache_set;
+    int way = cache_find(c, address, &cache_set);
+    if (way < 0) {
+        return 0;
+    }
+    uint64_t* dirty = c->dirty + cache_set * (unsigned long)c->valid_words;
+    int was = (dirty[way >> 6] >> (way & 63)) & 1;
+    dirty_set(dirty, way, 0);
+    return was;
+}
+
+int cache_lookup(cache* c, unsigned long address, int write, unsigned long* evicted, cache_stats* stats) {
+    return kernels[c->kernel].lookup(c, address, write, evicted, stats);
+}
+
+/*
+Cache hierarchy
+    Levels are read from a -H config file, one per line:
+        <name> s=<num> E=<num> b=<num> [policy=<name>] [inclusion=inclusive|exclusive|nine] [serves=i|d|u]
+               [write=wb|wt] [alloc=wa|nwa]
+    Levels that serve only instructions (i) or only data (d) form the first level. Unified
+    levels (u, the default) chain below them in file order, and the first unified level is
+    the first level for data when there is no d level. Instruction fetches are only
+    simulated when an i level exists. The inclusion policy of a level describes it relative
+    to every level above it:
+        inclusive: evicting a block also invalidates it in every level above
+        exclusive: blocks are never filled here on a demand miss; a block found here moves up
+                   and leaves this level, and victims of the level above are inserted here
+        nine: filled on every miss, no back-invalidation (non-inclusive non-exclusive)
+    A first-level hit returns before any lower level is looked at. Stores are only stores at
+    the first level: fills below it are reads, and write-backs and write-throughs are counted
+    as traffic of the level they leave rather than simulated as writes into the next level.
+    That includes the write-back of a dirty line a back-invalidation removes.
+*/
+static const char* inclusion_names[] = {"nine", "inclusive", "exclusive"};
+
+// Strips comments and splits a config line on whitespace, returns the token count
+static int split_tokens(char* line, char** tokens, int max) {
+    char* hash = strchr(line, '#');
+    if (hash) {
+        *hash = '\0';
+    }
+    int n = 0;
+    for (char* tok = strtok(line, " \t\r\n"); tok && n < max; tok = strtok(NULL, " \t\r\n")) {
+        tokens[n++] = tok;
+    }
+    return n;
+}
+
+void freehierarchy(hierarchy* h) {
+    if (h) {
+        for (int i = 0; i < h->count; i++) {
+            freecache(h->levels[i].c);
+        }
+        free(h);
+    }
+}
+
+hierarchy* load_hierarchy(const char* path, int policy, int write_policy) {
+    FILE* f = fopen(path, "r");
+    if (!f) {
+        printf("Error opening hierarchy config %s\n", path);
+        return NULL;
+    }
+    hierarchy* h = (hierarchy*)calloc(1, sizeof(hierarchy));
+    if (!h) {
+        fclose(f);
+        return NULL;
+    }
+
+    char line[HIER_LINE_MAX];
+    int lineno = 0, ok = 1;
+    while (ok && fgets(line, sizeof(line), f)) {
+        lineno++;
+        char* tokens[16];
+        int n = split_tokens(line, tokens, 16);
+        if (n == 0) {
+            continue;
+        }
+        if (h->count == HIER_MAX_LEVELS) {
+            printf("%s:%d: at most %d levels are supported\n", path, lineno, HIER_MAX_LEVELS);
+            ok = 0;
+            break;
+        }
+
+        // Level name, then key=value settings
+        hier_level* lvl = &h->levels[h->count];
+        snprintf(lvl->name, sizeof(lvl->name), "%s", tokens[0]);
+        int s = -1, E = 0, b = -1, p = policy, w = write_policy;
+        lvl->serves = LEVEL_UNIFIED;
+        lvl->inclusion = INCLUSION_NINE;
+        for (int k = 1; k < n && ok; k++) {
+            char* eq = strchr(tokens[k], '=');
+            if (!eq) {
+                printf("%s:%d: expected key=value, got %s\n", path, lineno, tokens[k]);
+                ok = 0;
+                break;
+            }
+            *eq = '\0';
+            const char* key = tokens[k];
+            const char* val = eq + 1;
+            if (strcmp(key, "s") == 0) s = atoi(val);
+            else if (strcmp(key, "E") == 0) E = atoi(val);
+            else if (strcmp(key, "b") == 0) b = atoi(val);
+            else if (strcmp(key, "policy") == 0) {
+                p = parse_policy(val);
+                ok = p >= 0;
+            }
+            else if (strcmp(key, "inclusion") == 0) {
+                lvl->inclusion = -1;
+                for (int m = 0; m < 3; m++) {
+                    if (strcmp(val, inclusion_names[m]) == 0) lvl->inclusion = m;
+                }
+                ok = lvl->inclusion >= 0;
+            }
+            else if (strcmp(key, "write") == 0) {
+                ok = parse_write_option(val, WRITE_BACK, "wb", "wt", &w);
+            }
+            else if (strcmp(key, "alloc") == 0) {
+                ok = parse_write_option(val, WRITE_ALLOCATE, "wa", "nwa", &w);
+            }
+            else if (strcmp(key, "serves") == 0) {
+                lvl->serves = strcmp(val, "i") == 0 ? LEVEL_INSTR : strcmp(val, "d") == 0 ? LEVEL_DATA
+                            : strcmp(val, "u") == 0 ? LEVEL_UNIFIED : -1;
+                ok = lvl->serves >= 0;
+            }
+            else {
+                ok = 0;
+            }
+            if (!ok) {
+                printf("%s:%d: bad setting %s=%s\n", path, lineno, key, val);
+            }
+        }
+        if (!ok) {
+            break;
+        }
+        if (s < 0 || E <= 0 || b < 0) {
+            printf("%s:%d: level %s needs s, E and b\n", path, lineno, lvl->name);
+            ok = 0;
+            break;
+        }
+        lvl->c = makecache(s, E, b, p, w);
+        if (!lvl->c) {
+            ok = 0;
+            break;
+        }
+        h->count++;
+    }
+    fclose(f);
+
+    // Wire up the levels: split first levels feed the first unified level, unified levels chain
+    h->entry_instr = h->entry_data = -1;
+    int prev_unified = -1;
+    for (int i = 0; ok && i < h->count; i++) {
+        h->levels[i].below = -1;
+        if (h->levels[i].serves == LEVEL_INSTR && h->entry_instr < 0) h->entry_instr = i;
+        else if (h->levels[i].serves == LEVEL_DATA && h->entry_data < 0) h->entry_data = i;
+        else if (h->levels[i].serves != LEVEL_UNIFIED) {
+            printf("%s: only one %s level is supported\n", path, h->levels[i].serves == LEVEL_INSTR ? "i" : "d");
+            ok = 0;
+        }
+        else {
+            if (prev_unified >= 0) h->levels[prev_unified].below = i;
+            prev_unified = i;
+        }
+    }
+    int first_unified = -1;
+    for (int i = 0; ok && i < h->count; i++) {
+        if (h->levels[i].serves == LEVEL_UNIFIED) {
+            first_unified = i;
+            break;
+        }
+    }
+    if (ok) {
+        if (h->entry_instr >= 0) h->levels[h->entry_instr].below = first_unified;
+        if (h->entry_data >= 0) h->levels[h->entry_data].below = first_unified;
+        else h->entry_data = first_unified;
+        if (h->entry_data < 0) {
+            printf("%s: no level serves data accesses\n", path);
+            ok = 0;
+        }
+    }
+
+    // Levels above each level, for back-invalidation
+    for (int i = 0; ok && i < h->count; i++) {
+        for (int k = h->levels[i].below; k >= 0; k = h->levels[k].below) {
+            h->levels[k].above |= 1u << i;
+        }
+    }
+    if (!ok) {
+        freehierarchy(h);
+        return NULL;
+    }
+    return h;
+}
+
+// Inserts a block evicted from the level above into an exclusive level, cascading its own victim
+static void hier_insert(hierarchy* h, int k, unsigned long block) {
+    while (k >= 0 && h->levels[k].inclusion == INCLUSION_EXCLUSIVE) {
+        hier_level* lvl = &h->levels[k];
+        unsigned long evicted;
+        cache_stats fill = {0, 0, 0, 0, 0, 0};  // A victim arrives from above, it is not read from below
+        lvl->victim_fills++;
+        int result = cache_lookup(lvl->c, block, 0, &evicted, &fill);
+        lvl->stats.dirty_evictions += fill.dirty_evictions;
+        lvl->stats.bytes_written += fill.bytes_written;
+        if (result != CACHE_EVICT) {
+            return;
+        }
+        lvl->stats.evictions++;
+        block = evicted;
+        k = lvl->below;
+    }
+}
+
+// Invalidates every part of a block in every level above an inclusive level. A dirty copy is
+// written back first, counted as a dirty eviction and traffic of the level it leaves
+static void hier_back_invalidate(hierarchy* h, int k, unsigned long block) {
+    int b = h->levels[k].c->b;
+    for (unsigned above = h->levels[k].above; above; above &= above - 1) {
+        hier_level* up = &h->levels[__builtin_ctz(above)];
+        // A level above with smaller blocks holds up to 2^(b - its b) pieces of the evicted block
+        unsigned long step = 1UL << up->c->b;
+        unsigned long pieces = up->c->b < b ? 1UL << (b - up->c->b) : 1;
+        unsigned long at = block & ~(step - 1);
+        for (unsigned long i = 0; i < pieces; i++, at += step) {
+            int dirty = cache_line_state(up->c, at) == LINE_DIRTY;
+            if (cache_invalidate(up->c, at)) {
+                up->invalidations++;
+                if (dirty) {
+                    up->stats.dirty_evictions++;
+                    up->stats.bytes_written += step;
+                }
+            }
+        }
+    }
+}
+
+void hier_access(hierarchy* h, int entry, unsigned long address, int write, unsigned long bytes, int verbose) {
+    // Walk down until some level has the block
+    for (int k = entry; k >= 0; ) {
+        hier_level* lvl = &h->levels[k];
+        int below = lvl->below;
+        int result;
+        unsigned long evicted = 0;
+        if (lvl->above && lvl->inclusion == INCLUSION_EXCLUSIVE) {
+            // The block moves up out of an exclusive level, and a miss does not fill it here
+            result = cache_invalidate(lvl->c, address) ? CACHE_HIT : CACHE_MISS;
+        }
+        else {
+            result = cache_lookup(lvl->c, address, write, &evicted, &lvl->stats);
+            store_through(lvl->c, write, result, bytes, &lvl->stats);
+        }
+        if (verbose) {
+            verbose_write(lvl->name);
+            verbose_write(":");
+            verbose_write(result_names[result]);
+        }
+        if (result == CACHE_HIT) {
+            lvl->stats.hits++;
+            return;
+        }
+        // A store that was not allocated here is done, its bytes went on as traffic
+        if (write && !(lvl->c->write_policy & WRITE_ALLOCATE)) {
+            lvl->stats.misses++;
+            return;
+        }
+        write = 0;
+        lvl->stats.misses++;
+        if (result == CACHE_EVICT) {
+            lvl->stats.evictions++;
+            if (lvl->inclusion == INCLUSION_INCLUSIVE) {
+                hier_back_invalidate(h, k, evicted);
+            }
+        }
+
+        // Fetch the demand block from below first so the victim cannot displace it there
+        k = below;
+        if (result == CACHE_EVICT && below >= 0) {
+            hier_level* next = &h->levels[below];
+            if (next->inclusion == INCLUSION_EXCLUSIVE) {
+                hier_access(h, below, address, 0, bytes, verbose);
+                hier_insert(h, below, evicted);
+                return;
+            }
+        }
+    }
+    h->memory_accesses++;
+}
+
+void runhierarchy(hierarchy* h, trace_reader* tracefile, int verbose) {
+    char operation;
+    unsigned long address;
+    int size;
+    while (trace_next(tracefile, &operation, &address, &size) > 0) {
+        int entry;
+        if (operation == 'I') {
+            // Instruction fetches need an instruction level
+            if (h->entry_instr < 0) {
+                continue;
+            }
+            entry = h->entry_instr;
+        }
+        else if (operation == 'L' || operation == 'S' || operation == 'M') {
+            entry = h->entry_data;
+        }
+        else {
+            continue;
+        }
+        if (verbose) {
+            verbose_record(operation, address, size);
+        }
+        // Split at the first level's block size, lower levels see one access per first-level block
+        int b = h->levels[entry].c->b;
+        unsigned long last = access_last(address, size);
+        unsigned long end = last >> b;
+        // A load or fetch is one read pass, a store one write pass, and a modify a read then a write
+        for (int write = operation == 'S'; write <= (operation == 'S' || operation == 'M'); write++) {
+            unsigned long block = address >> b;
+            do {
+                unsigned long lo = block == address >> b ? address : block << b;
+                unsigned long hi = block == end ? last : ((block + 1) << b) - 1;
+                hier_access(h, entry, lo, write, hi - lo + 1, verbose);
+            } while (block++ != end);
+        }
+        if (verbose) {
+            verbose_write("\n");
+        }
+    }
+    verbose_flush();
+}
+
+const cache_stats* hier_stats(const hierarchy* h, const char* name) {
+    for (int i = 0; i < h->count; i++) {
+        if (strcmp(h->levels[i].name, name) == 0) {
+            return &h->levels[i].stats;
+        }
+    }
+    return NULL;
+}
+
+void print_hierarchy(const hierarchy* h) {
+    for (int i = 0; i < h->count; i++) {
+        const hier_level* lvl = &h->levels[i];
+        printf("%s ", lvl->name);
+        print_summary(&lvl->stats);
+        printf("%s ", lvl->name);
+        print_traffic(&lvl->stats);
+        if (lvl->invalidations || lvl->victim_fills) {
+            printf("%s invalidations:%llu victim_fills:%llu\n", lvl->name,
+                   (unsigned long long)lvl->invalidations, (unsigned long long)lvl->victim_fills);
+        }
+    }
+    printf("memory accesses:%llu\n", (unsigned long long)h->memory_accesses);
+}
+
+/*
+Binary trace format (.ctr)
+    An 8-byte header (CTR_MAGIC, then the format version) followed by one variable-length
+    record per access:
+        byte 0: operation in bits 0-1 (I, L, S, M), size in bits 2-7 (CTR_SIZE_ESCAPE means
+                the size follows as a varint)
+        then the zigzag varint difference between this address and the previous record's
+    Varints are LEB128, 7 bits per byte with the high bit marking a continuation. Typical
+    lackey records shrink from ~20 text bytes to 3-4.
+*/
+static const char ctr_ops[4] = {'I', 'L', 'S', 'M'};
+
+static inline unsigned char* put_varint(unsigned char* p, uint64_t v) {
+    while (v >= 0x80) {
+        *p++ = (unsigned char)(v | 0x80);
+        v >>= 7;
+    }
+    *p++ = (unsigned char)v;
+    return p;
+}
+
+// Reads a varint, returns NULL if it runs past end
+static inline const unsigned char* get_varint(const unsigned char* p, const unsigned char* end, uint64_t* v) {
+    uint64_t x = 0;
+    for (int shift = 0; p < end && shift < 64; shift += 7) {
+        unsigned char byte = *p++;
+        x |= (uint64_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            *v = x;
+            return p;
+        }
+    }
+    return NULL;
+}
+
+static int trace_next_binary(trace_reader* r, char* op, unsigned long* address, int* size) {
+    // A record is at most 21 bytes, well within TRACE_LINE_MAX
+    if (!r->eof && r->len - r->pos < TRACE_LINE_MAX) {
+        trace_refill(r);
+    }
+    const unsigned char* p = (const unsigned char*)r->buf + r->pos;
+    const unsigned char* end = (const unsigned char*)r->buf + r->len;
+    if (p >= end) {
+        return 0;
+    }
+
+    unsigned char head = *p++;
+    uint64_t sz = head >> 2, delta;
+    if (sz == CTR_SIZE_ESCAPE) {
+        p = get_varint(p, end, &sz);
+    }
+    if (p) {
+        p = get_varint(p, end, &delta);
+    }
+    if (!p) {
+        // Truncated final record
+        r->pos = r->len;
+        return 0;
+    }
+    r->pos = (size_t)((const char*)p - r->buf);
+
+    // Undo the zigzag encoding and apply the delta
+    r->last_address += (delta >> 1) ^ (0 - (delta & 1));
+    *op = ctr_ops[head & 3];
+    *address = (unsigned long)r->last_address;
+    *size = (int)sz;
+    return 1;
+}
+
+int convert_trace(const char* inpath, const char* outpath) {
+    trace_reader* in = trace_open(inpath);
+    if (!in) {
+        printf("Error opening trace file. Make sure path and name is correct\n");
+        return 1;
+    }
+    FILE* out = strcmp(outpath, "-") == 0 ? stdout : fopen(outpath, "wb");
+    unsigned char* buf = (unsigned char*)malloc(TRACE_CHUNK);
+    if (!out || !buf) {
+        printf("Error opening output file %s\n", outpath);
+        if (out && out != stdout) {
+            fclose(out);
+        }
+        free(buf);
+        trace_close(in);
+        return 1;
+    }
+
+    // Header
+    unsigned char* p = buf;
+    memcpy(p, CTR_MAGIC, CTR_MAGIC_LEN);
+    p += CTR_MAGIC_LEN;
+    *p++ = CTR_VERSION;
+
+    char operation;
+    unsigned long address;
+    int size;
+    uint64_t last = 0;
+    unsigned long records = 0, written = 0;
+    int ok = 1;
+    while (ok && trace_next(in, &operation, &address, &size) > 0) {
+        // Only lackey's four operations have a code, anything else is dropped
+        const char* code = memchr(ctr_ops, operation, sizeof(ctr_ops));
+        if (!code || size < 0) {
+            continue;
+        }
+        unsigned sz = (unsigned)size < CTR_SIZE_ESCAPE ? (unsigned)size : CTR_SIZE_ESCAPE;
+        *p++ = (unsigned char)((sz << 2) | (unsigned)(code - ctr_ops));
+        if (sz == CTR_SIZE_ESCAPE) {
+            p = put_varint(p, (uint64_t)size);
+        }
+        // Zigzag keeps small backward steps as short as small forward ones
+        uint64_t delta = (uint64_t)address - last;
+        p = put_varint(p, (delta << 1) ^ (0 - (delta >> 63)));
+        last = address;
+        records++;
+
+        // Flush once another record might not fit
+        if ((size_t)(p - buf) > TRACE_CHUNK - TRACE_LINE_MAX) {
+            ok = fwrite(buf, 1, (size_t)(p - buf), out) == (size_t)(p - buf);
+            written += (unsigned long)(p - buf);
+            p = buf;
+        }
+    }
+    if (ok && p > buf) {
+        ok = fwrite(buf, 1, (size_t)(p - buf), out) == (size_t)(p - buf);
+        written += (unsigned long)(p - buf);
+    }
+    if (out != stdout) {
+        ok = fclose(out) == 0 && ok;
+    }
+    else {
+        ok = fflush(out) == 0 && ok;
+    }
+    free(buf);
+    trace_close(in);
+
+    if (!ok) {
+        printf("Error writing %s\n", outpath);
+        return 1;
+    }
+    if (out != stdout) {
+        printf("Converted %lu records into %lu bytes\n", records, written);
+    }
+    return 0;
+}
+
+int trace_batch(trace_reader* r, mem_access* out, int max) {
+    char operation;
+    unsigned long address;
+    int size, n = 0;
+    // Leave room for the second access of a modify
+    while (n + 2 <= max && trace_next(r, &operation, &address, &size) > 0) {
+        if (operation == 'L' || operation == 'S' || operation == 'M') {
+            // Block splitting depends on b, so the consumer does it from the last byte
+            unsigned long last = access_last(address, size);
+            out[n].address = address;
+            out[n].last = last;
+            out[n++].write = operation == 'S';
+            // Modify operation is load and store combined
+            if (operation == 'M') {
+                out[n].address = address;
+                out[n].last = last;
+                out[n++].write = 1;
+            }
+        }
+    }
+    return n;
+}
+
+// Parses "a..b" or "a" into an inclusive range, returns 0 on malformed input
+static int parse_range(const char* tok, int* lo, int* hi) {
+    char* end;
+    long a = strtol(tok, &end, 10);
+    if (end == tok) {
+        return 0;
+    }
+    long z = a;
+    if (end[0] == '.' && end[1] == '.') {
+        const char* rest = end + 2;
+        z = strtol(rest, &end, 10);
+        if (end == rest) {
+            return 0;
+        }
+    }
+    if (*end != '\0' || a < 0 || z < a || z > SWEEP_MAX_VALUE) {
+        return 0;
+    }
+    *lo = (int)a;
+    *hi = (int)z;
+    return 1;
+}
+
+int parse_sweep(const char* spec, sweep_config** out) {
+    // Values collected for s, E and b, in the order given
+    int vals[3][SWEEP_MAX_VALUES];
+    int counts[3] = {0, 0, 0};
+    int key = -1;
+
+    char* copy = strdup(spec);
+    if (!copy) {
+        return -1;
+    }
+    for (char* tok = strtok(copy, ","); tok; tok = strtok(NULL, ",")) {
+        // "k=..." starts a new parameter, bare values extend the current one
+        if (tok[0] != '\0' && tok[1] == '=') {
+            key = tok[0] == 's' ? 0 : tok[0] == 'E' ? 1 : tok[0] == 'b' ? 2 : -1;
+            if (key < 0) {
+                free(copy);
+                return -1;
+            }
+            tok += 2;
+        }
+        int lo, hi;
+        if (key < 0 || !parse_range(tok, &lo, &hi)) {
+            free(copy);
+            return -1;
+        }
+        for (int v = lo; v <= hi; v++) {
+            if (counts[key] == SWEEP_MAX_VALUES) {
+                free(copy);
+                return -1;
+            }
+            vals[key][counts[key]++] = v;
+        }
+    }
+    free(copy);
+
+    // Every parameter needs at least one value, E additionally needs to be positive
+    if (counts[0] == 0 || counts[1] == 0 || counts[2] == 0) {
+        return -1;
+    }
+    for (int i = 0; i < counts[1]; i++) {
+        if (vals[1][i] == 0) {
+            return -1;
+        }
+    }
+
+    // One configuration per point of the s x E x b product
+    int n = counts[0] * counts[1] * counts[2];
+    sweep_config* configs = (sweep_config*)calloc((size_t)n, sizeof(sweep_config));
+    if (!configs) {
+        return -1;
+    }
+    int k = 0;
+    for (int i = 0; i < counts[0]; i++) {
+        for (int j = 0; j < counts[1]; j++) {
+            for (int l = 0; l < counts[2]; l++) {
+                configs[k].s = vals[0][i];
+                configs[k].E = vals[1][j];
+                configs[k].b = vals[2][l];
+                k++;
+            }
+        }
+    }
+    *out = configs;
+    return n;
+}
+
+int runsweep(sweep_config* configs, int n, trace_reader* tracefile, int policy, int write_policy) {
+    // Build every cache up front
+    for (int i = 0; i < n; i++) {
+        configs[i].c = makecache(configs[i].s, configs[i].E, configs[i].b, policy, write_policy);
+        if (!configs[i].c) {
+            printf("Error creating cache s=%d E=%d b=%d\n", configs[i].s, configs[i].E, configs[i].b);
+            for (int j = 0; j < i; j++) {
+                freecache(configs[j].c);
+            }
+            return 1;
+        }
+    }
+
+    mem_access* accesses = (mem_access*)malloc(SWEEP_BATCH * sizeof(mem_access));
+    if (!accesses) {
+        printf("Error allocating sweep batch\n");
+        for (int i = 0; i < n; i++) {
+            freecache(configs[i].c);
+        }
+        return 1;
+    }
+
+    // Parse a batch once, then run each cache over the whole batch so only one cache's
+    // state is hot at a time while the batch itself stays in the host cache
+    int count;
+    while ((count = trace_batch(tracefile, accesses, SWEEP_BATCH)) > 0) {
+        for (int i = 0; i < n; i++) {
+            cache* c = configs[i].c;
+            kernels[c->kernel].batch[0](c, accesses, count, &configs[i].stats);
+        }
+    }
+
+    // One summary row per configuration
+    for (int i = 0; i < n; i++) {
+        printf("s=%d E=%d b=%d ", configs[i].s, configs[i].E, configs[i].b);
+        print_summary(&configs[i].stats);
+        printf("s=%d E=%d b=%d ", configs[i].s, configs[i].E, configs[i].b);
+        print_traffic(&configs[i].stats);
+        freecache(configs[i].c);
+        configs[i].c = NULL;
+    }
+    free(accesses);
+    return 0;
+}
+
+/*
+Stack distance engine
+    Under LRU a block hits in an E-way set exactly when fewer than E distinct blocks of the
+    same set were touched since its previous access (its stack distance). Each set numbers
+    its accesses with slots and keeps a Fenwick tree with a 1 at the latest slot of every
+    block it holds, so a distance is a prefix-sum difference. When a set runs out of slots
+    its live markers are renumbered into a fresh tree, keeping memory proportional to the
+    number of distinct blocks. A hash map gives each block's latest slot.
+*/
+static inline uint64_t block_hash(uint64_t key) {
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    return key;
+}
+
+// Finds the map entry for a block, or the empty entry where it belongs
+static inline size_t block_map_find(const block_map* m, uint64_t block) {
+    size_t i = (size_t)block_hash(block) & m->mask;
+    while (m->keys[i] != 0 && m->keys[i] != block + 1) {
+        i = (i + 1) & m->mask;
+    }
+    return i;
+}
+
+static int block_map_grow(block_map* m) {
+    size_t cap = m->keys ? 2 * (m->mask + 1) : STACK_MAP_INIT;
+    uint64_t* keys = (uint64_t*)calloc(cap, sizeof(uint64_t));
+    uint32_t* slots = (uint32_t*)malloc(cap * sizeof(uint32_t));
+    if (!keys || !slots) {
+        free(keys);
+        free(slots);
+        return 0;
+    }
+    block_map grown = {keys, slots, cap - 1, m->count};
+    for (size_t i = 0; m->keys && i <= m->mask; i++) {
+        if (m->keys[i]) {
+            size_t j = block_map_find(&grown, m->keys[i] - 1);
+            keys[j] = m->keys[i];
+            slots[j] = m->slots[i];
+        }
+    }
+    free(m->keys);
+    free(m->slots);
+    *m = grown;
+    return 1;
+}
+
+static inline void fenwick_add(uint32_t* tree, uint32_t cap, uint32_t slot, int delta) {
+    for (uint32_t i = slot + 1; i <= cap; i += i & (0u - i)) {
+        tree[i - 1] += (uint32_t)delta;
+    }
+}
+
+// Number of markers in slots [0, slot)
+static inline uint32_t fenwick_prefix(const uint32_t* tree, uint32_t slot) {
+    uint32_t sum = 0;
+    for (uint32_t i = slot; i > 0; i -= i & (0u - i)) {
+        sum += tree[i - 1];
+    }
+    return sum;
+}
+
+// Renumbers a set's live blocks into slots 0..distinct-1 of a tree with room to spare
+static int stack_set_compact(stack_set* st, block_map* m) {
+    uint32_t cap = st->distinct * 2 > STACK_SET_INIT ? st->distinct * 2 : STACK_SET_INIT;
+    uint32_t* tree = (uint32_t*)calloc(cap, sizeof(uint32_t));
+    uint64_t* owner = (uint64_t*)malloc((size_t)cap * sizeof(uint64_t));
+    if (!tree || !owner) {
+        free(tree);
+        free(owner);
+        return 0;
+    }
+    uint32_t live = 0;
+    for (uint32_t t = 0; t < st->next; t++) {
+        size_t i = block_map_find(m, st->owner[t]);
+        if (m->slots[i] == t) {
+            // Slot t is this block's latest access, keep it
+            m->slots[i] = live;
+            owner[live] = st->owner[t];
+            tree[live] = 1;
+            live++;
+        }
+    }
+    // Linear-time Fenwick build from the marker array
+    for (uint32_t i = 1; i <= cap; i++) {
+        uint32_t parent = i + (i & (0u - i));
+        if (parent <= cap) {
+            tree[parent - 1] += tree[i - 1];
+        }
+    }
+    free(st->tree);
+    free(st->owner);
+    st->tree = tree;
+    st->owner = owner;
+    st->cap = cap;
+    st->next = live;
+    return 1;
+}
+
+// Prints the LRU results for E = 1..Emax from a stack distance histogram and set fill counts
+static void stack_report(int s, int b, int Emax, const uint64_t* hist, const uint64_t* fills) {
+    // Sweep E upwards: an access hits once E exceeds its distance, and every miss
+    // evicts except the ones that fill one of a set's first E distinct blocks
+    uint64_t total = 0, hits = 0, filled = 0, full_sets = 0;
+    for (int d = 0; d <= Emax; d++) {
+        total += hist[d];
+        full_sets += fills[d];
+    }
+    for (int E = 1; E <= Emax; E++) {
+        hits += hist[E - 1];
+        full_sets -= fills[E - 1];
+        filled += fills[E - 1] * (uint64_t)(E - 1);
+        uint64_t misses = total - hits;
+        uint64_t evictions = misses - (filled + full_sets * (uint64_t)E);
+        printf("s=%d E=%d b=%d hits:%llu misses:%llu evictions:%llu miss_ratio:%.6f\n", s, E, b,
+               (unsigned long long)hits, (unsigned long long)misses, (unsigned long long)evictions,
+               total ? (double)misses / (double)total : 0.0);
+    }
+}
+
+int runstack(trace_reader* tracefile, int s, int b, int Emax) {
+    return runstack_shard(tracefile, s, b, Emax, 0, 0, NULL);
+}
+
+int runstack_shard(trace_reader* tracefile, int s, int b, int Emax, int shard, int shards, const char* path) {
+    unsigned long S = 1UL << s;
+    if (shards < 0 || (shards > 0 && ((unsigned long)shards > S || shard < 0 || shard >= shards))) {
+        printf("Cannot split %lu sets into %d shards\n", S, shards);
+        return 1;
+    }
+    stack_set* sets = (stack_set*)calloc(S, sizeof(stack_set));
+    uint64_t* hist = (uint64_t*)calloc((size_t)Emax + 1, sizeof(uint64_t));  // hist[d] for d < Emax, hist[Emax] = farther or cold
+    uint64_t* fills = (uint64_t*)calloc((size_t)Emax + 1, sizeof(uint64_t));  // sets by min(distinct blocks, Emax)
+    mem_access* accesses = (mem_access*)malloc(SWEEP_BATCH * sizeof(mem_access));
+    block_map map = {NULL, NULL, 0, 0};
+    int ok = sets && hist && fills && accesses && block_map_grow(&map);
+
+    int count;
+    while (ok && (count = trace_batch(tracefile, accesses, SWEEP_BATCH)) > 0) {
+        int k = 0;
+        uint64_t block = accesses[0].address >> b;
+        while (k < count && ok) {
+            // A sharded run skips the other shards' sets before touching any state
+            uint64_t set_idx = block & (S - 1);
+            if (shards == 0 || set_idx % (uint64_t)shards == (uint64_t)shard) {
+                stack_set* st = &sets[set_idx];
+
+                // Make room for this access's slot
+                if (st->next == st->cap && !stack_set_compact(st, &map)) {
+                    ok = 0;
+                    break;
+                }
+                uint32_t t = st->next++;
+
+                size_t i = block_map_find(&map, block);
+                if (map.keys[i]) {
+                    // Distinct blocks of this set touched since the previous access
+                    uint32_t p = map.slots[i];
+                    uint32_t d = fenwick_prefix(st->tree, t) - fenwick_prefix(st->tree, p + 1);
+                    hist[d < (uint32_t)Emax ? d : (uint32_t)Emax]++;
+                    fenwick_add(st->tree, st->cap, p, -1);
+                }
+                else {
+                    hist[Emax]++;  // Cold access, misses at every size
+                    st->distinct++;
+                    map.keys[i] = block + 1;
+                    map.count++;
+                }
+                map.slots[i] = t;
+                st->owner[t] = block;
+                fenwick_add(st->tree, st->cap, t, 1);
+
+                if (map.count * 2 > map.mask + 1 && !block_map_grow(&map)) {
+                    ok = 0;
+                }
+            }
+
+            // An access crossing block boundaries is one access per block it touches
+            if (block < accesses[k].last >> b) {
+                block++;
+            }
+            else if (++k < count) {
+                block = accesses[k].address >> b;
+            }
+        }
+    }
+
+    if (ok) {
+        // Only this shard's sets count towards the fills, so the shards' fills add up to the whole
+        for (unsigned long k = 0; k < S; k++) {
+            if (shards == 0 || k % (unsigned long)shards == (unsigned long)shard) {
+                fills[sets[k].distinct < (uint32_t)Emax ? sets[k].distinct : (uint32_t)Emax]++;
+            }
+        }
+        stack_report(s, b, Emax, hist, fills);
+        if (path) {
+            ok = write_stack_shard(path, s, b, Emax, shard, shards, hist, fills) == 0;
+        }
+    }
+    else {
+        printf("Error allocating stack distance state\n");
+    }
+
+    for (unsigned long k = 0; sets && k < S; k++) {
+        free(sets[k].tree);
+        free(sets[k].owner);
+    }
+    free(sets);
+    free(hist);
+    free(fills);
+    free(accesses);
+    free(map.keys);
+    free(map.slots);
+    return ok ? 0 : 1;
+}
+
+/*
+Shard result files
+    A sharded run simulates only the sets with set % shards == shard. Sets never interact and
+    every counter is per access, so the counters of the shards of a run add up to those of the
+    whole run, per set and in total, and so do the stack distance histogram and set fill counts
+    of -M. A shard file is text: "CSIMSHARD <version>", "shard <k> <N>", then either
+    "cache <s> <E> <b> <policy> <write_policy>", a "stats" line with the six cache_stats
+    counters and, when per-set counters were on, one "set <i> <hits> <misses> <evictions>" line
+    per set of the shard; or "stack <s> <b> <Emax>" followed by "hist <d> <count>" and
+    "fills <d> <count>" for d = 0..Emax. merge_shards checks that its files describe the same
+    run and cover every shard exactly once before it adds them up.
+*/
+int parse_shard(const char* spec, int* shard, int* shards) {
+    char* end;
+    long k = strtol(spec, &end, 10);
+    if (end == spec || *end != '/') {
+        return 0;
+    }
+    const char* rest = end + 1;
+    long n = strtol(rest, &end, 10);
+    if (end == rest || *end != '\0' || n < 1 || n > INT32_MAX || k < 0 || k >= n) {
+        return 0;
+    }
+    *shard = (int)k;
+    *shards = (int)n;
+    return 1;
+}
+
+int cache_shard(cache* c, int shard, int shards) {
+    if (shards < 1 || shards > c->S || shard < 0 || shard >= shards) {
+        return 0;
+    }
+    c->shard = shard;
+    c->shards = shards > 1 ? shards : 0;
+    return 1;
+}
+
+static FILE* shard_open(const char* path, int shard, int shards) {
+    FILE* out = strcmp(path, "-") == 0 ? stdout : fopen(path, "w");
+    if (!out) {
+        printf("Error opening %s\n", path);
+        return NULL;
+    }
+    fprintf(out, "%s %d\nshard %d %d\n", SHARD_MAGIC, SHARD_VERSION, shard, shards);
+    return out;
+}
+
+static int shard_close(FILE* out, const char* path) {
+    int failed = out == stdout ? fflush(out) != 0 : fclose(out) != 0;
+    if (failed) {
+        printf("Error writing %s\n", path);
+    }
+    return failed;
+}
+
+int write_shard(const cache* c, const cache_stats* stats, const char* path) {
+    int shards = c->shards ? c->shards : 1;
+    FILE* out = shard_open(path, c->shard, shards);
+    if (!out) {
+        return 1;
+    }
+    fprintf(out, "cache %d %d %d %d %d\n", c->s, c->E, c->b, c->policy, c->write_policy);
+    fprintf(out, "stats %llu %llu %llu %llu %llu %llu\n", (unsigned long long)stats->hits,
+            (unsigned long long)stats->misses, (unsigned long long)stats->evictions,
+            (unsigned long long)stats->dirty_evictions, (unsigned long long)stats->bytes_read,
+            (unsigned long long)stats->bytes_written);
+    for (int i = c->set_stats ? c->shard : c->S; i < c->S; i += shards) {
+        const set_counts* set = &c->set_stats[i];
+        fprintf(out, "set %d %llu %llu %llu\n", i, (unsigned long long)set->hits,
+                (unsigned long long)set->misses, (unsigned long long)set->evictions);
+    }
+    return shard_close(out, path);
+}
+
+static int write_stack_shard(const char* path, int s, int b, int Emax, int shard, int shards,
+                             const uint64_t* hist, const uint64_t* fills) {
+    FILE* out = shard_open(path, shard, shards ? shards : 1);
+    if (!out) {
+        return 1;
+    }
+    fprintf(out, "stack %d %d %d\n", s, b, Emax);
+    for (int d = 0; d <= Emax; d++) {
+        fprintf(out, "hist %d %llu\n", d, (unsigned long long)hist[d]);
+    }
+    for (int d = 0; d <= Emax; d++) {
+        fprintf(out, "fills %d %llu\n", d, (unsigned long long)fills[d]);
+    }
+    return shard_close(out, path);
+}
+
+int merge_shards(char** paths, int n, const char* set_stats) {
+    enum { SHARD_NONE, SHARD_CACHE, SHARD_STACK };
+    int kind = SHARD_NONE, shards = 0;
+    int run[5] = {0, 0, 0, 0, 0};  // cache: s, E, b, policy, write_policy; stack: s, b, Emax
+    cache_stats total = {0, 0, 0, 0, 0, 0};
+    set_counts* sets = NULL;  // Merged per-set counters, once a file brings some
+    uint64_t* hist = NULL;
+    uint64_t* fills = NULL;
+    char* seen = NULL;  // Per shard, 1 once a file covered it
+    int with_sets = 0;  // Files that carried per-set counters
+    int ok = n > 0;
+    if (!ok) {
+        printf("--merge needs the shard files to merge\n");
+    }
+
+    for (int f = 0; ok && f < n; f++) {
+        FILE* in = fopen(paths[f], "r");
+        if (!in) {
+            printf("Error opening shard file %s\n", paths[f]);
+            ok = 0;
+            break;
+        }
+        char line[SHARD_LINE_MAX];
+        int lineno = 0, version = 0, shard = -1, count = 0, has_sets = 0;
+        while (ok && fgets(line, sizeof(line), in)) {
+            lineno++;
+            char key[16];
+            int used = 0;
+            if (sscanf(line, "%15s%n", key, &used) != 1) {
+                continue;
+            }
+            const char* rest = line + used;
+            int a[5];
+            unsigned long long v[6];
+            if (lineno == 1) {
+                ok = strcmp(key, SHARD_MAGIC) == 0 && sscanf(rest, "%d", &version) == 1 && version == SHARD_VERSION;
+            }
+            else if (strcmp(key, "shard") == 0) {
+                ok = shard < 0 && sscanf(rest, "%d %d", &shard, &count) == 2 && count >= 1 && shard >= 0
+                     && shard < count && (shards == 0 || count == shards);
+                if (ok && !seen) {
+                    shards = count;
+                    seen = (char*)calloc((size_t)shards, 1);
+                    ok = seen != NULL;
+                }
+                if (ok && seen[shard]) {
+                    printf("%s: shard %d/%d is also in an earlier file\n", paths[f], shard, count);
+                    break;
+                }
+                if (ok) {
+                    seen[shard] = 1;
+                }
+            }
+            else if (strcmp(key, "cache") == 0 || strcmp(key, "stack") == 0) {
+                int k = strcmp(key, "cache") == 0 ? SHARD_CACHE : SHARD_STACK;
+                int fields = k == SHARD_CACHE ? 5 : 3;
+                ok = shard >= 0 && sscanf(rest, "%d %d %d %d %d", &a[0], &a[1], &a[2], &a[3], &a[4]) >= fields
+                     && a[0] >= 0 && a[0] <= 30 && (k == SHARD_CACHE || (a[2] >= 1 && a[2] <= STACK_MAX_E));
+                if (ok && kind == SHARD_NONE) {
+                    kind = k;
+                    memcpy(run, a, (size_t)fields * sizeof(int));
+                    if (kind == SHARD_STACK) {
+                        hist = (uint64_t*)calloc((size_t)run[2] + 1, sizeof(uint64_t));
+                        fills = (uint64_t*)calloc((size_t)run[2] + 1, sizeof(uint64_t));
+                        ok = hist && fills;
+                    }
+                }
+                else if (ok && (k != kind || memcmp(run, a, (size_t)fields * sizeof(int)) != 0)) {
+                    printf("%s: shard of a different run than %s\n", paths[f], paths[0]);
+                    break;
+                }
+            }
+            else if (strcmp(key, "stats") == 0 && kind == SHARD_CACHE) {
+                ok = sscanf(rest, "%llu %llu %llu %llu %llu %llu", &v[0], &v[1], &v[2], &v[3], &v[4], &v[5]) == 6;
+                total.hits += v[0];
+                total.misses += v[1];
+                total.evictions += v[2];
+                total.dirty_evictions += v[3];
+                total.bytes_read += v[4];
+                total.bytes_written += v[5];
+            }
+            else if (strcmp(key, "set") == 0 && kind == SHARD_CACHE) {
+                int S = 1 << run[0];
+                if (!sets) {
+                    sets = (set_counts*)calloc((size_t)S, sizeof(set_counts));
+                    if (!sets) {
+                        printf("Error allocating the merged per-set statistics\n");
+                        ok = 0;
+                        break;
+                    }
+                }
+                ok = sscanf(rest, "%d %llu %llu %llu", &a[0], &v[0], &v[1], &v[2]) == 4 && a[0] >= 0 && a[0] < S
+                     && a[0] % shards == shard;
+                if (ok) {
+                    sets[a[0]].hits += v[0];
+                    sets[a[0]].misses += v[1];
+                    sets[a[0]].evictions += v[2];
+                    has_sets = 1;
+                }
+            }
+            else if ((strcmp(key, "hist") == 0 || strcmp(key, "fills") == 0) && kind == SHARD_STACK) {
+                ok = sscanf(rest, "%d %llu", &a[0], &v[0]) == 2 && a[0] >= 0 && a[0] <= run[2];
+                if (ok) {
+                    (key[0] == 'h' ? hist : fills)[a[0]] += v[0];
+                }
+            }
+            else {
+                ok = 0;
+            }
+            if (!ok) {
+                printf("%s:%d: not a valid shard file line\n", paths[f], lineno);
+            }
+        }
+        // The checks that break out of the loop have reported their error
+        ok = ok && feof(in);
+        fclose(in);
+        if (ok && (shard < 0 || kind == SHARD_NONE)) {
+            printf("%s: not a complete shard file\n", paths[f]);
+            ok = 0;
+        }
+        with_sets += has_sets;
+    }
+
+    // Every shard must be there for the sums to be the whole run
+    for (int k = 0; ok && k < shards; k++) {
+        if (!seen[k]) {
+            printf("Shard %d/%d is missing\n", k, shards);
+            ok = 0;
+        }
+    }
+    if (ok && set_stats && with_sets != n) {
+        printf("Every shard needs per-set statistics (--set-stats) to merge them\n");
+        ok = 0;
+    }
+    if (ok && kind == SHARD_CACHE) {
+        printf("Results:\n");
+        print_summary(&total);
+        print_traffic(&total);
+        if (set_stats) {
+            ok = write_set_counts(sets, 1 << run[0], set_stats) == 0;
+        }
+    }
+    else if (ok) {
+        stack_report(run[0], run[1], run[2], hist, fills);
+    }
+    free(seen);
+    free(sets);
+    free(hist);
+    free(fills);
+    return ok ? 0 : 1;
+}
+
+/*
+Parallel simulation
+    Sets never interact, so -j splits them into contiguous ranges, one per worker thread.
+    The calling thread parses the trace and appends each access to the batch being filled for
+    the worker that owns its set. Full batches are published through a single-producer
+    single-consumer ring per worker (head advanced only by the worker, tail only by the
+    parser). Every worker sees its sets' accesses in trace order, so its counters add up to
+    exactly the serial totals.
+*/
+// Worker side: a batch is queued or the parser is done
+static int par_has_batch(const void* arg) {
+    const par_worker* w = (const par_worker*)arg;
+    return __atomic_load_n(&w->tail, __ATOMIC_ACQUIRE) != __atomic_load_n(&w->head, __ATOMIC_RELAXED)
+           || __atomic_load_n(&w->done, __ATOMIC_ACQUIRE);
+}
+
+// Parser side: the worker's ring has a free slot
+static int par_has_room(const void* arg) {
+    const par_worker* w = (const par_worker*)arg;
+    return w->tail_local - __atomic_load_n(&w->head, __ATOMIC_ACQUIRE) != PAR_QUEUE_DEPTH;
+}
+
+static void* par_worker_main(void* arg) {
+    par_worker* w = (par_worker*)arg;
+    cache* c = w->c;
+    unsigned head = 0;
+    for (;;) {
+        unsigned tail = __atomic_load_n(&w->tail, __ATOMIC_ACQUIRE);
+        if (head == tail) {
+            // Nothing queued: finished if the parser is done, otherwise wait for it
+            if (__atomic_load_n(&w->done, __ATOMIC_ACQUIRE) && head == __atomic_load_n(&w->tail, __ATOMIC_ACQUIRE)) {
+                break;
+            }
+            wait_until(&w->gate, par_has_batch, w);
+            continue;
+        }
+        par_batch* batch = &w->slots[head % PAR_QUEUE_DEPTH];
+        kernels[c->kernel].batch[c->set_stats != NULL](c, batch->accesses, batch->count, &w->stats);
+        head++;
+        __atomic_store_n(&w->head, head, __ATOMIC_RELEASE);
+        wait_wake(&w->gate);
+    }
+    return NULL;
+}
+
+// Publishes the batch being filled for a worker and waits for a free slot for the next one
+static inline par_batch* par_publish(par_worker* w) {
+    w->tail_local++;
+    __atomic_store_n(&w->tail, w->tail_local, __ATOMIC_RELEASE);
+    wait_wake(&w->gate);
+    if (!par_has_room(w)) {
+        wait_until(&w->gate, par_has_room, w);
+    }
+    par_batch* next = &w->slots[w->tail_local % PAR_QUEUE_DEPTH];
+    next->count = 0;
+    return next;
+}
+
+int runsim_parallel(cache* c, trace_reader* tracefile, int nthreads, cache_stats* stats) {
+    // Every worker needs at least one set
+    if (nthreads > c->S) {
+        nthreads = c->S;
+    }
+    par_worker* workers = (par_worker*)calloc((size_t)nthreads, sizeof(par_worker));
+    par_batch** filling = (par_batch**)malloc((size_t)nthreads * sizeof(par_batch*));
+    if (!workers || !filling) {
+        printf("Error allocating worker state\n");
+        free(workers);
+        free(filling);
+        return 1;
+    }
+
+    int started = 0, ok = 1;
+    for (int i = 0; i < nthreads; i++) {
+        workers[i].c = c;
+        workers[i].slots = (par_batch*)malloc(PAR_QUEUE_DEPTH * sizeof(par_batch));
+        if (!workers[i].slots || !wait_gate_init(&workers[i].gate)) {
+            free(workers[i].slots);
+            ok = 0;
+            break;
+        }
+        if (pthread_create(&workers[i].thread, NULL, par_worker_main, &workers[i]) != 0) {
+            wait_gate_destroy(&workers[i].gate);
+            free(workers[i].slots);
+            ok = 0;
+            break;
+        }
+        filling[i] = &workers[i].slots[0];
+        filling[i]->count = 0;
+        started++;
+    }
+
+    if (ok) {
+        // Route every access to the worker owning sets [i*S/N, (i+1)*S/N)
+        char operation;
+        unsigned long address;
+        int size;
+        while (trace_next(tracefile, &operation, &address, &size) > 0) {
+            if (operation != 'L' && operation != 'S' && operation != 'M') {
+                continue;
+            }
+            // Blocks of an access that crosses a boundary can belong to different workers,
+            // so split here and hand the workers single-block accesses
+            unsigned long last = access_last(address, size);
+            unsigned long end = last >> c->b;
+            // A load is one read pass, a store one write pass, and a modify a read then a write
+            for (int write = operation == 'S'; write <= (operation != 'L'); write++) {
+                unsigned long block = address >> c->b;
+                do {
+                    unsigned long set_idx = block & ((1UL << c->s) - 1);
+                    if (!set_in_shard(c, set_idx)) {
+                        continue;  // Another shard's set, the do-while condition still advances
+                    }
+                    int owner = (int)((set_idx * (unsigned long)nthreads) >> c->s);
+                    par_batch* batch = filling[owner];
+                    mem_access* a = &batch->accesses[batch->count++];
+                    a->address = block == address >> c->b ? address : block << c->b;
+                    a->last = block == end ? last : ((block + 1) << c->b) - 1;
+                    a->write = write;
+                    if (batch->count == PAR_BATCH) {
+                        filling[owner] = par_publish(&workers[owner]);
+                    }
+                } while (block++ != end);
+            }
+        }
+    }
+
+    // Flush partial batches, then tell every worker no more are coming
+    for (int i = 0; i < started; i++) {
+        if (ok && filling[i]->count > 0) {
+            par_publish(&workers[i]);
+        }
+        __atomic_store_n(&workers[i].done, 1, __ATOMIC_RELEASE);
+        wait_wake(&workers[i].gate);
+    }
+
+    // Join and reduce the private counters
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i].thread, NULL);
+        const cache_stats* w = &workers[i].stats;
+        stats->hits += w->hits;
+        stats->misses += w->misses;
+        stats->evictions += w->evictions;
+        stats->dirty_evictions += w->dirty_evictions;
+        stats->bytes_read += w->bytes_read;
+        stats->bytes_written += w->bytes_written;
+        wait_gate_destroy(&workers[i].gate);
+        free(workers[i].slots);
+    }
+    if (!ok) {
+        printf("Error starting worker threads\n");
+    }
+    free(workers);
+    free(filling);
+    return ok ? 0 : 1;
+}
+
+/*
+Multicore coherence
+    Each core has a private L1 in front of one shared LLC, kept coherent with MESI: a dirty line
+    is Modified, a clean line is Exclusive or Shared depending on how many L1s the directory
+    lists for it. Time advances in quanta. Within a quantum every core runs on its own L1, in
+    parallel across host threads, and queues what needs the shared level: misses, victims and
+    stores to shared lines. After the quantum the queues are merged in interleave order and
+    applied to the directory, the other L1s and the LLC. A core therefore sees another core's
+    invalidations from the next quantum on, the usual bound of quantum-based parallel simulation.
+    The results depend on the quantum but not on the number of host threads
+*/
+
+static int mc_dir_init(mc_dir* d, size_t entries) {
+    d->keys = (uint64_t*)calloc(entries, sizeof(uint64_t));
+    d->sharers = (uint64_t*)calloc(entries, sizeof(uint64_t));
+    d->invalidated = (uint64_t*)calloc(entries, sizeof(uint64_t));
+    d->mask = entries - 1;
+    d->count = 0;
+    return d->keys && d->sharers && d->invalidated;
+}
+
+static void mc_dir_free(mc_dir* d) {
+    free(d->keys);
+    free(d->sharers);
+    free(d->invalidated);
+}
+
+static inline size_t mc_dir_slot(const mc_dir* d, uint64_t block) {
+    size_t i = block_hash(block) & d->mask;
+    while (d->keys[i] != 0 && d->keys[i] != block + 1) {
+        i = (i + 1) & d->mask;
+    }
+    return i;
+}
+
+// Sharers of a block, for the private phase, which only reads the directory
+static inline uint64_t mc_dir_sharers(const mc_dir* d, uint64_t block) {
+    size_t i = mc_dir_slot(d, block);
+    return d->keys[i] ? d->sharers[i] : 0;
+}
+
+// Entry of a block, inserted if new and growing the map at half load; (size_t)-1 when out of memory
+static size_t mc_dir_entry(mc_dir* d, uint64_t block) {
+    if (2 * (d->count + 1) > d->mask + 1) {
+        mc_dir old = *d;
+        if (!mc_dir_init(d, 2 * (old.mask + 1))) {
+            mc_dir_free(d);
+            *d = old;
+            return (size_t)-1;
+        }
+        for (size_t i = 0; i <= old.mask; i++) {
+            if (old.keys[i]) {
+                size_t j = mc_dir_slot(d, old.keys[i] - 1);
+                d->keys[j] = old.keys[i];
+                d->sharers[j] = old.sharers[i];
+                d->invalidated[j] = old.invalidated[i];
+                d->count++;
+            }
+        }
+        mc_dir_free(&old);
+    }
+    size_t i = mc_dir_slot(d, block);
+    if (!d->keys[i]) {
+        d->keys[i] = block + 1;
+        d->count++;
+    }
+    return i;
+}
+
+static void mc_push(mc_core* core, uint64_t time, unsigned long address, int kind, int flag) {
+    if (core->nevents == core->cap) {
+        size_t cap = core->cap ? 2 * core->cap : 1024;
+        mc_event* grown = (mc_event*)realloc(core->events, cap * sizeof(mc_event));
+        if (!grown) {
+            core->failed = 1;
+            return;
+        }
+        core->events = grown;
+        core->cap = cap;
+    }
+    mc_event* e = &core->events[core->nevents++];
+    e->time = time;
+    e->address = address;
+    e->kind = kind;
+    e->flag = flag;
+}
+
+// One block access of core id on its own L1, queueing whatever needs the shared level
+static void mc_private_access(multicore* m, int id, uint64_t time, unsigned long address, int write) {
+    mc_core* core = &m->cores[id];
+    cache* c = core->l1;
+    int state = write ? cache_line_state(c, address) : LINE_ABSENT;
+    uint64_t dirty_before = core->stats.dirty_evictions;
+    unsigned long evicted;
+    int result = cache_lookup(c, address, write, &evicted, &core->stats);
+    if (result == CACHE_HIT) {
+        core->stats.hits++;
+        // A store to a clean line is silent if it was Exclusive, a Shared one invalidates the others
+        if (state == LINE_CLEAN && (mc_dir_sharers(&m->dir, address >> c->b) & ~(1ULL << id))) {
+            mc_push(core, time, address, MC_UPGRADE, 0);
+        }
+        return;
+    }
+    core->stats.misses++;
+    if (result == CACHE_EVICT) {
+        core->stats.evictions++;
+        mc_push(core, time, evicted, MC_EVICT, core->stats.dirty_evictions != dirty_before);
+    }
+    mc_push(core, time, address, MC_MISS, write);
+}
+
+// Runs core id on its L1 up to the end of the quantum
+static void mc_private(multicore* m, int id) {
+    mc_core* core = &m->cores[id];
+    const int b = core->l1->b;
+    for (;;) {
+        if (!core->pending) {
+            if (core->eof || trace_next(core->trace, &core->op, &core->address, &core->size) <= 0) {
+                core->eof = 1;
+                return;
+            }
+            core->pending = 1;
+        }
+        int data = core->op == 'L' || core->op == 'S' || core->op == 'M';
+        if (!data && m->interleave == INTERLEAVE_ROUND_ROBIN) {
+            core->pending = 0;  // Instruction fetches take no turn
+            continue;
+        }
+        if (core->clock >= m->end) {
+            return;
+        }
+        uint64_t time = core->clock++;
+        core->pending = 0;
+        if (!data) {
+            continue;
+        }
+
+        // A modify is a load pass then a store pass, each touching every block of the access
+        unsigned long last = access_last(core->address, core->size);
+        int first = core->op == 'S', passes = core->op == 'L' ? 1 : 2;
+        for (int pass = first; pass < passes; pass++) {
+            unsigned long block = core->address >> b, end = last >> b;
+            do {
+                mc_private_access(m, id, time, block << b, pass == 1);
+            } while (block++ != end);
+        }
+    }
+}
+
+static void* mc_worker_main(void* arg) {
+    mc_worker* w = (mc_worker*)arg;
+    multicore* m = w->m;
+    pthread_mutex_lock(&m->gate);
+    pthread_mutex_unlock(&m->gate);
+    if (m->stop) {
+        return NULL;
+    }
+    for (;;) {
+        pthread_barrier_wait(&m->start);
+        if (m->stop) {
+            return NULL;
+        }
+        for (int i = w->first; i < m->count; i += w->stride) {
+            mc_private(m, i);
+        }
+        pthread_barrier_wait(&m->done);
+    }
+}
+
+// A dirty L1 line goes back into the LLC
+static void mc_writeback(multicore* m, unsigned long address) {
+    unsigned long evicted;
+    cache_stats fill = {0, 0, 0, 0, 0, 0};  // The line comes from above, not from memory
+    m->llc_writebacks++;
+    int result = cache_lookup(m->llc, address, 1, &evicted, &fill);
+    m->llc_stats.dirty_evictions += fill.dirty_evictions;
+    m->llc_stats.bytes_written += fill.bytes_written;
+    m->llc_stats.evictions += result == CACHE_EVICT;
+}
+
+// A demand fetch of an L1 miss from the LLC
+static void mc_fetch(multicore* m, unsigned long address) {
+    unsigned long evicted;
+    int result = cache_lookup(m->llc, address, 0, &evicted, &m->llc_stats);
+    if (result == CACHE_HIT) {
+        m->llc_stats.hits++;
+        return;
+    }
+    m->llc_stats.misses++;
+    m->llc_stats.evictions += result == CACHE_EVICT;
+}
+
+// Makes the other L1s give up a block (store) or write back a Modified copy (load)
+static void mc_snoop(multicore* m, int id, size_t k, unsigned long address, int write) {
+    for (uint64_t others = m->dir.sharers[k] & ~(1ULL << id); others; others &= others - 1) {
+        int j = __builtin_ctzll(others);
+        mc_core* other = &m->cores[j];
+        if (write) {
+            int dirty = cache_line_state(other->l1, address) == LINE_DIRTY;
+            if (cache_invalidate(other->l1, address)) {
+                m->invalidations++;
+                other->invalidations++;
+                m->dir.invalidated[k] |= 1ULL << j;
+            }
+            m->dir.sharers[k] &= ~(1ULL << j);
+            if (dirty) {
+                m->interventions++;
+                mc_writeback(m, address);
+            }
+        }
+        else if (cache_clean(other->l1, address)) {
+            m->interventions++;  // Modified -> Shared
+            mc_writeback(m, address);
+        }
+    }
+}
+
+static int mc_apply(multicore* m, int id, const mc_event* e) {
+    mc_core* core = &m->cores[id];
+    const uint64_t me = 1ULL << id;
+    size_t k = mc_dir_entry(&m->dir, e->address >> core->l1->b);
+    if (k == (size_t)-1) {
+        return 0;
+    }
+    if (e->kind == MC_EVICT) {
+        m->dir.sharers[k] &= ~me;
+        if (e->flag) {
+            mc_writeback(m, e->address);
+        }
+        return 1;
+    }
+    if (e->kind == MC_UPGRADE && (m->dir.sharers[k] & me)) {
+        core->upgrades++;
+        mc_snoop(m, id, k, e->address, 1);
+        m->dir.sharers[k] = me;
+        return 1;
+    }
+
+    // A miss, or an upgrade whose line a store earlier in the quantum already took away
+    int write = e->kind == MC_UPGRADE || e->flag;
+    if (m->dir.invalidated[k] & me) {
+        core->coherence_misses++;
+        m->dir.invalidated[k] &= ~me;
+    }
+    mc_snoop(m, id, k, e->address, write);
+    mc_fetch(m, e->address);
+    m->dir.sharers[k] = write ? me : m->dir.sharers[k] | me;
+    if (e->kind == MC_UPGRADE) {
+        // The store hit a line that was gone by the time it reached the shared level: refetch it
+        core->stats.hits--;
+        core->stats.misses++;
+        unsigned long evicted;
+        uint64_t dirty_before = core->stats.dirty_evictions;
+        if (cache_lookup(core->l1, e->address, 1, &evicted, &core->stats) == CACHE_EVICT) {
+            core->stats.evictions++;
+            mc_event victim = {e->time, evicted, MC_EVICT, core->stats.dirty_evictions != dirty_before};
+            return mc_apply(m, id, &victim);
+        }
+    }
+    return 1;
+}
+
+// Applies every queued request of the quantum in interleave order, ties broken by core
+static int mc_shared(multicore* m) {
+    size_t heads[MC_MAX_CORES] = {0};
+    for (;;) {
+        int best = -1;
+        for (int i = 0; i < m->count; i++) {
+            const mc_core* core = &m->cores[i];
+            if (heads[i] < core->nevents
+                    && (best < 0 || core->events[heads[i]].time < m->cores[best].events[heads[best]].time)) {
+                best = i;
+            }
+        }
+        if (best < 0) {
+            break;
+        }
+        if (!mc_apply(m, best, &m->cores[best].events[heads[best]++])) {
+            return 0;
+        }
+    }
+    for (int i = 0; i < m->count; i++) {
+        m->cores[i].nevents = 0;
+    }
+    return 1;
+}
+
+multicore* makemulticore(char** paths, int n, int s, int E, int b, int llc_s, int llc_E, int policy, int interleave) {
+    if (n < 1 || n > MC_MAX_CORES) {
+        printf("A multicore run takes 1 to %d traces\n", MC_MAX_CORES);
+        return NULL;
+    }
+    multicore* m = (multicore*)calloc(1, sizeof(multicore));
+    if (!m) {
+        return NULL;
+    }
+    m->interleave = interleave;
+    m->llc = makecache(llc_s, llc_E, b, policy, WRITE_DEFAULT);
+    if (!m->llc || !mc_dir_init(&m->dir, MC_DIR_INIT)) {
+        printf("Error creating the shared cache\n");
+        freemulticore(m);
+        return NULL;
+    }
+    for (int i = 0; i < n; i++) {
+        mc_core* core = &m->cores[i];
+        core->path = paths[i];
+        core->l1 = makecache(s, E, b, policy, WRITE_DEFAULT);
+        core->trace = core->l1 ? trace_open(paths[i]) : NULL;
+        m->count = i + 1;
+        if (!core->trace) {
+            printf(core->l1 ? "Error opening trace file %s\n" : "Error creating the L1 for %s\n", paths[i]);
+            freemulticore(m);
+            return NULL;
+        }
+    }
+    return m;
+}
+
+void freemulticore(multicore* m) {
+    if (!m) {
+        return;
+    }
+    for (int i = 0; i < m->count; i++) {
+        if (m->cores[i].trace) {
+            trace_close(m->cores[i].trace);
+        }
+        freecache(m->cores[i].l1);
+        free(m->cores[i].events);
+    }
+    freecache(m->llc);
+    mc_dir_free(&m->dir);
+    free(m);
+}
+
+int runmulticore(multicore* m, int quantum, int threads) {
+    uint64_t step = quantum > 0 ? (uint64_t)quantum : MC_QUANTUM;
+    threads = threads < 1 ? 1 : threads > m->count ? m->count : threads;
+
+    // The calling thread simulates the first share of the cores itself. The workers wait at the
+    // gate until it is known how many of them started, which is what the barriers count
+    mc_worker workers[MC_MAX_CORES];
+    int started = 1;
+    if (threads > 1 && pthread_mutex_init(&m->gate, NULL) == 0) {
+        pthread_mutex_lock(&m->gate);
+        for (; started < threads; started++) {
+            workers[started].m = m;
+            workers[started].first = started;
+            if (pthread_create(&workers[started].thread, NULL, mc_worker_main, &workers[started]) != 0) {
+                break;
+            }
+        }
+        if (started == 1 || pthread_barrier_init(&m->start, NULL, (unsigned)started) != 0) {
+            m->stop = 1;
+        }
+        else if (pthread_barrier_init(&m->done, NULL, (unsigned)started) != 0) {
+            pthread_barrier_destroy(&m->start);
+            m->stop = 1;
+        }
+        for (int t = 1; t < started; t++) {
+            workers[t].stride = started;
+        }
+        pthread_mutex_unlock(&m->gate);
+        if (m->stop) {
+            // Too few threads to share the work: simulate every core here
+            for (int t = 1; t < started; t++) {
+                pthread_join(workers[t].thread, NULL);
+            }
+            pthread_mutex_destroy(&m->gate);
+            m->stop = 0;
+            started = 1;
+        }
+        else {
+            threads = started;
+        }
+    }
+    if (started == 1) {
+        threads = 1;
+    }
+
+    int ok = 1;
+    for (;;) {
+        m->end += step;
+        if (threads > 1) {
+            pthread_barrier_wait(&m->start);
+        }
+        for (int i = 0; i < m->count; i += threads) {
+            mc_private(m, i);
+        }
+        if (threads > 1) {
+            pthread_barrier_wait(&m->done);
+        }
+
+        // Workers are parked on the start barrier until the shared phase is done
+        int finished = 1;
+        for (int i = 0; i < m->count; i++) {
+            ok &= !m->cores[i].failed;
+            finished &= m->cores[i].eof;
+        }
+        ok = ok && mc_shared(m);
+        if (finished || !ok) {
+            break;
+        }
+    }
+    if (threads > 1) {
+        m->stop = 1;
+        pthread_barrier_wait(&m->start);
+        for (int t = 1; t < threads; t++) {
+            pthread_join(workers[t].thread, NULL);
+        }
+        pthread_barrier_destroy(&m->start);
+        pthread_barrier_destroy(&m->done);
+        pthread_mutex_destroy(&m->gate);
+    }
+    if (!ok) {
+        printf("Error allocating coherence state\n");
+    }
+    return ok ? 0 : 1;
+}
+
+const cache_stats* multicore_stats(const multicore* m, int core) {
+    return core >= 0 && core < m->count ? &m->cores[core].stats : NULL;
+}
+
+void print_multicore(const multicore* m) {
+    for (int i = 0; i < m->count; i++) {
+        const mc_core* core = &m->cores[i];
+        printf("core%d %s\n", i, core->path);
+        printf("core%d ", i);
+        print_summary(&core->stats);
+        printf("core%d ", i);
+        print_traffic(&core->stats);
+        printf("core%d coherence_misses:%llu upgrades:%llu invalidations:%llu\n", i,
+               (unsigned long long)core->coherence_misses, (unsigned long long)core->upgrades,
+               (unsigned long long)core->invalidations);
+    }
+    printf("LLC ");
+    print_summary(&m->llc_stats);
+    printf("LLC ");
+    print_traffic(&m->llc_stats);
+    printf("LLC writebacks:%llu\n", (unsigned long long)m->llc_writebacks);
+    printf("coherence invalidations:%llu interventions:%llu\n", (unsigned long long)m->invalidations,
+           (unsigned long long)m->interventions);
+}
+
+/*
+Batch runs
+    A manifest lists jobs, one per line: a trace path followed by s=, E= and b= settings and
+    optionally policy=, write= and alloc= like a -H level. Jobs on the same trace share one
+    decode of it. runbatch gives every worker thread a deque of job indices: a worker with an
+    empty deque first steals the oldest job of another worker, and only when there is nothing
+    to steal takes the next undecoded trace, decodes it and pushes all of its jobs, which the
+    other workers then steal from it. A decoded trace is freed by whichever job of it finishes
+    last, so at most about one trace per worker is held in memory at a time. Each worker keeps
+    the caches of its recent configurations, up to BATCH_POOL_BYTES of arena, and resets one
+    for the next job that has the same configuration instead of allocating it again.
+*/
+static int batch_config_of(batch_run* r, const batch_config* cfg) {
+    uint64_t key = (uint64_t)cfg->E << 32 | (uint64_t)cfg->s << 24 | (uint64_t)cfg->b << 16
+                 | (uint64_t)cfg->policy << 8 | (uint64_t)cfg->write_policy;
+    if ((r->config_index.count + 1) * 2 > r->config_index.mask + 1 && !block_map_grow(&r->config_index)) {
+        return -1;
+    }
+    size_t i = block_map_find(&r->config_index, key);
+    if (r->config_index.keys[i]) {
+        return (int)r->config_index.slots[i];
+    }
+    if (r->nconfigs == r->configs_cap) {
+        int cap = r->configs_cap ? 2 * r->configs_cap : 16;
+        batch_config* grown = (batch_config*)realloc(r->configs, (size_t)cap * sizeof(batch_config));
+        if (!grown) {
+            return -1;
+        }
+        r->configs = grown;
+        r->configs_cap = cap;
+    }
+    r->configs[r->nconfigs] = *cfg;
+    r->config_index.keys[i] = key + 1;
+    r->config_index.slots[i] = (uint32_t)r->nconfigs;
+    r->config_index.count++;
+    return r->nconfigs++;
+}
+
+static int batch_trace_of(batch_run* r, const char* path) {
+    // Manifests usually list a trace's jobs together, so the last trace is checked first
+    if (r->ntraces > 0 && strcmp(r->traces[r->ntraces - 1].path, path) == 0) {
+        return r->ntraces - 1;
+    }
+    for (int i = 0; i < r->ntraces; i++) {
+        if (strcmp(r->traces[i].path, path) == 0) {
+            return i;
+        }
+    }
+    if (r->ntraces == r->traces_cap) {
+        int cap = r->traces_cap ? 2 * r->traces_cap : 16;
+        batch_trace* grown = (batch_trace*)realloc(r->traces, (size_t)cap * sizeof(batch_trace));
+        if (!grown) {
+            return -1;
+        }
+        r->traces = grown;
+        r->traces_cap = cap;
+    }
+    batch_trace* t = &r->traces[r->ntraces];
+    memset(t, 0, sizeof(*t));
+    t->path = strdup(path);
+    if (!t->path) {
+        return -1;
+    }
+    return r->ntraces++;
+}
+
+static int batch_add_job(batch_run* r, int trace, int config) {
+    if (r->njobs == r->jobs_cap) {
+        int cap = r->jobs_cap ? 2 * r->jobs_cap : 64;
+        batch_job* grown = (batch_job*)realloc(r->jobs, (size_t)cap * sizeof(batch_job));
+        if (!grown) {
+            return 0;
+        }
+        r->jobs = grown;
+        r->jobs_cap = cap;
+    }
+    batch_trace* t = &r->traces[trace];
+    if (t->count == t->cap) {
+        int cap = t->cap ? 2 * t->cap : 16;
+        int* grown = (int*)realloc(t->jobs, (size_t)cap * sizeof(int));
+        if (!grown) {
+            return 0;
+        }
+        t->jobs = grown;
+        t->cap = cap;
+    }
+    batch_job* job = &r->jobs[r->njobs];
+    memset(job, 0, sizeof(*job));
+    job->trace = trace;
+    job->config = config;
+    t->jobs[t->count++] = r->njobs++;
+    return 1;
+}
+
+void freebatch(batch_run* r) {
+    if (!r) {
+        return;
+    }
+    for (int i = 0; i < r->ntraces; i++) {
+        free(r->traces[i].path);
+        free(r->traces[i].jobs);
+        free(r->traces[i].accesses);
+    }
+    free(r->traces);
+    free(r->jobs);
+    free(r->configs);
+    free(r->config_index.keys);
+    free(r->config_index.slots);
+    free(r);
+}
+
+batch_run* load_batch(const char* path, int policy, int write_policy) {
+    FILE* f = fopen(path, "r");
+    if (!f) {
+        printf("Error opening batch manifest %s\n", path);
+        return NULL;
+    }
+    batch_run* r = (batch_run*)calloc(1, sizeof(batch_run));
+    if (!r) {
+        fclose(f);
+        return NULL;
+    }
+
+    char line[BATCH_LINE_MAX];
+    int lineno = 0, ok = 1;
+    while (ok && fgets(line, sizeof(line), f)) {
+        lineno++;
+        char* tokens[16];
+        int n = split_tokens(line, tokens, 16);
+        if (n == 0) {
+            continue;
+        }
+
+        // Trace path, then key=value settings
+        batch_config cfg = {-1, 0, -1, policy, write_policy};
+        for (int k = 1; k < n && ok; k++) {
+            char* eq = strchr(tokens[k], '=');
+            if (!eq) {
+                printf("%s:%d: expected key=value, got %s\n", path, lineno, tokens[k]);
+                ok = 0;
+                break;
+            }
+            *eq = '\0';
+            const char* key = tokens[k];
+            const char* val = eq + 1;
+            if (strcmp(key, "s") == 0) cfg.s = atoi(val);
+            else if (strcmp(key, "E") == 0) cfg.E = atoi(val);
+            else if (strcmp(key, "b") == 0) cfg.b = atoi(val);
+            else if (strcmp(key, "policy") == 0) {
+                cfg.policy = parse_policy(val);
+                ok = cfg.policy >= 0;
+            }
+            else if (strcmp(key, "write") == 0) {
+                ok = parse_write_option(val, WRITE_BACK, "wb", "wt", &cfg.write_policy);
+            }
+            else if (strcmp(key, "alloc") == 0) {
+                ok = parse_write_option(val, WRITE_ALLOCATE, "wa", "nwa", &cfg.write_policy);
+            }
+            else {
+                ok = 0;
+            }
+            if (!ok) {
+                printf("%s:%d: bad setting %s=%s\n", path, lineno, key, val);
+            }
+        }
+        if (!ok) {
+            break;
+        }
+        if (cfg.s < 0 || cfg.s > 30 || cfg.E <= 0 || cfg.E > SWEEP_MAX_VALUE || cfg.b < 0 || cfg.b > 30) {
+            printf("%s:%d: job %s needs s and b from 0 to 30 and E from 1 to %d\n", path, lineno, tokens[0],
+                   SWEEP_MAX_VALUE);
+            ok = 0;
+            break;
+        }
+        if (cfg.policy == POLICY_PLRU && (cfg.E & (cfg.E - 1)) != 0) {
+            printf("%s:%d: PLRU needs a power-of-two number of lines per set\n", path, lineno);
+            ok = 0;
+            break;
+        }
+        int trace = batch_trace_of(r, tokens[0]);
+        int config = trace < 0 ? -1 : batch_config_of(r, &cfg);
+        if (config < 0 || !batch_add_job(r, trace, config)) {
+            printf("Error allocating the batch jobs\n");
+            ok = 0;
+        }
+    }
+    fclose(f);
+    if (ok && r->njobs == 0) {
+        printf("%s: no jobs\n", path);
+        ok = 0;
+    }
+    if (!ok) {
+        freebatch(r);
+        return NULL;
+    }
+    return r;
+}
+
+// Decodes a trace into its run-long access array, 0 if it could not be opened or decoded
+static int batch_decode(batch_trace* t) {
+    trace_reader* tracefile = trace_open(t->path);
+    if (!tracefile) {
+        printf("Error opening trace %s\n", t->path);
+        return 0;
+    }
+    size_t cap = 0;
+    int ok = 1;
+    for (;;) {
+        if (t->n + SWEEP_BATCH > cap) {
+            cap = cap ? 2 * cap : (size_t)BATCH_CHUNK;
+            mem_access* grown = (mem_access*)realloc(t->accesses, cap * sizeof(mem_access));
+            if (!grown) {
+                printf("Error allocating the decoded %s\n", t->path);
+                ok = 0;
+                break;
+            }
+            t->accesses = grown;
+        }
+        int count = trace_batch(tracefile, t->accesses + t->n, SWEEP_BATCH);
+        if (count <= 0) {
+            break;
+        }
+        t->n += (size_t)count;
+    }
+    trace_close(tracefile);
+    if (!ok) {
+        free(t->accesses);
+        t->accesses = NULL;
+    }
+    return ok;
+}
+
+// Takes the job the worker pushed last, -1 when its deque is empty
+static int batch_pop(batch_worker* w) {
+    pthread_mutex_lock(&w->lock);
+    int job = w->bottom > w->top ? w->deque[--w->bottom] : -1;
+    pthread_mutex_unlock(&w->lock);
+    return job;
+}
+
+// Takes the oldest job of the first other worker that has one, -1 when none has
+static int batch_steal(batch_worker* w) {
+    batch_run* r = w->run;
+    for (int k = 1; k < r->nworkers; k++) {
+        batch_worker* victim = &r->workers[(w->id + k) % r->nworkers];
+        pthread_mutex_lock(&victim->lock);
+        int job = victim->bottom > victim->top ? victim->deque[victim->top++] : -1;
+        pthread_mutex_unlock(&victim->lock);
+        if (job >= 0) {
+            return job;
+        }
+    }
+    return -1;
+}
+
+// Pushes the jobs of a freshly decoded trace, the ones whose caches this worker kept on top
+static void batch_push(batch_worker* w, const batch_trace* t) {
+    pthread_mutex_lock(&w->lock);
+    w->top = w->bottom = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 0; i < t->count; i++) {
+            int kept = w->caches[w->run->jobs[t->jobs[i]].config] != NULL;
+            if (kept == pass) {
+                w->deque[w->bottom++] = t->jobs[i];
+            }
+        }
+    }
+    pthread_mutex_unlock(&w->lock);
+}
+
+// A cold cache for a configuration, reset from the worker's kept caches when it has one
+static cache* batch_cache(batch_worker* w, int config) {
+    w->clock++;
+    if (w->caches[config]) {
+        cache_reset(w->caches[config]);
+        w->used[config] = w->clock;
+        return w->caches[config];
+    }
+    const batch_config* cfg = &w->run->configs[config];
+    cache* c = makecache(cfg->s, cfg->E, cfg->b, cfg->policy, cfg->write_policy);
+    if (!c) {
+        return NULL;
+    }
+    // Drop the least recently used caches until the new one fits the pool
+    while (w->bytes > 0 && w->bytes + c->size > BATCH_POOL_BYTES) {
+        int lru = -1;
+        for (int i = 0; i < w->run->nconfigs; i++) {
+            if (w->caches[i] && (lru < 0 || w->used[i] < w->used[lru])) {
+                lru = i;
+            }
+        }
+        w->bytes -= w->caches[lru]->size;
+        freecache(w->caches[lru]);
+        w->caches[lru] = NULL;
+    }
+    w->caches[config] = c;
+    w->used[config] = w->clock;
+    w->bytes += c->size;
+    return c;
+}
+
+static void batch_run_job(batch_worker* w, int j) {
+    batch_job* job = &w->run->jobs[j];
+    batch_trace* t = &w->run->traces[job->trace];
+    cache* c = batch_cache(w, job->config);
+    if (!c) {
+        job->status = 1;
+    }
+    for (size_t off = 0; c && off < t->n; off += BATCH_CHUNK) {
+        int n = t->n - off < BATCH_CHUNK ? (int)(t->n - off) : BATCH_CHUNK;
+        kernels[c->kernel].batch[0](c, t->accesses + off, n, &job->stats);
+    }
+    if (__atomic_sub_fetch(&t->remaining, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(t->accesses);
+        t->accesses = NULL;
+    }
+}
+
+static void* batch_worker_main(void* arg) {
+    batch_worker* w = (batch_worker*)arg;
+    batch_run* r = w->run;
+    for (;;) {
+        int job = batch_pop(w);
+        if (job < 0) {
+            job = batch_steal(w);
+        }
+        if (job >= 0) {
+            batch_run_job(w, job);
+            continue;
+        }
+
+        // Nothing queued anywhere: decode the next trace, or wait for the ones being decoded
+        pthread_mutex_lock(&r->lock);
+        if (r->next_trace < r->ntraces) {
+            batch_trace* t = &r->traces[r->next_trace++];
+            r->decoding++;
+            pthread_mutex_unlock(&r->lock);
+            if (batch_decode(t)) {
+                t->remaining = t->count;
+                batch_push(w, t);
+            }
+            else {
+                for (int i = 0; i < t->count; i++) {
+                    r->jobs[t->jobs[i]].status = 1;
+                }
+            }
+            pthread_mutex_lock(&r->lock);
+            r->decoding--;
+            pthread_cond_broadcast(&r->wake);
+            pthread_mutex_unlock(&r->lock);
+            continue;
+        }
+        if (r->decoding > 0) {
+            pthread_cond_wait(&r->wake, &r->lock);
+            pthread_mutex_unlock(&r->lock);
+            continue;
+        }
+        pthread_mutex_unlock(&r->lock);
+
+        // Every trace is pushed, so once one more look finds nothing left to steal the run is done
+        job = batch_steal(w);
+        if (job < 0) {
+            break;
+        }
+        batch_run_job(w, job);
+    }
+    for (int i = 0; i < r->nconfigs; i++) {
+        freecache(w->caches[i]);
+        w->caches[i] = NULL;
+    }
+    w->bytes = 0;
+    return NULL;
+}
+
+int runbatch(batch_run* r, int threads) {
+    if (threads < 1 || threads > PAR_MAX_THREADS) {
+        printf("A batch run takes 1 to %d threads\n", PAR_MAX_THREADS);
+        return 1;
+    }
+    int most = 0;  // Largest number of jobs one trace pushes
+    for (int i = 0; i < r->ntraces; i++) {
+        most = r->traces[i].count > most ? r->traces[i].count : most;
+    }
+    r->nworkers = threads < r->njobs ? threads : r->njobs;
+    r->workers = (batch_worker*)calloc((size_t)r->nworkers, sizeof(batch_worker));
+    if (!r->workers) {
+        printf("Error allocating the batch workers\n");
+        return 1;
+    }
+    int ok = 1;
+    for (int i = 0; i < r->nworkers; i++) {
+        batch_worker* w = &r->workers[i];
+        w->run = r;
+        w->id = i;
+        w->deque = (int*)malloc((size_t)most * sizeof(int));
+        w->caches = (cache**)calloc((size_t)r->nconfigs, sizeof(cache*));
+        w->used = (uint64_t*)calloc((size_t)r->nconfigs, sizeof(uint64_t));
+        ok &= w->deque && w->caches && w->used;
+        pthread_mutex_init(&w->lock, NULL);
+    }
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->wake, NULL);
+    r->next_trace = 0;
+    r->decoding = 0;
+
+    // The calling thread is worker 0; a worker that fails to start just leaves its share to the others
+    int* started = (int*)calloc((size_t)r->nworkers, sizeof(int));
+    ok &= started != NULL;
+    if (!ok) {
+        printf("Error allocating the batch workers\n");
+    }
+    for (int i = 1; ok && i < r->nworkers; i++) {
+        started[i] = pthread_create(&r->workers[i].thread, NULL, batch_worker_main, &r->workers[i]) == 0;
+    }
+    if (ok) {
+        batch_worker_main(&r->workers[0]);
+    }
+    for (int i = 1; ok && i < r->nworkers; i++) {
+        if (started[i]) {
+            pthread_join(r->workers[i].thread, NULL);
+        }
+    }
+    free(started);
+
+    for (int i = 0; i < r->nworkers; i++) {
+        pthread_mutex_destroy(&r->workers[i].lock);
+        free(r->workers[i].deque);
+        free(r->workers[i].caches);
+        free(r->workers[i].used);
+    }
+    pthread_mutex_destroy(&r->lock);
+    pthread_cond_destroy(&r->wake);
+    free(r->workers);
+    r->workers = NULL;
+    r->nworkers = 0;
+    if (!ok) {
+        return 1;
+    }
+    int failed = 0;
+    for (int i = 0; i < r->njobs; i++) {
+        failed |= r->jobs[i].status;
+    }
+    return failed;
+}
+
+// Writes s as a JSON string, or as a CSV field quoted only when it needs to be
+static void batch_write_path(FILE* out, const char* s, int format) {
+    if (format == BATCH_CSV && !strpbrk(s, ",\"\r\n")) {
+        fputs(s, out);
+        return;
+    }
+    fputc('"', out);
+    for (; *s; s++) {
+        if (*s == '"') {
+            fputs(format == BATCH_JSON ? "\\\"" : "\"\"", out);
+        }
+        else if (format == BATCH_JSON && *s == '\\') {
+            fputs("\\\\", out);
+        }
+        else if (format == BATCH_JSON && (unsigned char)*s < 0x20) {
+            fprintf(out, "\\u%04x", (unsigned char)*s);
+        }
+        else {
+            fputc(*s, out);
+        }
+    }
+    fputc('"', out);
+}
+
+int write_batch(const batch_run* r, const char* path, int format) {
+    FILE* out = strcmp(path, "-") == 0 ? stdout : fopen(path, "w");
+    if (!out) {
+        printf("Error opening %s\n", path);
+        return 1;
+    }
+    const char* row = format == BATCH_JSON
+        ? ",\"s\":%d,\"E\":%d,\"b\":%d,\"policy\":\"%s\",\"write\":\"%s\",\"alloc\":\"%s\",\"status\":\"%s\","
+          "\"hits\":%llu,\"misses\":%llu,\"evictions\":%llu,\"dirty_evictions\":%llu,\"bytes_read\":%llu,"
+          "\"bytes_written\":%llu}"
+        : ",%d,%d,%d,%s,%s,%s,%s,%llu,%llu,%llu,%llu,%llu,%llu\n";
+    if (format == BATCH_JSON) {
+        fprintf(out, "[\n");
+    }
+    else {
+        fprintf(out, "trace,s,E,b,policy,write,alloc,status,hits,misses,evictions,dirty_evictions,bytes_read,bytes_written\n");
+    }
+    for (int i = 0; i < r->njobs; i++) {
+        const batch_job* job = &r->jobs[i];
+        const batch_config* cfg = &r->configs[job->config];
+        if (format == BATCH_JSON) {
+            fputs("{\"trace\":", out);
+        }
+        batch_write_path(out, r->traces[job->trace].path, format);
+        fprintf(out, row, cfg->s, cfg->E, cfg->b, policy_names[cfg->policy],
+                (cfg->write_policy & WRITE_BACK) ? "wb" : "wt", (cfg->write_policy & WRITE_ALLOCATE) ? "wa" : "nwa",
+                job->status ? "error" : "ok", (unsigned long long)job->stats.hits,
+                (unsigned long long)job->stats.misses, (unsigned long long)job->stats.evictions,
+                (unsigned long long)job->stats.dirty_evictions, (unsigned long long)job->stats.bytes_read,
+                (unsigned long long)job->stats.bytes_written);
+        if (format == BATCH_JSON) {
+            fprintf(out, i + 1 < r->njobs ? ",\n" : "\n");
+        }
+    }
+    if (format == BATCH_JSON) {
+        fprintf(out, "]\n");
+    }
+    int failed = out == stdout ? fflush(out) != 0 : fclose(out) != 0;
+    if (failed) {
+        printf("Error writing %s\n", path);
+    }
+    return failed;
+}
+
+/*
+Region maps
+    A region map labels address ranges, one "<start> <end> <label>" line each with hex
+    addresses and the end exclusive, and counts every block
+    access under the label of the range holding its first byte; accesses outside every range
+    count as REGION_UNMAPPED. Several ranges may share a label, which is how one named
+    allocation spread over many ranges gets a single line. Ranges are sorted by start and must
+    not overlap, so a lookup is a binary search for the last range starting at or below the
+    address. Trace accesses cluster, so the range of the previous lookup is tried first and
+    most accesses never search. Filters keep or drop labels before an access reaches the cache.
+*/
+static int region_label(region_map* m, const char* name) {
+    // Ranges are usually listed one allocation at a time, so the newest label is checked first
+    if (m->nlabels > 0 && strcmp(m->names[m->nlabels - 1], name) == 0) {
+        return m->nlabels - 1;
+    }
+    for (int i = 0; i < m->nlabels; i++) {
+        if (strcmp(m->names[i], name) == 0) {
+            return i;
+        }
+    }
+    if (m->nlabels == m->names_cap) {
+        int cap = m->names_cap ? 2 * m->names_cap : 16;
+        char** grown = (char**)realloc(m->names, (size_t)cap * sizeof(char*));
+        if (!grown) {
+            return -1;
+        }
+        m->names = grown;
+        m->names_cap = cap;
+    }
+    m->names[m->nlabels] = strdup(name);
+    return m->names[m->nlabels] ? m->nlabels++ : -1;
+}
+
+static int region_add(region_map* m, uint64_t start, uint64_t end, int label) {
+    if (m->count == m->cap) {
+        int cap = m->cap ? 2 * m->cap : 64;
+        uint64_t* starts = (uint64_t*)realloc(m->starts, (size_t)cap * sizeof(uint64_t));
+        if (starts) {
+            m->starts = starts;
+        }
+        uint64_t* ends = (uint64_t*)realloc(m->ends, (size_t)cap * sizeof(uint64_t));
+        if (ends) {
+            m->ends = ends;
+        }
+        int* labels = (int*)realloc(m->labels, (size_t)cap * sizeof(int));
+        if (labels) {
+            m->labels = labels;
+        }
+        if (!starts || !ends || !labels) {
+            return 0;
+        }
+        m->cap = cap;
+    }
+    m->starts[m->count] = start;
+    m->ends[m->count] = end;
+    m->labels[m->count++] = label;
+    return 1;
+}
+
+// Sorts the ranges by start, carrying their ends and labels along
+static void region_sort(region_map* m) {
+    // Maps are usually written in address order already, anything else is heap sorted
+    int sorted = 1;
+    for (int i = 1; i < m->count && sorted; i++) {
+        sorted = m->starts[i - 1] <= m->starts[i];
+    }
+    if (sorted) {
+        return;
+    }
+    int n = m->count;
+    for (int root = n / 2 - 1, end = n; end > 1; ) {
+        int i;
+        if (root >= 0) {
+            i = root--;
+        }
+        else {
+            end--;
+            uint64_t ts = m->starts[0], te = m->ends[0];
+            int tl = m->labels[0];
+            m->starts[0] = m->starts[end], m->ends[0] = m->ends[end], m->labels[0] = m->labels[end];
+            m->starts[end] = ts, m->ends[end] = te, m->labels[end] = tl;
+            i = 0;
+        }
+        // Sift node i down within [0, end)
+        for (int child = 2 * i + 1; child < end; i = child, child = 2 * i + 1) {
+            if (child + 1 < end && m->starts[child + 1] > m->starts[child]) {
+                child++;
+            }
+            if (m->starts[i] >= m->starts[child]) {
+                break;
+            }
+            uint64_t ts = m->starts[i], te = m->ends[i];
+            int tl = m->labels[i];
+            m->starts[i] = m->starts[child], m->ends[i] = m->ends[child], m->labels[i] = m->labels[child];
+            m->starts[child] = ts, m->ends[child] = te, m->labels[child] = tl;
+        }
+    }
+}
+
+void freeregions(region_map* m) {
+    if (!m) {
+        return;
+    }
+    for (int i = 0; i < m->nlabels; i++) {
+        free(m->names[i]);
+    }
+    free(m->names);
+    free(m->starts);
+    free(m->ends);
+    free(m->labels);
+    free(m->keep);
+    free(m->counts);
+    free(m);
+}
+
+region_map* load_regions(const char* path) {
+    FILE* f = fopen(path, "r");
+    if (!f) {
+        printf("Error opening region map %s\n", path);
+        return NULL;
+    }
+    region_map* m = (region_map*)calloc(1, sizeof(region_map));
+    if (!m) {
+        fclose(f);
+        return NULL;
+    }
+    int ok = region_label(m, REGION_UNMAPPED) == 0;
+
+    char line[REGION_LINE_MAX];
+    int lineno = 0;
+    while (ok && fgets(line, sizeof(line), f)) {
+        lineno++;
+        char* tokens[4];
+        int n = split_tokens(line, tokens, 4);
+        if (n == 0) {
+            continue;
+        }
+        char* start_end = NULL;
+        char* end_end = NULL;
+        uint64_t start = n == 3 ? strtoull(tokens[0], &start_end, 16) : 0;
+        uint64_t end = n == 3 ? strtoull(tokens[1], &end_end, 16) : 0;
+        if (n != 3 || *start_end != '\0' || *end_end != '\0' || end <= start) {
+            printf("%s:%d: expected <start> <end> <label> with hex addresses and start below end\n", path, lineno);
+            ok = 0;
+            break;
+        }
+        if (strcmp(tokens[2], REGION_UNMAPPED) == 0) {
+            printf("%s:%d: %s is the label of addresses outside every range\n", path, lineno, REGION_UNMAPPED);
+            ok = 0;
+            break;
+        }
+        int label = region_label(m, tokens[2]);
+        if (label < 0 || !region_add(m, start, end, label)) {
+            printf("Error allocating the region map\n");
+            ok = 0;
+        }
+    }
+    fclose(f);
+
+    if (ok) {
+        region_sort(m);
+        for (int i = 1; i < m->count && ok; i++) {
+            if (m->starts[i] < m->ends[i - 1]) {
+                printf("%s: ranges %s and %s overlap at %llx\n", path, m->names[m->labels[i - 1]],
+                       m->names[m->labels[i]], (unsigned long long)m->starts[i]);
+                ok = 0;
+            }
+        }
+    }
+    if (ok) {
+        m->keep = (unsigned char*)malloc((size_t)m->nlabels);
+        m->counts = (set_counts*)calloc((size_t)m->nlabels, sizeof(set_counts));
+        ok = m->keep && m->counts;
+        if (!ok) {
+            printf("Error allocating the region map\n");
+        }
+    }
+    if (!ok) {
+        freeregions(m);
+        return NULL;
+    }
+    memset(m->keep, 1, (size_t)m->nlabels);
+    m->last = -1;
+    return m;
+}
+
+int region_filter(region_map* m, const char* labels, int include) {
+    char* copy = strdup(labels);
+    if (!copy) {
+        return 1;
+    }
+    // Including starts from nothing kept, excluding from what earlier filters kept
+    unsigned char* keep = (unsigned char*)malloc((size_t)m->nlabels);
+    if (!keep) {
+        free(copy);
+        return 1;
+    }
+    for (int i = 0; i < m->nlabels; i++) {
+        keep[i] = include ? 0 : m->keep[i];
+    }
+    int failed = 0;
+    for (char* tok = strtok(copy, ","); tok; tok = strtok(NULL, ",")) {
+        int label = -1;
+        for (int i = 0; i < m->nlabels && label < 0; i++) {
+            label = strcmp(m->names[i], tok) == 0 ? i : -1;
+        }
+        if (label < 0) {
+            printf("No region is labelled %s\n", tok);
+            failed = 1;
+            break;
+        }
+        keep[label] = include ? m->keep[label] : 0;
+    }
+    if (!failed) {
+        memcpy(m->keep, keep, (size_t)m->nlabels);
+    }
+    free(keep);
+    free(copy);
+    return failed;
+}
+
+// The label of the range holding address, 0 (REGION_UNMAPPED) when none does
+static inline int region_of(region_map* m, uint64_t address) {
+    int r = m->last;
+    if (r >= 0 && address >= m->starts[r] && address < m->ends[r]) {
+        return m->labels[r];
+    }
+    // Last range starting at or below the address
+    const uint64_t* base = m->starts;
+    int n = m->count;
+    if (n == 0 || address < base[0]) {
+        return 0;
+    }
+    while (n > 1) {
+        int half = n / 2;
+        base = base[half] <= address ? base + half : base;
+        n -= half;
+    }
+    r = (int)(base - m->starts);
+    if (address >= m->ends[r]) {
+        return 0;
+    }
+    m->last = r;
+    return m->labels[r];
+}
+
+void region_access(cache* c, region_map* m, unsigned long address, int write, unsigned long bytes, cache_stats* stats) {
+    int label = region_of(m, (uint64_t)address);
+    if (!m->keep[label]) {
+        m->filtered++;
+        return;
+    }
+    unsigned long evicted;
+    unsigned long cache_set = (address >> c->b) & ((1UL << c->s) - 1);
+    int result = kernels[c->kernel].lookup(c, address, write, &evicted, stats);
+    count_result(c, cache_set, write, bytes, result, stats, c->set_stats != NULL);
+    set_counts* counts = &m->counts[label];
+    counts->hits += result == CACHE_HIT;
+    counts->misses += result != CACHE_HIT;
+    counts->evictions += result == CACHE_EVICT;
+}
+
+void runsim_regions(cache* c, region_map* m, trace_reader* tracefile, cache_stats* stats) {
+    cache_batch* batch = cache_batch_new();
+    if (!batch) {
+        printf("Error allocating the trace batch\n");
+        return;
+    }
+    int n;
+    while ((n = cache_batch_fill(batch, tracefile, c->b)) > 0) {
+        for (int k = 0; k < n; k++) {
+            region_access(c, m, (unsigned long)batch->addr[k], batch->write[k], batch->bytes[k], stats);
+        }
+    }
+    free(batch);
+}
+
+void print_regions(const region_map* m) {
+    for (int i = 0; i < m->nlabels; i++) {
+        const set_counts* st = &m->counts[i];
+        uint64_t accesses = st->hits + st->misses;
+        // Filtered labels are left out, and so is REGION_UNMAPPED when nothing fell outside the ranges
+        if (!m->keep[i] || (i == 0 && accesses == 0)) {
+            continue;
+        }
+        printf("region %s hits:%llu misses:%llu evictions:%llu miss_rate:%.4f\n", m->names[i],
+               (unsigned long long)st->hits, (unsigned long long)st->misses, (unsigned long long)st->evictions,
+               accesses ? (double)st->misses / (double)accesses : 0.0);
+    }
+    if (m->filtered) {
+        printf("regions filtered:%llu\n", (unsigned long long)m->filtered);
+    }
+}
+
+/*
+Prefetchers
+    A prefetcher watches the demand block accesses of one cache and requests blocks it predicts
+    come next. Requests go into a fixed queue and are filled right after the demand access that
+    raised them, through the cache's own lookup kernel, without triggering the prefetcher
+    again. Blocks already cached are dropped without touching the replacement state. A
+    prefetched line is tagged with the demand count it arrived at: the first demand hit on it
+    is useful, or late if fewer than latency demand accesses have passed, and evicting it
+    unused makes it useless. Blocks a prefetch fill evicts are remembered in a direct-mapped
+    table (one slot per line, collisions forget), and a later demand miss on one of them is a
+    polluting prefetch. Prefetch fills move data, so their traffic is in the run's cache_stats;
+    demand hits, misses and evictions are counted as without a prefetcher
+*/
+static const char* prefetcher_names[] = {"none", "next", "stride", "stream"};
+
+int parse_prefetcher(const char* name) {
+    for (int i = 0; i < PREFETCH_COUNT; i++) {
+        if (strcmp(name, prefetcher_names[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+prefetcher* makeprefetcher(const cache* c, int kind, int degree, int latency) {
+    if (kind < 0 || kind >= PREFETCH_COUNT || degree < 1 || degree > PF_MAX_DEGREE || latency < 0) {
+        printf("The prefetch degree must be 1 to %d\n", PF_MAX_DEGREE);
+        return NULL;
+    }
+    prefetcher* p = (prefetcher*)calloc(1, sizeof(prefetcher));
+    size_t lines = (size_t)c->S * (size_t)c->E;
+    size_t slots = 1;
+    while (slots < lines) {
+        slots <<= 1;
+    }
+    if (p) {
+        p->issued = (uint64_t*)calloc(lines, sizeof(uint64_t));
+        p->evicted = (uint64_t*)calloc(slots, sizeof(uint64_t));
+    }
+    if (!p || !p->issued || !p->evicted) {
+        printf("Error allocating prefetcher state\n");
+        freeprefetcher(p);
+        return NULL;
+    }
+    p->kind = kind;
+    p->degree = degree;
+    p->latency = (uint64_t)latency;
+    p->evicted_mask = slots - 1;
+    return p;
+}
+
+void freeprefetcher(prefetcher* p) {
+    if (p) {
+        free(p->issued);
+        free(p->evicted);
+    }
+    free(p);
+}
+
+// Queues block + k * step for k = 1..degree, stopping where the block number would wrap
+static void pf_queue_run(prefetcher* p, uint64_t block, int64_t step) {
+    for (int k = 1; k <= p->degree; k++) {
+        uint64_t next = block + (uint64_t)(step * k);
+        if ((step > 0) != (next > block)) {
+            break;
+        }
+        p->queue[p->queued++] = next;
+    }
+}
+
+static void pf_train_stride(prefetcher* p, uint64_t block, int b) {
+    uint64_t region = (block << b) >> PF_REGION_BITS;
+    pf_region* r = &p->regions[block_hash(region) % PF_REGIONS];
+    if (r->region != region + 1) {
+        r->region = region + 1;
+        r->last = block;
+        r->stride = 0;
+        r->confidence = 0;
+        return;
+    }
+    int64_t stride = (int64_t)(block - r->last);
+    if (stride == 0) {
+        return;  // Another access to the same block says nothing about the stride
+    }
+    if (stride == r->stride) {
+        r->confidence += r->confidence < 3;
+    }
+    else {
+        r->stride = stride;
+        r->confidence = 0;
+    }
+    r->last = block;
+    if (r->confidence >= PF_STRIDE_CONFIDENCE) {
+        pf_queue_run(p, block, stride);
+    }
+}
+
+static void pf_train_stream(prefetcher* p, uint64_t block) {
+    pf_stream* match = NULL;
+    pf_stream* victim = &p->streams[0];
+    p->triggers++;
+    for (int i = 0; i < PF_STREAMS && !match; i++) {
+        pf_stream* st = &p->streams[i];
+        if (!st->valid) {
+            victim = st;
+            continue;
+        }
+        int64_t d = (int64_t)(block - st->last);
+        if (st->dir == 0 ? d != 0 && d >= -PF_STREAM_WINDOW && d <= PF_STREAM_WINDOW
+                         : d * st->dir > 0 && d * st->dir <= PF_STREAM_WINDOW) {
+            match = st;
+        }
+        else if (victim->valid && st->used < victim->used) {
+            victim = st;
+        }
+    }
+    if (!match) {
+        victim->valid = 1;
+        victim->last = block;
+        victim->dir = 0;
+        victim->used = p->triggers;
+        return;
+    }
+
+    // The second miss fixes the direction, after that the stream runs degree blocks ahead
+    if (match->dir == 0) {
+        match->dir = block > match->last ? 1 : -1;
+        match->head = block;
+    }
+    match->last = block;
+    match->used = p->triggers;
+    if ((int64_t)(match->head - block) * match->dir <= 0) {
+        match->head = block + (uint64_t)(int64_t)match->dir;
+    }
+    while (p->queued < p->degree && (int64_t)(match->head - block) * match->dir <= p->degree) {
+        if ((match->dir > 0) != (match->head > block)) {
+            break;  // Wrapped past either end of the address space
+        }
+        p->queue[p->queued++] = match->head;
+        match->head += (uint64_t)(int64_t)match->dir;
+    }
+}
+
+// Index of a cached block's line in issued, -1 if the block is not cached
+static inline long pf_line(const cache* c, unsigned long address) {
+    unsigned long cache_set;
+    int way = cache_find(c, address, &cache_set);
+    return way < 0 ? -1 : (long)(cache_set * (unsigned long)c->E + (unsigned long)way);
+}
+
+// Takes over the line a fill just used; a prefetch tag still on it belonged to a line that left unused
+static void pf_fill(prefetcher* p, long line, uint64_t tag) {
+    if (p->issued[line]) {
+        p->stats.useless++;
+        p->outstanding--;
+    }
+    p->issued[line] = tag;
+    p->outstanding += tag != 0;
+}
+
+static void pf_issue(cache* c, prefetcher* p, cache_stats* stats) {
+    for (int i = 0; i < p->queued; i++) {
+        unsigned long address = (unsigned long)(p->queue[i] << c->b);
+        p->stats.issued++;
+        if (pf_line(c, address) >= 0) {
+            p->stats.redundant++;
+            continue;
+        }
+        unsigned long evicted;
+        int result = cache_lookup(c, address, 0, &evicted, stats);
+        p->stats.fills++;
+        uint64_t* slot = &p->evicted[block_hash(p->queue[i]) & p->evicted_mask];
+        if (*slot == p->queue[i] + 1) {
+            *slot = 0;  // Back in before anyone missed on it
+        }
+        if (result == CACHE_EVICT) {
+            p->stats.evictions++;
+            uint64_t victim = (uint64_t)evicted >> c->b;
+            p->evicted[block_hash(victim) & p->evicted_mask] = victim + 1;
+        }
+        pf_fill(p, pf_line(c, address), p->now + 1);
+    }
+    p->queued = 0;
+}
+
+void prefetch_access(cache* c, prefetcher* p, unsigned long address, int write, unsigned long bytes, cache_stats* stats) {
+    uint64_t block = (uint64_t)address >> c->b;
+    p->now++;
+
+    // A demand hit on a line a prefetch brought in is that prefetch's first use
+    int prefetched = 0;
+    if (p->outstanding) {
+        long line = pf_line(c, address);
+        if (line >= 0 && p->issued[line]) {
+            uint64_t age = p->now - p->issued[line];
+            if (age < p->latency) {
+                p->stats.late++;
+            }
+            else {
+                p->stats.useful++;
+            }
+            p->issued[line] = 0;
+            p->outstanding--;
+            prefetched = 1;
+        }
+    }
+
+    unsigned long evicted;
+    unsigned long cache_set = (address >> c->b) & ((1UL << c->s) - 1);
+    int result = cache_lookup(c, address, write, &evicted, stats);
+    count_result(c, cache_set, write, bytes, result, stats, c->set_stats != NULL);
+    if (result != CACHE_HIT) {
+        uint64_t* slot = &p->evicted[block_hash(block) & p->evicted_mask];
+        if (*slot == block + 1) {
+            p->stats.polluting++;
+            *slot = 0;
+        }
+        // No-write-allocate store misses leave nothing behind to tag
+        long line = pf_line(c, address);
+        if (line >= 0) {
+            pf_fill(p, line, 0);
+        }
+    }
+
+    // Next-line and stream train on misses and first hits on prefetched lines, stride on everything
+    int trigger = result != CACHE_HIT || prefetched;
+    if (p->kind == PREFETCH_NEXT_LINE && trigger) {
+        pf_queue_run(p, block, 1);
+    }
+    else if (p->kind == PREFETCH_STRIDE) {
+        pf_train_stride(p, block, c->b);
+    }
+    else if (p->kind == PREFETCH_STREAM && trigger) {
+        pf_train_stream(p, block);
+    }
+    if (p->queued) {
+        pf_issue(c, p, stats);
+    }
+}
+
+void runsim_prefetch(cache* c, prefetcher* p, trace_reader* tracefile, cache_stats* stats) {
+    cache_batch* batch = cache_batch_new();
+    if (!batch) {
+        printf("Error allocating the trace batch\n");
+        return;
+    }
+    int n;
+    while ((n = cache_batch_fill(batch, tracefile, c->b)) > 0) {
+        for (int k = 0; k < n; k++) {
+            prefetch_access(c, p, (unsigned long)batch->addr[k], batch->write[k], batch->bytes[k], stats);
+        }
+    }
+    free(batch);
+}
+
+void print_prefetch(const prefetcher* p, const cache_stats* stats) {
+    const prefetch_stats* ps = &p->stats;
+    uint64_t used = ps->useful + ps->late;
+    printf("prefetch %s issued:%llu redundant:%llu fills:%llu evictions:%llu\n", prefetcher_names[p->kind],
+           (unsigned long long)ps->issued, (unsigned long long)ps->redundant, (unsigned long long)ps->fills,
+           (unsigned long long)ps->evictions);
+    printf("prefetch useful:%llu late:%llu useless:%llu polluting:%llu\n", (unsigned long long)ps->useful,
+           (unsigned long long)ps->late, (unsigned long long)ps->useless, (unsigned long long)ps->polluting);
+    // Accuracy is the share of fills a demand access used, coverage the share of would-be misses they removed
+    printf("prefetch accuracy:%.4f coverage:%.4f\n", ps->fills ? (double)used / (double)ps->fills : 0.0,
+           used + stats->misses ? (double)used / (double)(used + stats->misses) : 0.0);
+}
+
+/*
+Miss classification
+    Every access also goes to a shadow fully-associative LRU cache with as many lines as the
+    classified one, and into the set of blocks accessed so far. A miss on a block never accessed
+    before is compulsory, a miss the shadow cache also takes is capacity, and a miss the shadow
+    cache hits is conflict. The shadow cache is a hash map from block to node and a doubly-linked
+    LRU list of nodes threaded through index arrays, so each access is O(1); nodes are allocated
+    once for the full capacity. The optional victim cache catches the lines the cache evicts.
+    Dirty victims are written back on their way in, as without a victim cache, so it only holds
+    clean lines. A miss that finds its block there takes it back instead of reading the next
+    level; the fill still happens in the cache, so the miss still counts there
+*/
+static void block_map_erase(block_map* m, size_t i) {
+    // Backward shift deletion: pull later entries of the probe run into the gap
+    size_t j = i;
+    for (;;) {
+        j = (j + 1) & m->mask;
+        if (m->keys[j] == 0) {
+            break;
+        }
+        size_t home = (size_t)block_hash(m->keys[j] - 1) & m->mask;
+        int stays = i <= j ? i < home && home <= j : i < home || home <= j;
+        if (!stays) {
+            m->keys[i] = m->keys[j];
+            m->slots[i] = m->slots[j];
+            i = j;
+        }
+    }
+    m->keys[i] = 0;
+    m->count--;
+}
+
+classifier* makeclassifier(const cache* c, int victim_entries) {
+    uint64_t lines = (uint64_t)c->S * (uint64_t)c->E;
+    if (victim_entries < 0 || victim_entries > VICTIM_MAX_ENTRIES || lines >= UINT32_MAX / 2) {
+        printf("Victim caches hold up to %d lines\n", VICTIM_MAX_ENTRIES);
+        return NULL;
+    }
+    size_t slots = CLASSIFY_SEEN_INIT;
+    while (slots < 2 * lines) {
+        slots <<= 1;
+    }
+    classifier* k = (classifier*)calloc(1, sizeof(classifier));
+    if (k) {
+        k->shadow_map.keys = (uint64_t*)calloc(slots, sizeof(uint64_t));
+        k->shadow_map.slots = (uint32_t*)malloc(slots * sizeof(uint32_t));
+        k->shadow_map.mask = slots - 1;
+        k->shadow_block = (uint64_t*)malloc((size_t)lines * sizeof(uint64_t));
+        k->prev = (uint32_t*)malloc((size_t)lines * sizeof(uint32_t));
+        k->next = (uint32_t*)malloc((size_t)lines * sizeof(uint32_t));
+        k->seen = (uint64_t*)calloc(CLASSIFY_SEEN_INIT, sizeof(uint64_t));
+        k->seen_mask = CLASSIFY_SEEN_INIT - 1;
+    }
+    if (!k || !k->shadow_map.keys || !k->shadow_map.slots || !k->shadow_block || !k->prev || !k->next || !k->seen) {
+        printf("Error allocating miss classification state\n");
+        freeclassifier(k);
+        return NULL;
+    }
+    k->head = k->tail = UINT32_MAX;
+    k->capacity = (uint32_t)lines;
+    k->victim_entries = victim_entries;
+    return k;
+}
+
+void freeclassifier(classifier* k) {
+    if (k) {
+        free(k->shadow_map.keys);
+        free(k->shadow_map.slots);
+        free(k->shadow_block);
+        free(k->prev);
+        free(k->next);
+        free(k->seen);
+    }
+    free(k);
+}
+
+static inline void shadow_unlink(classifier* k, uint32_t n) {
+    if (k->prev[n] != UINT32_MAX) k->next[k->prev[n]] = k->next[n]; else k->head = k->next[n];
+    if (k->next[n] != UINT32_MAX) k->prev[k->next[n]] = k->prev[n]; else k->tail = k->prev[n];
+}
+
+static inline void shadow_push(classifier* k, uint32_t n) {
+    k->prev[n] = UINT32_MAX;
+    k->next[n] = k->head;
+    if (k->head != UINT32_MAX) k->prev[k->head] = n; else k->tail = n;
+    k->head = n;
+}
+
+// Accesses the shadow cache, returns 1 on a hit. allocate is 0 for no-write-allocate store misses
+static int shadow_access(classifier* k, uint64_t block, int allocate) {
+    block_map* m = &k->shadow_map;
+    size_t i = block_map_find(m, block);
+    if (m->keys[i]) {
+        uint32_t n = m->slots[i];
+        if (k->head != n) {
+            shadow_unlink(k, n);
+            shadow_push(k, n);
+        }
+        return 1;
+    }
+    if (!allocate) {
+        return 0;
+    }
+    uint32_t n;
+    if (k->lines < k->capacity) {
+        n = k->lines++;
+    }
+    else {
+        // Reuse the LRU node; its entry leaves the map first, which may shift the probe run
+        n = k->tail;
+        shadow_unlink(k, n);
+        block_map_erase(m, block_map_find(m, k->shadow_block[n]));
+        i = block_map_find(m, block);
+    }
+    k->shadow_block[n] = block;
+    m->keys[i] = block + 1;
+    m->slots[i] = n;
+    m->count++;
+    shadow_push(k, n);
+    return 0;
+}
+
+// Records a block as accessed, returns 1 if this is its first access
+static int seen_insert(classifier* k, uint64_t block) {
+    size_t i = (size_t)block_hash(block) & k->seen_mask;
+    while (k->seen[i] != 0 && k->seen[i] != block + 1) {
+        i = (i + 1) & k->seen_mask;
+    }
+    if (k->seen[i]) {
+        return 0;
+    }
+    k->seen[i] = block + 1;
+    if (++k->seen_count * 2 > k->seen_mask + 1 && !k->failed) {
+        size_t cap = 2 * (k->seen_mask + 1);
+        uint64_t* grown = (uint64_t*)calloc(cap, sizeof(uint64_t));
+        if (!grown) {
+            k->failed = 1;
+            return 1;
+        }
+        for (size_t j = 0; j <= k->seen_mask; j++) {
+            if (k->seen[j]) {
+                size_t t = (size_t)block_hash(k->seen[j] - 1) & (cap - 1);
+                while (grown[t]) {
+                    t = (t + 1) & (cap - 1);
+                }
+                grown[t] = k->seen[j];
+            }
+        }
+        free(k->seen);
+        k->seen = grown;
+        k->seen_mask = cap - 1;
+    }
+    return 1;
+}
+
+void classify_access(cache* c, classifier* k, unsigned long address, int write, unsigned long bytes, cache_stats* stats) {
+    uint64_t block = (uint64_t)address >> c->b;
+    int allocate = !write || (c->write_policy & WRITE_ALLOCATE);
+    int shadow_hit = shadow_access(k, block, allocate);
+    int first = k->failed ? 0 : seen_insert(k, block);
+
+    unsigned long evicted;
+    unsigned long cache_set = (address >> c->b) & ((1UL << c->s) - 1);
+    int result = cache_lookup(c, address, write, &evicted, stats);
+    count_result(c, cache_set, write, bytes, result, stats, c->set_stats != NULL);
+    if (result == CACHE_HIT) {
+        return;
+    }
+    if (first) {
+        k->stats.compulsory++;
+    }
+    else if (!shadow_hit) {
+        k->stats.capacity++;
+    }
+    else {
+        k->stats.conflict++;
+    }
+    if (k->victim_entries == 0 || !allocate) {
+        return;
+    }
+
+    // The filled block may come out of the victim cache, the evicted one goes in
+    for (int i = 0; i < k->victim_entries; i++) {
+        if (k->victim[i] == block + 1) {
+            k->victim[i] = 0;
+            k->stats.victim_hits++;
+            stats->bytes_read -= 1ULL << c->b;
+            break;
+        }
+    }
+    if (result == CACHE_EVICT) {
+        int slot = 0;
+        for (int i = 0; i < k->victim_entries; i++) {
+            if (k->victim[i] == 0) {
+                slot = i;
+                break;
+            }
+            if (k->victim_used[i] < k->victim_used[slot]) {
+                slot = i;
+            }
+        }
+        k->stats.victim_evictions += k->victim[slot] != 0;
+        k->stats.victim_fills++;
+        k->victim[slot] = ((uint64_t)evicted >> c->b) + 1;
+        k->victim_used[slot] = ++k->clock;
+    }
+}
+
+int runsim_classify(cache* c, classifier* k, trace_reader* tracefile, cache_stats* stats) {
+    cache_batch* batch = cache_batch_new();
+    if (!batch) {
+        printf("Error allocating the trace batch\n");
+        return 1;
+    }
+    int n;
+    while ((n = cache_batch_fill(batch, tracefile, c->b)) > 0) {
+        for (int i = 0; i < n; i++) {
+            classify_access(c, k, (unsigned long)batch->addr[i], batch->write[i], batch->bytes[i], stats);
+        }
+    }
+    free(batch);
+    if (k->failed) {
+        printf("Error growing the first-touch set, compulsory misses are undercounted\n");
+        return 1;
+    }
+    return 0;
+}
+
+void print_classify(const classifier* k) {
+    printf("misses compulsory:%llu capacity:%llu conflict:%llu\n", (unsigned long long)k->stats.compulsory,
+           (unsigned long long)k->stats.capacity, (unsigned long long)k->stats.conflict);
+    if (k->victim_entries) {
+        printf("victim lines:%d hits:%llu fills:%llu evictions:%llu\n", k->victim_entries,
+               (unsigned long long)k->stats.victim_hits, (unsigned long long)k->stats.victim_fills,
+               (unsigned long long)k->stats.victim_evictions);
+    }
+}